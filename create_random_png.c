@@ -1,12 +1,122 @@
+/* Generatore di dati di test.
+ * Senza opzioni crea un PNG 250x250 con pixel casuali (come prima), con
+ * "--data" invece genera in streaming un dataset deterministico a partire da
+ * un seed, così le prestazioni di encoder e decoder si possono misurare in
+ * modo riproducibile su qualsiasi macchina e con diversi livelli di
+ * comprimibilità. I dati vengono prodotti un blocco alla volta, quindi la
+ * dimensione può arrivare a centinaia di GB senza tenere nulla in memoria.
+ *
+ * Uso: create_random_png <output PNG>
+ *      create_random_png --data <profilo> <dimensione> <seed> <output|->
+ *
+ * La dimensione accetta i suffissi K, M, G, T (potenze di 1024).
+ */
+
+#include <ctype.h>
+#include <errno.h>
 #include <png.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+// Dimensione del buffer con cui si scrive l'output
+#define GENERATOR_BUFFER_SIZE (1 << 20)
+// Profilo "float": periodo del segnale in campioni (circa 2π / 0.001) e
+// ampiezza. I valori sono in punto fisso con FLOAT_FRACTION_BITS bit dopo la
+// virgola, così restano sotto i 24 bit della mantissa e la conversione in
+// float è esatta su ogni piattaforma.
+#define FLOAT_PERIOD 6284
+#define FLOAT_AMPLITUDE 1000
+#define FLOAT_FRACTION_BITS 12
+// Granularità dei profili "sparse" e "repeat"
+#define GENERATOR_BLOCK_SIZE 4096
+// Nel profilo "sparse" un blocco su SPARSE_DATA_RATIO contiene dati
+#define SPARSE_DATA_RATIO 16
+// Numero di blocchi distinti che il profilo "repeat" continua a ripetere,
+// in totale stanno dentro la finestra di 32 KB di deflate
+#define REPEAT_POOL_BLOCKS 4
+#define LOG_LINE_MAX_LENGTH 256
+
+#define ERROR_GENERATOR_ARGS 2
+#define ERROR_GENERATOR_OUTPUT 3
+
 int width = 250;               // Larghezza dell'immagine
 int height = 250;               // Altezza dell'immagine
 png_bytep *row_pointers = NULL; // Puntatore per le righe dell'immagine
 
+enum PROFILE {
+  PROFILE_RANDOM, // incomprimibile
+  PROFILE_ZEROS,  // comprimibile al massimo
+  PROFILE_SPARSE, // blocchi di zeri con qualche blocco casuale
+  PROFILE_TEXT,   // righe di log
+  PROFILE_FLOAT,  // array di float32 (segnale con rumore)
+  PROFILE_REPEAT  // pochi blocchi casuali ripetuti
+} typedef profile_t;
+
+// Nomi dei profili, nello stesso ordine dell'enum
+static const char *profile_names[] = {"random", "zeros", "sparse",
+                                      "text",   "float", "repeat"};
+
+// Stato del generatore pseudo-casuale xoshiro256**: veloce, con un periodo
+// enorme e soprattutto identico su ogni piattaforma, a differenza di rand()
+uint64_t rng_state[4];
+
+static inline uint64_t rotl(const uint64_t x, const int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+uint64_t rng_next(void) {
+  const uint64_t result = rotl(rng_state[1] * 5, 7) * 9;
+  const uint64_t t = rng_state[1] << 17;
+
+  rng_state[2] ^= rng_state[0];
+  rng_state[3] ^= rng_state[1];
+  rng_state[1] ^= rng_state[2];
+  rng_state[0] ^= rng_state[3];
+  rng_state[2] ^= t;
+  rng_state[3] = rotl(rng_state[3], 45);
+
+  return result;
+}
+
+// Inizializza lo stato con splitmix64, come consigliato dagli autori di
+// xoshiro, così anche seed "brutti" (es. 0) danno uno stato ben distribuito
+void rng_seed(uint64_t seed) {
+  for (int i = 0; i < 4; i++) {
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    rng_state[i] = z ^ (z >> 31);
+  }
+}
+
+// Riempie il buffer con bytes casuali, 8 alla volta. Ogni numero viene
+// scritto in little endian, così l'output non dipende dalla CPU.
+void fill_random(uint8_t *buffer, const size_t length) {
+  for (size_t i = 0; i < length; i += 8) {
+    const uint64_t value = rng_next();
+    for (size_t j = 0; j < 8 && i + j < length; j++)
+      buffer[i + j] = (uint8_t)(value >> (8 * j));
+  }
+}
+
+// Campione 'index' del profilo "float": un'onda fatta di archi di parabola
+// (vicina a una sinusoide) più un rumore in [0, 1). Tutto è calcolato con gli
+// interi, senza sin() il cui arrotondamento cambia tra le libm.
+float float_sample(const uint64_t index) {
+  const int64_t half = FLOAT_PERIOD / 2;
+  const int64_t phase = (int64_t)(index % FLOAT_PERIOD);
+  const int64_t x = phase < half ? phase : phase - half;
+  int64_t value = 4 * ((int64_t)FLOAT_AMPLITUDE << FLOAT_FRACTION_BITS) * x *
+                  (half - x) / (half * half);
+  if (phase >= half)
+    value = -value;
+  value += (int64_t)(rng_next() >> (64 - FLOAT_FRACTION_BITS));
+  return (float)value / (float)(1 << FLOAT_FRACTION_BITS);
+}
+
 // Funzione per scrivere un file PNG
 void write_png_file(char *filename) {
   FILE *fp = fopen(filename, "wb");
@@ -64,10 +174,289 @@ void create_random_image() {
   }
 }
 
+// Legge un numero decimale senza segno all'inizio di 'str', esce se non c'è
+// o se non sta in 64 bit. In 'end' resta il primo carattere dopo il numero.
+uint64_t parse_number(const char *str, char **end, const char *what) {
+  // strtoull() accetterebbe anche spazi e segno meno
+  if (!isdigit((unsigned char)str[0])) {
+    printf("%s non valido: %s\n", what, str);
+    exit(ERROR_GENERATOR_ARGS);
+  }
+  errno = 0;
+  const uint64_t value = strtoull(str, end, 10);
+  if (errno == ERANGE) {
+    printf("%s troppo grande: %s\n", what, str);
+    exit(ERROR_GENERATOR_ARGS);
+  }
+  return value;
+}
+
+// Converte una dimensione tipo "512M" o "100G" in bytes
+uint64_t parse_size(const char *str) {
+  char *end = NULL;
+  const uint64_t size = parse_number(str, &end, "Dimensione");
+
+  int shift;
+  switch (*end) {
+  case 'T':
+  case 't':
+    shift = 40;
+    break;
+  case 'G':
+  case 'g':
+    shift = 30;
+    break;
+  case 'M':
+  case 'm':
+    shift = 20;
+    break;
+  case 'K':
+  case 'k':
+    shift = 10;
+    break;
+  case '\0':
+    return size;
+  default:
+    printf("Suffisso non valido: %s\n", end);
+    exit(ERROR_GENERATOR_ARGS);
+  }
+  // dopo il suffisso non ci deve essere altro ("512MB" non è valido)
+  if (end[1] != '\0') {
+    printf("Suffisso non valido: %s\n", end);
+    exit(ERROR_GENERATOR_ARGS);
+  }
+  if (size > (UINT64_MAX >> shift)) {
+    printf("Dimensione troppo grande: %s\n", str);
+    exit(ERROR_GENERATOR_ARGS);
+  }
+  return size << shift;
+}
+
+// Il seed deve essere un numero intero, senza altri caratteri
+uint64_t parse_seed(const char *str) {
+  char *end = NULL;
+  const uint64_t seed = parse_number(str, &end, "Seed");
+  if (*end != '\0') {
+    printf("Seed non valido: %s\n", str);
+    exit(ERROR_GENERATOR_ARGS);
+  }
+  return seed;
+}
+
+profile_t parse_profile(const char *name) {
+  for (size_t i = 0; i < sizeof(profile_names) / sizeof(profile_names[0]);
+       i++) {
+    if (strcmp(name, profile_names[i]) == 0)
+      return (profile_t)i;
+  }
+
+  printf("Profilo sconosciuto: %s (random, zeros, sparse, text, float, "
+         "repeat)\n",
+         name);
+  exit(ERROR_GENERATOR_ARGS);
+}
+
+// Stato dei profili che producono dati "a flusso", cioè che non ricominciano
+// da capo ad ogni buffer: righe di log spezzate tra due buffer, il segnale dei
+// float e il pool di blocchi ripetuti
+struct GENERATOR {
+  profile_t profile;
+  // bytes totali generati finora, decide anche in quale blocco siamo
+  uint64_t produced;
+
+  // profilo "text": riga corrente e quanti suoi bytes sono già stati emessi
+  char line[LOG_LINE_MAX_LENGTH];
+  int line_length, line_position;
+  uint64_t line_number;
+
+  // profilo "float": campione corrente del segnale
+  uint64_t sample;
+
+  // profilo "sparse" e "repeat": blocco corrente
+  uint8_t block[GENERATOR_BLOCK_SIZE];
+  uint8_t *repeat_pool;
+} typedef generator_t;
+
+// Crea la prossima riga di log, con campi che variano come nei log reali:
+// timestamp crescente, pochi livelli, pochi path e numeri casuali
+void next_log_line(generator_t *gen) {
+  static const char *levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN",
+                                 "ERROR"};
+  static const char *paths[] = {"/api/v1/users", "/api/v1/orders",
+                                "/api/v1/items", "/health", "/metrics"};
+
+  const uint64_t r = rng_next();
+  const uint64_t ms = gen->line_number * 7 + (r & 0x7);
+  gen->line_length = snprintf(
+      gen->line, LOG_LINE_MAX_LENGTH,
+      "2024-01-01T%02llu:%02llu:%02llu.%03llu %-5s [worker-%02llu] "
+      "request id=%016llx path=%s status=%llu latency_ms=%llu\n",
+      (unsigned long long)(ms / 3600000) % 24,
+      (unsigned long long)(ms / 60000) % 60,
+      (unsigned long long)(ms / 1000) % 60, (unsigned long long)ms % 1000,
+      levels[(r >> 3) % 6], (unsigned long long)(r >> 8) % 16,
+      (unsigned long long)rng_next(), paths[(r >> 12) % 5],
+      (unsigned long long)((r >> 16) % 8 == 0 ? 500 : 200),
+      (unsigned long long)(r >> 20) % 2000);
+  gen->line_position = 0;
+  gen->line_number++;
+}
+
+// Riempie il buffer con i prossimi 'length' bytes del profilo scelto
+void generate(generator_t *gen, uint8_t *buffer, const size_t length) {
+  size_t filled = 0;
+
+  switch (gen->profile) {
+  case PROFILE_RANDOM:
+    fill_random(buffer, length);
+    break;
+
+  case PROFILE_ZEROS:
+    memset(buffer, 0, length);
+    break;
+
+  case PROFILE_TEXT:
+    while (filled < length) {
+      if (gen->line_position == gen->line_length)
+        next_log_line(gen);
+      size_t n = gen->line_length - gen->line_position;
+      if (n > length - filled)
+        n = length - filled;
+      memcpy(&buffer[filled], &gen->line[gen->line_position], n);
+      gen->line_position += n;
+      filled += n;
+    }
+    break;
+
+  case PROFILE_FLOAT:
+    // I float vengono spezzati sui bordi del buffer come farebbe un file
+    // vero, per questo si lavora sul byte assoluto e non sul campione
+    while (filled < length) {
+      const uint64_t byte_offset = gen->produced + filled;
+      const float value = float_sample(byte_offset / sizeof(float));
+      // i bit del float (IEEE 754) scritti in little endian
+      uint32_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      const size_t start = byte_offset % sizeof(float);
+      size_t n = sizeof(float) - start;
+      if (n > length - filled)
+        n = length - filled;
+      for (size_t i = 0; i < n; i++)
+        buffer[filled + i] = (uint8_t)(bits >> (8 * (start + i)));
+      filled += n;
+    }
+    break;
+
+  case PROFILE_SPARSE:
+  case PROFILE_REPEAT:
+    while (filled < length) {
+      const uint64_t byte_offset = gen->produced + filled;
+      const size_t start = byte_offset % GENERATOR_BLOCK_SIZE;
+      // All'inizio di ogni blocco si decide il suo contenuto
+      if (start == 0) {
+        const uint64_t r = rng_next();
+        if (gen->profile == PROFILE_SPARSE) {
+          if (r % SPARSE_DATA_RATIO == 0)
+            fill_random(gen->block, GENERATOR_BLOCK_SIZE);
+          else
+            memset(gen->block, 0, GENERATOR_BLOCK_SIZE);
+        } else {
+          memcpy(gen->block,
+                 &gen->repeat_pool[(r % REPEAT_POOL_BLOCKS) *
+                                   GENERATOR_BLOCK_SIZE],
+                 GENERATOR_BLOCK_SIZE);
+        }
+      }
+      size_t n = GENERATOR_BLOCK_SIZE - start;
+      if (n > length - filled)
+        n = length - filled;
+      memcpy(&buffer[filled], &gen->block[start], n);
+      filled += n;
+    }
+    break;
+  }
+
+  gen->produced += length;
+}
+
+// Genera 'size' bytes del profilo scelto e li scrive su file (o su stdout con
+// "-"), stampando alla fine il throughput su stderr
+void generate_dataset(const profile_t profile, const uint64_t size,
+                      const uint64_t seed, const char *output_filename) {
+  FILE *fp = strcmp(output_filename, "-") == 0 ? stdout
+                                                : fopen(output_filename, "wb");
+  if (!fp) {
+    perror("Errore nell'apertura del file di output");
+    exit(ERROR_GENERATOR_OUTPUT);
+  }
+
+  rng_seed(seed);
+
+  generator_t *gen = (generator_t *)calloc(1, sizeof(generator_t));
+  uint8_t *buffer = (uint8_t *)malloc(GENERATOR_BUFFER_SIZE);
+  if (!gen || !buffer) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  gen->profile = profile;
+  if (profile == PROFILE_REPEAT) {
+    gen->repeat_pool =
+        (uint8_t *)malloc(REPEAT_POOL_BLOCKS * GENERATOR_BLOCK_SIZE);
+    if (!gen->repeat_pool) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+    fill_random(gen->repeat_pool, REPEAT_POOL_BLOCKS * GENERATOR_BLOCK_SIZE);
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  uint64_t remaining = size;
+  while (remaining > 0) {
+    const size_t length = remaining > GENERATOR_BUFFER_SIZE
+                              ? GENERATOR_BUFFER_SIZE
+                              : (size_t)remaining;
+    generate(gen, buffer, length);
+    if (fwrite(buffer, 1, length, fp) != length) {
+      perror("Errore nella scrittura dell'output");
+      exit(ERROR_GENERATOR_OUTPUT);
+    }
+    remaining -= length;
+  }
+
+  if (fp != stdout && fclose(fp) != 0) {
+    perror("Errore nella chiusura dell'output");
+    exit(ERROR_GENERATOR_OUTPUT);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  const double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "Generati %llu bytes (%s, seed %llu) in %.3f s, %.1f MB/s\n",
+          (unsigned long long)size, profile_names[profile],
+          (unsigned long long)seed, seconds,
+          seconds > 0 ? size / seconds / 1e6 : 0.0);
+
+  free(gen->repeat_pool);
+  free(gen);
+  free(buffer);
+}
+
 // Funzione principale
 int main(int argc, char *argv[]) {
+  if (argc == 6 && strcmp(argv[1], "--data") == 0) {
+    generate_dataset(parse_profile(argv[2]), parse_size(argv[3]),
+                     parse_seed(argv[4]), argv[5]);
+    return 0;
+  }
+
   if (argc != 2) {
     printf("Enter output filename\n");
+    printf("Usage: %s <output PNG>\n", argv[0]);
+    printf("       %s --data <random|zeros|sparse|text|float|repeat> <size> "
+           "<seed> <output|->\n",
+           argv[0]);
     exit(EXIT_FAILURE);
   }
 
@@ -1,8 +1,10 @@
-/* Per compilare aggiungere "-lpng" su linux
+/* Per compilare aggiungere "-lpng -lz -lm -pthread -lcrypto" su linux
  * Su MacOS bisogna dire dove si trovano gli header e le librerie, con
  * l'installazione delle librerie tramite homebrew quindi il comando diventa
  * così "clang example_libpng.c -o example -I/opt/homebrew/include
- * -L/opt/homebrew/lib -lpng -lz -lc"
+ * -L/opt/homebrew/lib -lpng -lz -lcrypto -lc"
+ * Su linux serve anche -D_GNU_SOURCE per SEEK_DATA, SCHED_IDLE e CPU_SET:
+ * "gcc -D_GNU_SOURCE main.c -o d2v -lpng -lz -lm -pthread -lcrypto"
  */
 
 /* Utilizzo i primi 4 byte di un immagine per definire in maniera precisa quando
@@ -24,25 +26,99 @@
  * definire il chunk finale.
  * Dopodichè utilizzo un numero variabile di byte per contenere i caratteri
  * dell'estensione del file che sto trasformando.
+ * Se il file contiene zone di zeri (buchi di un file sparse oppure, con
+ * --sparse, blocchi fatti solo di zeri) il bit più significativo del numero
+ * di chunks è a 1 e dopo l'estensione ci sono 8 byte con il numero di zone e
+ * 16 byte (offset e lunghezza) per ogni zona. Queste zone non finiscono nei
+ * pixel e in decodifica diventano buchi del file.
+ * Con --key i dati di ogni frame sono cifrati con AES-256-GCM (o
+ * ChaCha20-Poly1305 sulle CPU senza AES-NI): il secondo bit più significativo
+ * del numero di chunks è a 1, dopo l'eventuale tabella ci sono 1 byte con il
+ * cifrario e 12 byte con la base dei nonce, e gli ultimi 16 byte di ogni frame
+ * contengono il tag di autenticazione.
  */
 
+#include <ctype.h> // Include per isxdigit(), usato per leggere le chiavi in esadecimale
+#include <dirent.h> // Include per opendir() e readdir(), la modalità salvage legge una cartella di immagini
+#include <errno.h> // Include per errno e i codici di errore delle chiamate di sistema
 #include <fcntl.h> // Include per la gestione dei file (fornisce funzioni come open(), read(), write(), etc.)
 #include <ftw.h> // Include per funzioni che permettono di eseguire operazioni su file e directory come ftw() (file tree walk)
+#include <glob.h> // Include per glob(), espande i caratteri jolly nei percorsi (usato dalla modalità batch)
 #include <math.h> // Include per funzioni matematiche come pow(), sqrt(), sin(), cos(), etc.
+#include <poll.h> // Include per poll(), usato dalla modalità live per aspettare i dati con una scadenza
 #include <png.h> // Include per usare le funzioni della libreria libpng, utilizzata per la lettura e scrittura di file PNG
+#include <pthread.h> // Include per i thread POSIX, usati dal pool di worker che codifica i frame in parallelo
 #include <stdint.h> // Include per tipi di dati con dimensioni fisse (es. int8_t, uint16_t, etc.), utile per compatibilità a basso livello
 #include <stdio.h> // Include per funzioni di input/output come fopen(), fclose(), printf(), etc.
 #include <stdlib.h> // Include per funzioni di allocazione dinamica (malloc(), free()) e altre utility come exit()
 #include <string.h> // Include per funzioni di manipolazione delle stringhe come strlen(), strcpy(), memcmp(), etc.
+#include <stdarg.h> // Include per le funzioni con un numero variabile di argomenti (va_list)
+#include <signal.h> // Include per signal(), usato dal demone per ignorare SIGPIPE
+#include <sys/mman.h> // Include per mmap() e madvise(), i buffer dei frame usano le huge pages
+#include <sys/resource.h> // Include per setpriority(), la modalità QoS abbassa la priorità dei worker
+#include <sys/socket.h> // Include per i socket, usati dalla modalità demone
+#include <sys/stat.h> // Include per stat() e mkdir()
+#include <sys/statvfs.h> // Include per statvfs(), lo spazio libero delle cartelle di output
+#include <sys/un.h> // Include per gli indirizzi dei socket Unix (struct sockaddr_un)
+#include <time.h> // Include per time() e clock_gettime(), usato per misurare il throughput
 #include <unistd.h> // Include per funzioni di sistema POSIX come fork(), exec(), sleep(), close(), etc., comuni nei sistemi UNIX-like
+#include <zlib.h> // Include per le costanti dei livelli di compressione usati da libpng
+#include <openssl/evp.h> // Include per la cifratura autenticata dei frame (AES-GCM e ChaCha20-Poly1305)
+#include <openssl/rand.h> // Include per RAND_bytes(), genera la base dei nonce
 
+// Affinità dei thread per i nodi NUMA, solo su linux
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h> // ioprio_set() non ha un wrapper nella libc
+#if defined(CPU_SET)
+#define NUMA_AVAILABLE
+#endif
+#endif
+
+// Probe USDT (d2v:<fase>_start e d2v:<fase>_done) per perf e bpftrace: sono
+// delle nop finchè nessuno ci si attacca. Senza <sys/sdt.h> spariscono.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define USDT_AVAILABLE
+#endif
+#endif
+#ifdef USDT_AVAILABLE
+#define PROBE1(name, a) DTRACE_PROBE1(d2v, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(d2v, name, a, b)
+#else
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#endif
+
+// Intrinsics per la scansione degli zeri, SSE2 su x86 e NEON su ARM (Apple
+// Silicon), altrimenti si usa il ciclo normale
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Con -D_GNU_SOURCE features.h le ha già impostate (a valori più alti)
+#ifndef _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE 500L
+#endif
 
 #define ERROR_PNG_STRUCT_WRITE_CREATION 2
 #define ERROR_PNG_INFO_STRUCT_CREATION 3
 #define ERROR_PNG_WRITE_ELABORATION 4
 #define ERROR_ROWS_NOT_ALLOCATED 5
+#define ERROR_FRAME_COMMIT 6
+#define ERROR_JOURNAL 7
+#define ERROR_INPUT_READ 8
+#define ERROR_DECODE 9
+#define ERROR_DAEMON 10
+#define ERROR_LIVE 11
+#define ERROR_SYNC 12
+#define ERROR_AEAD 13
+#define ERROR_VERIFY 14
+#define ERROR_SALVAGE 15
 
 // Risoluzione di default = 4K (Ultra HD) in RGB -> 24 883 200 bytes
 #define WIDTH_DEFAULT 3840
@@ -53,9 +129,145 @@
 #define PNG_TOTAL_PIXELS (WIDTH_DEFAULT * HEIGHT_DEFAULT)
 #define PNG_TOTAL_BYTES (PNG_TOTAL_PIXELS * BYTES_PER_PIXEL)
 #define BUFFER_SIZE 4096
+// Blocchi con cui libpng scrive i frame nel file
+#define PNG_WRITE_BUFFER_SIZE (1 << 20)
 #define EXTENSION_MAX_LENGTH 64 // l'ultimo carattere è quello nullo '\0'
 #define HEADER_INFO_LENGTH 20
 
+// Suffisso dei file temporanei, rinominati solo quando sono completi
+#define TMP_SUFFIX ".tmp"
+// Il journal dei progressi si chiama "<base>.journal"
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_MAGIC "D2VJOURNAL1"
+// Con --stripe i frame sono divisi tra più cartelle e il manifest
+// "<base>.manifest" dice in quale cartella si trova ogni frame
+#define MANIFEST_SUFFIX ".manifest"
+#define MANIFEST_MAGIC "D2VMANIFEST1"
+// Alla fine della codifica l'albero di Merkle degli hash dei frame viene
+// salvato in "<base>.merkle", con un nodo per riga: il nodo i si trova con un
+// seek e --verify --frame controlla un frame leggendo solo log2(n) nodi
+#define MERKLE_SUFFIX ".merkle"
+#define MERKLE_MAGIC "D2VMERKLE1"
+#define HASH_LENGTH 32 // SHA-256
+#define MERKLE_LINE_LENGTH (2 * HASH_LENGTH + 1)
+// Frame compressi in attesa di essere scritti, per ogni cartella di output (il
+// profilo di --tune può sceglierne di più, fino a WRITER_QUEUE_MAX)
+#define WRITER_QUEUE_DEPTH 2
+#define WRITER_QUEUE_MAX 8
+// Nodi NUMA gestiti al massimo, e ogni quanti byte si tocca un buffer nuovo
+// per farlo allocare sul suo nodo (una pagina normale)
+#define NUMA_MAX_NODES 64
+#define NUMA_TOUCH_STRIDE 4096
+
+// Con --durability batch i frame scritti vengono sincronizzati su disco a
+// gruppi di --sync-every frame, oppure dopo SYNC_MAX_DELAY_MS se ne arrivano
+// pochi
+#define SYNC_EVERY_DEFAULT 16
+#define SYNC_MAX_DELAY_MS 200
+
+// Modalità QoS (--qos): ogni QOS_SAMPLE_MS si guarda il carico degli altri
+// processi (per CPU) e la latenza media delle letture e scritture. Se uno dei
+// due supera la soglia i limiti si dimezzano, altrimenti risalgono di
+// QOS_RECOVERY_STEP alla volta.
+#define QOS_SAMPLE_MS 500
+#define QOS_LOAD_DEFAULT 0.5
+#define QOS_LATENCY_DEFAULT_MS 20
+#define QOS_LATENCY_WEIGHT 0.05 // peso di ogni nuova misura nella media
+#define QOS_MIN_SCALE 0.05
+#define QOS_RECOVERY_STEP 0.1
+#define QOS_BURST_SECONDS 0.25 // credito massimo accumulabile dai limiti
+
+// Le zone di zeri non vengono messe nei frame ma salvate come estensioni
+// (offset, lunghezza) in una tabella subito dopo l'estensione del file, nel
+// primo frame. Il bit più alto di total_frames indica che la tabella c'è,
+// così i file senza zone di zeri hanno lo stesso header di prima.
+#define HEADER_FLAG_ZERO_EXTENTS (1ULL << 63)
+#define ZERO_EXTENT_LENGTH (2 * BYTES_INSIDE_INT64)
+// La tabella deve stare tutta nel primo frame
+#define ZERO_EXTENTS_MAX                                                       \
+  ((PNG_TOTAL_BYTES - HEADER_INFO_LENGTH - EXTENSION_MAX_LENGTH -              \
+    BYTES_INSIDE_INT64 - AEAD_HEADER_LENGTH - AEAD_TAG_LENGTH -                \
+    FRAME_TAG_LENGTH) /                                                        \
+   ZERO_EXTENT_LENGTH)
+// Con --sparse i dati vengono scansionati a blocchi di questa dimensione e i
+// blocchi fatti solo di zeri diventano estensioni
+#define ZERO_SCAN_BLOCK (64 * 1024)
+#define ZERO_SCAN_BUFFER (16 * ZERO_SCAN_BLOCK)
+
+// Cifratura autenticata (--key): il secondo bit più alto di total_frames
+// indica che i frame sono cifrati. L'header resta in chiaro ma è autenticato
+// insieme al frame 0, dopo l'eventuale tabella delle zone di zeri ci sono il
+// cifrario usato e la base dei nonce. Ogni frame perde gli ultimi
+// AEAD_TAG_LENGTH bytes, dove va il tag.
+#define HEADER_FLAG_AEAD (1ULL << 62)
+#define AEAD_KEY_LENGTH 32
+#define AEAD_NONCE_LENGTH 12
+#define AEAD_TAG_LENGTH 16
+#define AEAD_HEADER_LENGTH (1 + AEAD_NONCE_LENGTH)
+
+// Firma di ogni frame, nei primi bytes della prima riga: "D2VF", 8 byte con
+// l'identificativo dell'archivio, 8 con il numero del frame, 8 con il numero
+// di frame e il CRC32 dei bytes precedenti. Serve a riconoscere i frame anche
+// rinominati o mescolati (--salvage) leggendo solo la prima riga. Il terzo bit
+// più alto di total_frames indica che i frame hanno la firma, e allora
+// l'header del frame 0 inizia subito dopo.
+#define HEADER_FLAG_FRAME_TAGS (1ULL << 61)
+#define FRAME_TAG_MAGIC "D2VF"
+#define FRAME_TAG_LENGTH (4 + 3 * BYTES_INSIDE_INT64 + BYTES_INSIDE_INT32)
+
+// Modalità demone: lunghezza massima di una richiesta
+#define DAEMON_REQUEST_MAX_LENGTH (2 * PATH_MAX + 16)
+// Numero di latenze recenti tenute per calcolare i percentili (demone e live)
+#define LATENCY_SAMPLES 1024
+
+// Modalità live: ogni frame inizia con "D2VL", 8 byte con il numero di
+// sequenza e 4 byte con i bytes di dati contenuti, ed è alto solo le righe
+// che servono. Un frame viene scritto quando è pieno oppure quando il primo
+// byte ricevuto rischia di superare la latenza voluta.
+#define LIVE_MAGIC "D2VL"
+#define LIVE_HEADER_LENGTH (4 + BYTES_INSIDE_INT64 + BYTES_INSIDE_INT32)
+#define LIVE_FRAME_CAPACITY (PNG_TOTAL_BYTES - LIVE_HEADER_LENGTH)
+#define LIVE_TARGET_DEFAULT_MS 50
+// La scadenza di un frame è la latenza voluta meno il tempo stimato per
+// scriverlo, ma mai meno di questa frazione della latenza voluta
+#define LIVE_MIN_DEADLINE_FRACTION 0.1
+// Peso dell'ultimo frame nella stima del tempo di scrittura
+#define LIVE_ESTIMATE_WEIGHT 0.2
+#define LIVE_REPORT_SECONDS 10
+
+// --plan: quanti campioni leggere dall'input e quante righe per campione, i
+// campioni vengono compressi davvero con libpng per stimare dimensione e tempo
+#define PLAN_SAMPLES 16
+#define PLAN_SAMPLE_ROWS 32
+// poll() aspetta in millisecondi, quindi un frame viene scritto fino a un
+// millisecondo prima della sua scadenza invece che fino a uno dopo
+#define LIVE_POLL_RESOLUTION 0.001
+
+// --tune calibra l'encoder su questa macchina e salva un profilo, caricato
+// a ogni avvio, in "$HOME/.d2v_profile" (oppure nel file di --profile)
+#define PROFILE_FILENAME ".d2v_profile"
+#define PROFILE_MAGIC "D2VPROFILE1"
+// Fasce di entropia (bit/byte) dei frame, ognuna con il suo livello di
+// compressione nel profilo. L'entropia di un frame si stima su
+// ENTROPY_SAMPLES blocchi da ENTROPY_SAMPLE_BYTES presi a distanza regolare.
+#define ENTROPY_BANDS 3
+#define ENTROPY_LOW_MAX 3.0
+#define ENTROPY_HIGH_MIN 7.0
+#define ENTROPY_SAMPLES 16
+#define ENTROPY_SAMPLE_BYTES 4096
+// Righe dei campioni sintetici di --tune, durata minima di ogni misura e
+// frame scritti per misurare il disco
+#define TUNE_SAMPLE_ROWS 64
+#define TUNE_SECONDS 0.25
+#define TUNE_IO_FRAMES 4
+// File virtuale (--cat): tetto di default della cache dei frame decodificati,
+// frame decodificati in anticipo, letture consecutive che rendono l'accesso
+// sequenziale e blocchi con cui --cat scrive su stdout
+#define VFILE_CACHE_DEFAULT_MB 256
+#define VFILE_READAHEAD_FRAMES 4
+#define VFILE_SEQUENTIAL_READS 2
+#define VFILE_CAT_CHUNK (1024 * 1024)
+
 #define BYTES_INSIDE_INT64 8
 #define BYTES_INSIDE_INT32 4
 #define BYTES_INSIDE_INT16 2
@@ -77,12 +289,220 @@ struct HEADER_INFO {
   uint8_t last_channel_and_extension_length;
 } typedef header_info_t;
 
+// Progressi della codifica salvati su disco, servono per riprendere con
+// --resume una codifica interrotta
+struct JOURNAL_INFO {
+  uint64_t file_size, total_frames;
+  // numero di frame scritti per intero, cioè indice del prossimo frame
+  uint64_t completed_frames;
+  // posizione nel file di input da cui parte il prossimo frame
+  uint64_t input_offset;
+} typedef journal_info_t;
+
+// Zona del file originale fatta solo di zeri (un buco di un file sparse
+// oppure una lunga sequenza di zeri), non viene salvata nei frame.
+// 'payload_offset' è la posizione nei dati salvati in cui andrebbe la zona.
+struct ZERO_EXTENT {
+  uint64_t offset, length;
+  uint64_t payload_offset;
+} typedef zero_extent_t;
+
+// Disposizione dei dati salvati nei frame, calcolata con soli interi a 64 bit
+// così è esatta per qualsiasi dimensione del file
+struct LAYOUT {
+  uint64_t payload_size;  // bytes salvati nei frame, senza header
+  uint32_t header_length; // header, estensione e tabella delle zone di zeri
+  uint64_t total_frames;
+  // bytes usati nell'ultimo frame, da 1 a PNG_TOTAL_BYTES (header compreso
+  // se l'ultimo frame è anche il primo)
+  uint32_t bytes_last_frame;
+  uint64_t padding_bytes; // bytes di riempimento in fondo all'ultimo frame
+} typedef layout_t;
+
+// Come vengono scelte le cartelle dei frame con --stripe: a turno oppure
+// quella con più spazio libero
+enum STRIPE_POLICY { STRIPE_ROUND_ROBIN, STRIPE_FREE_SPACE } typedef
+    stripe_policy_t;
+
+// Frame divisi tra più cartelle di output, di solito su dischi diversi. Il
+// frame n si chiama "<root>/<nome base>_<n>.png" con root = roots[frame_root[n]]
+struct STRIPE {
+  uint32_t n_roots;
+  char **roots;
+  char **frame_bases; // "<root>/<nome base>" per ogni cartella
+  uint64_t total_frames;
+  uint32_t *frame_root;
+  // in codifica, un writer con la sua coda per ogni cartella
+  struct WRITER *writers;
+} typedef stripe_t;
+
+// Quanto deve essere sicuro su disco un frame prima di contare come scritto:
+// - DURABILITY_NONE: basta che sia stato rinominato, ci pensa il sistema
+// - DURABILITY_BATCH: un thread a parte sincronizza i frame a gruppi e solo
+//   dopo li segna come completati (e quindi li scrive nel journal)
+// - DURABILITY_STRICT: fsync del frame e della cartella prima della rinomina
+//   (il frame) e dopo (la cartella), direttamente nel worker
+enum DURABILITY { DURABILITY_NONE, DURABILITY_BATCH, DURABILITY_STRICT }
+typedef durability_t;
+
+enum JOB_TYPE { JOB_ENCODE, JOB_DECODE, JOB_LIVE, JOB_VERIFY } typedef
+    job_type_t;
+
+// Cifrario dei frame, il valore è quello salvato nell'header. Entrambi sono
+// AEAD con chiave da 256 bit, nonce da 96 bit e tag da 128 bit.
+enum AEAD_CIPHER {
+  AEAD_NONE,
+  AEAD_AES_256_GCM,
+  AEAD_CHACHA20_POLY1305
+} typedef aead_cipher_t;
+
+// Frame della modalità live che si sta riempiendo o che è in coda per essere
+// scritto
+struct LIVE_FRAME {
+  uint8_t *data;   // header live seguito dai dati ricevuti
+  uint32_t length; // bytes di dati ricevuti
+  uint8_t busy;    // in coda o in scrittura, non si può riempire
+  struct timespec first_arrival; // quando è arrivato il primo byte
+} typedef live_frame_t;
+
+// Un job è la codifica di un file nei suoi frame, oppure la decodifica dei
+// frame nel file originale, oppure un flusso live, oppure la verifica dei
+// frame con l'albero di Merkle
+struct JOB {
+  job_type_t type;
+  // file originale: input per la codifica, output per la decodifica
+  char *filename;
+  // se >= 0 si usa questo descriptor al posto di aprire 'filename' (ad
+  // esempio un file passato al demone tramite il socket)
+  int fd;
+  // base dei frame "<base>_<n>.png"
+  char *frames_base;
+  uint64_t file_size;
+  // bytes salvati davvero nei frame, cioè il file senza le zone di zeri
+  uint64_t payload_size;
+  uint8_t ext_length;
+  header_info_t header_info;
+  // header già formattato in bytes (con l'eventuale tabella delle zone di
+  // zeri), copiato all'inizio del frame 0
+  uint8_t *header;
+  uint32_t header_length;
+  zero_extent_t *zero_extents;
+  uint64_t n_zero_extents;
+  // bytes di dati che può contenere un frame (header e firma compresi), tolto
+  // il tag se i frame sono cifrati
+  uint32_t frame_capacity;
+  // bytes della firma all'inizio di ogni frame, 0 per gli archivi senza.
+  // L'identificativo dell'archivio è lo stesso in tutte le firme.
+  uint32_t tag_length;
+  uint64_t archive_id;
+  aead_cipher_t cipher;
+  // il nonce del frame n è questa base con n in xor negli ultimi 8 byte
+  uint8_t nonce_base[AEAD_NONCE_LENGTH];
+  // hash di ogni frame (foglie dell'albero di Merkle), calcolati dai worker
+  // in codifica e letti da "<base>.merkle" in verifica
+  uint8_t *leaf_hashes;
+  uint8_t *frame_corrupt; // verifica: un flag per ogni frame che non torna
+
+  // progressi, i frame possono essere completati in qualsiasi ordine
+  pthread_mutex_t lock;
+  pthread_cond_t done;       // segnalata quando tutti i frame sono finiti
+  uint8_t *frame_done;       // un flag per ogni frame
+  uint64_t frames_done;      // frame scritti in totale
+  uint64_t completed_frames; // frame scritti senza buchi a partire dal primo
+  uint8_t use_journal;
+  uint8_t failed; // almeno un frame non è stato decodificato
+  stripe_t *stripe; // NULL se i frame sono tutti in una cartella
+
+  // modalità live: il frame n usa live_frames[n % live_slots], 'done' viene
+  // segnalata anche ogni volta che un frame si libera
+  live_frame_t *live_frames;
+  uint32_t live_slots;
+  double live_target;     // latenza massima voluta, in secondi
+  double write_estimate;  // stima del tempo di scrittura di un frame
+  uint64_t over_target;   // frame scritti oltre la latenza voluta
+} typedef job_t;
+
+// Un task è un singolo frame di un job
+struct TASK {
+  job_t *job;
+  uint64_t frame;
+} typedef task_t;
+
+// Coda di task di un worker, i task validi sono quelli in [head, tail) presi
+// modulo capacity
+struct WORK_DEQUE {
+  pthread_mutex_t lock;
+  task_t *tasks;
+  uint64_t head, tail, capacity;
+} typedef work_deque_t;
+
+struct WORKER {
+  struct THREAD_POOL *pool;
+  uint32_t id;
+  uint32_t node; // nodo NUMA su cui è fissato
+  pthread_t thread;
+  work_deque_t deque;
+  uint64_t frames_processed, frames_stolen;
+  uint64_t frames_stolen_remote; // rubati ai worker di un altro nodo
+} typedef worker_t;
+
+// Pool di worker con work stealing: ogni worker consuma la propria coda e
+// quando è vuota ruba i task dalle code degli altri
+struct THREAD_POOL {
+  uint32_t n_workers;
+  worker_t *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t work_available, idle;
+  uint64_t queued;  // task in coda non ancora presi
+  uint64_t pending; // task in coda o in lavorazione
+  // task già tolti da pending che stanno ancora avvisando il loro job:
+  // pending scende prima, così chi aspetta il job (il demone) non vede più il
+  // task come in lavorazione
+  uint64_t finishing;
+  uint32_t next_worker;
+  uint32_t next_on_node[NUMA_MAX_NODES];
+  uint8_t shutdown;
+} typedef thread_pool_t;
+
+// Profilo della macchina scritto da --tune: i parametri scelti e le
+// velocità misurate per sceglierli
+struct PROFILE {
+  uint8_t loaded;
+  uint32_t workers, in_flight, io_chunk;
+  int levels[ENTROPY_BANDS]; // livello di compressione per fascia di entropia
+  double deflate_mbps, write_mbps, pack_mbps;
+} typedef profile_t;
+
+// Firma letta dalla prima riga di un frame
+struct FRAME_TAG {
+  uint64_t archive_id, sequence, total_frames;
+} typedef frame_tag_t;
+
 // Variabili globali
 const int width = WIDTH_DEFAULT;
 const int height = HEIGHT_DEFAULT;
-png_bytep image_data = NULL;
 png_byte *extension_name = NULL; // Puntatore per i caratteri dell'estensione
-header_info_t header_info;
+// Stampa le informazioni di debug, in batch sono disattivate
+uint8_t verbose = TRUE;
+// Cerca anche le sequenze di zeri dentro i dati, non solo i buchi (--sparse)
+uint8_t sparse_scan = FALSE;
+// Livello di compressione di zlib per i frame, la modalità live usa quello
+// più veloce
+int compression_level = Z_DEFAULT_COMPRESSION;
+// Chiave di --key, usata per cifrare i frame in codifica e per verificarli e
+// decifrarli in decodifica. AEAD_NONE se non c'è una chiave.
+uint8_t aead_key[AEAD_KEY_LENGTH];
+aead_cipher_t aead_cipher = AEAD_NONE;
+// Frame in volo oltre a quelli dei worker: in coda a ogni writer con
+// --stripe, e buffer live in più rispetto ai worker (più uno)
+uint32_t in_flight_frames = WRITER_QUEUE_DEPTH;
+// Blocchi con cui si legge l'input
+uint32_t io_chunk_size = BUFFER_SIZE;
+// Profilo caricato all'avvio, se c'è
+profile_t profile;
+// Livello di durabilità dei frame scritti (--durability, --sync-every)
+durability_t durability = DURABILITY_NONE;
+uint64_t sync_every = SYNC_EVERY_DEFAULT;
 
 // Call-back to the 'remove()' function called by nftw()
 static int remove_callback(const char *pathname,
@@ -154,12 +574,814 @@ uint8_t *split_uint16_t_into_bytes(const uint16_t value) {
   return bytes;
 }
 
-long get_file_size(FILE *fp) {
-  fseek(fp, 0, SEEK_END); // seek to end of file
+// Operazione inversa di split_uint64_t_into_bytes()
+uint64_t join_bytes_into_uint64_t(const uint8_t *bytes) {
+  uint64_t value = 0;
+  for (uint8_t i = 0; i < BYTES_INSIDE_INT64; i++)
+    value = (value << 8) | bytes[i];
+  return value;
+}
+
+// Operazione inversa di split_uint32_t_into_bytes()
+uint32_t join_bytes_into_uint32_t(const uint8_t *bytes) {
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < BYTES_INSIDE_INT32; i++)
+    value = (value << 8) | bytes[i];
+  return value;
+}
+
+uint64_t get_file_size(FILE *fp) {
+  fseeko(fp, 0, SEEK_END); // seek to end of file
   fflush(fp);
-  const long size = ftell(fp); // get current file pointer
-  fseek(fp, 0, SEEK_SET);      // seek back to beginning of file
-  return size;
+  const off_t size = ftello(fp); // get current file pointer
+  fseeko(fp, 0, SEEK_SET);       // seek back to beginning of file
+  return size < 0 ? 0 : (uint64_t)size;
+}
+
+double elapsed_seconds(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Tracciamento delle fasi di ogni frame (--trace): ogni thread scrive gli
+// eventi nel suo buffer circolare senza lock, alla fine vengono esportati nel
+// formato JSON di Chrome/Perfetto. Se un buffer si riempie restano gli eventi
+// più recenti.
+#define TRACE_RING_EVENTS (1 << 16)
+
+struct TRACE_EVENT {
+  const char *stage;
+  int64_t frame; // -1 se la fase non riguarda un frame
+  uint64_t start_ns, end_ns;
+} typedef trace_event_t;
+
+struct TRACE_BUFFER {
+  uint32_t tid;
+  char name[64];
+  uint64_t count; // eventi registrati, compresi quelli sovrascritti
+  trace_event_t events[TRACE_RING_EVENTS];
+  struct TRACE_BUFFER *next;
+} typedef trace_buffer_t;
+
+// File della traccia, NULL se il tracciamento è spento
+char *trace_filename = NULL;
+struct timespec trace_origin;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+trace_buffer_t *trace_buffers = NULL;
+uint32_t trace_threads = 0;
+static __thread trace_buffer_t *thread_trace = NULL;
+// frame su cui sta lavorando il thread, finisce negli eventi e nei probe
+static __thread int64_t current_trace_frame = -1;
+
+// Inizio e fine di una fase nel thread corrente: evento per la traccia e
+// probe USDT con il numero del frame
+#define TRACE_BEGIN(stage)                                                     \
+  PROBE1(stage##_start, current_trace_frame);                                  \
+  const uint64_t trace_start_##stage = trace_now()
+#define TRACE_END(stage)                                                       \
+  PROBE1(stage##_done, current_trace_frame);                                   \
+  trace_event(#stage, trace_start_##stage)
+
+uint64_t trace_now() {
+  if (!trace_filename)
+    return 0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - trace_origin.tv_sec) * 1000000000ULL + now.tv_nsec -
+         trace_origin.tv_nsec;
+}
+
+// Buffer del thread corrente, allocato al primo evento
+trace_buffer_t *trace_thread_buffer() {
+  if (!thread_trace) {
+    thread_trace = (trace_buffer_t *)calloc(1, sizeof(trace_buffer_t));
+    if (!thread_trace) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&trace_lock);
+    thread_trace->tid = trace_threads++;
+    snprintf(thread_trace->name, sizeof(thread_trace->name), "thread %u",
+             thread_trace->tid);
+    thread_trace->next = trace_buffers;
+    trace_buffers = thread_trace;
+    pthread_mutex_unlock(&trace_lock);
+  }
+  return thread_trace;
+}
+
+// Nome del thread nella traccia, con la sintassi di printf()
+void trace_thread_name(const char *format, ...) {
+  if (!trace_filename)
+    return;
+  trace_buffer_t *buffer = trace_thread_buffer();
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buffer->name, sizeof(buffer->name), format, args);
+  va_end(args);
+}
+
+void trace_event(const char *stage, const uint64_t start_ns) {
+  if (!trace_filename)
+    return;
+  trace_buffer_t *buffer = trace_thread_buffer();
+  trace_event_t *event = &buffer->events[buffer->count % TRACE_RING_EVENTS];
+  event->stage = stage;
+  event->frame = current_trace_frame;
+  event->start_ns = start_ns;
+  event->end_ns = trace_now();
+  buffer->count++;
+}
+
+// Esporta gli eventi di tutti i thread come "complete events" di Chrome,
+// viene chiamata all'uscita del programma
+void write_trace() {
+  if (!trace_filename)
+    return;
+  FILE *fp = fopen(trace_filename, "w");
+  if (!fp) {
+    perror(trace_filename);
+    return;
+  }
+
+  pthread_mutex_lock(&trace_lock);
+  uint64_t written = 0, overwritten = 0;
+  fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  for (trace_buffer_t *buffer = trace_buffers; buffer; buffer = buffer->next) {
+    fprintf(fp,
+            "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %u, \"args\": {\"name\": \"%s\"}},\n",
+            buffer->tid, buffer->name);
+    const uint64_t kept = buffer->count < TRACE_RING_EVENTS
+                              ? buffer->count
+                              : TRACE_RING_EVENTS;
+    for (uint64_t i = buffer->count - kept; i < buffer->count; i++) {
+      const trace_event_t *event = &buffer->events[i % TRACE_RING_EVENTS];
+      fprintf(fp,
+              "{\"name\": \"%s\", \"cat\": \"d2v\", \"ph\": \"X\", "
+              "\"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f",
+              event->stage, buffer->tid, event->start_ns / 1e3,
+              (event->end_ns - event->start_ns) / 1e3);
+      if (event->frame >= 0)
+        fprintf(fp, ", \"args\": {\"frame\": %lld}", event->frame);
+      fprintf(fp, "},\n");
+    }
+    written += kept;
+    overwritten += buffer->count - kept;
+  }
+  pthread_mutex_unlock(&trace_lock);
+  // l'ultimo evento ha la virgola, il JSON non la accetta prima di ']'
+  fprintf(fp, "{\"name\": \"end\", \"ph\": \"i\", \"s\": \"g\", "
+              "\"pid\": 1, \"tid\": 0, \"ts\": %.3f}\n]}\n",
+          trace_now() / 1e3);
+
+  if (fclose(fp) != 0)
+    perror(trace_filename);
+  else
+    printf("Traccia: %llu eventi in %s (%llu sovrascritti)\n", written,
+           trace_filename, overwritten);
+}
+
+// Latenze delle ultime richieste del demone o degli ultimi frame live
+struct LATENCY_STATS {
+  pthread_mutex_t lock;
+  uint64_t count, failed;
+  // ultime latenze in secondi, usate come buffer circolare
+  double latencies[LATENCY_SAMPLES];
+} typedef latency_stats_t;
+
+latency_stats_t live_stats = {.lock = PTHREAD_MUTEX_INITIALIZER};
+// Durata di ogni sincronizzazione su disco (un frame in strict, un gruppo in
+// batch)
+latency_stats_t sync_stats = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int compare_doubles(const void *a, const void *b) {
+  const double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+void record_latency(latency_stats_t *stats, const double seconds,
+                    const uint8_t failed) {
+  pthread_mutex_lock(&stats->lock);
+  if (failed)
+    stats->failed++;
+  stats->latencies[stats->count++ % LATENCY_SAMPLES] = seconds;
+  pthread_mutex_unlock(&stats->lock);
+}
+
+// Calcola i percentili delle ultime latenze, ritorna quante sono
+uint64_t latency_percentiles(latency_stats_t *stats, double *p50,
+                             double *p99, double *max) {
+  double sorted[LATENCY_SAMPLES];
+
+  pthread_mutex_lock(&stats->lock);
+  const uint64_t samples =
+      stats->count < LATENCY_SAMPLES ? stats->count : LATENCY_SAMPLES;
+  memcpy(sorted, stats->latencies, samples * sizeof(double));
+  pthread_mutex_unlock(&stats->lock);
+
+  qsort(sorted, samples, sizeof(double), compare_doubles);
+  *p50 = samples ? sorted[samples / 2] : 0.0;
+  *p99 = samples ? sorted[(samples * 99) / 100] : 0.0;
+  *max = samples ? sorted[samples - 1] : 0.0;
+  return samples;
+}
+
+// Stampa i percentili delle sincronizzazioni su disco, se ce ne sono state
+void print_sync_stats() {
+  double p50, p99, max;
+  if (latency_percentiles(&sync_stats, &p50, &p99, &max) == 0)
+    return;
+  printf("Sync: %llu operazioni, p50 %.3f ms p99 %.3f ms max %.3f ms\n",
+         sync_stats.count, p50 * 1e3, p99 * 1e3, max * 1e3);
+}
+
+// Topologia NUMA: i worker vengono distribuiti a turno sui nodi e fissati
+// sulle CPU del proprio nodo, e ogni buffer dei frame viene toccato per la
+// prima volta da una CPU del nodo a cui appartiene, così il kernel lo alloca
+// nella memoria di quel nodo. Con un solo nodo (o su macOS) non cambia niente.
+
+struct NUMA_TOPOLOGY {
+  uint32_t n_nodes;
+  uint8_t pinned; // i worker sono fissati sulle CPU del loro nodo
+  int ids[NUMA_MAX_NODES]; // numero del nodo per il kernel
+#ifdef NUMA_AVAILABLE
+  cpu_set_t cpus[NUMA_MAX_NODES];
+#endif
+} typedef numa_topology_t;
+
+numa_topology_t numa = {.n_nodes = 1};
+// Nodo su cui gira il thread, i thread che non sono dei worker usano il primo
+static __thread uint32_t current_numa_node = 0;
+
+#ifdef NUMA_AVAILABLE
+// Aggiunge a 'cpus' le CPU di una lista nel formato del kernel ("0-3,8-11")
+void parse_cpu_list(const char *list, cpu_set_t *cpus) {
+  const char *p = list;
+  while (*p && *p != '\n') {
+    char *end;
+    const long first = strtol(p, &end, 10);
+    if (end == p)
+      break;
+    long last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, cpus);
+    p = *end == ',' ? end + 1 : end;
+  }
+}
+#endif
+
+// Legge i nodi da /sys/devices/system/node, tenendo solo quelli con delle CPU
+// su cui il processo può girare. 'forced_nodes' viene da --numa: -1 per
+// rilevarli, 0 per ignorarli e N per dividere le CPU in N nodi finti, utile
+// per provare la distribuzione su una macchina con un solo nodo.
+void detect_numa_topology(const long forced_nodes) {
+  numa.n_nodes = 1;
+  numa.pinned = FALSE;
+  numa.ids[0] = 0;
+#ifdef NUMA_AVAILABLE
+  cpu_set_t allowed;
+  if (forced_nodes == 0 ||
+      sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return;
+
+  uint32_t n_nodes = 0;
+  if (forced_nodes < 0) {
+    for (int node = 0; node < 1024 && n_nodes < NUMA_MAX_NODES; node++) {
+      char path[64], list[4096];
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+               node);
+      FILE *fp = fopen(path, "r");
+      if (!fp)
+        continue;
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      if (fgets(list, sizeof(list), fp))
+        parse_cpu_list(list, &cpus);
+      fclose(fp);
+      CPU_AND(&cpus, &cpus, &allowed);
+      if (CPU_COUNT(&cpus) == 0)
+        continue;
+      numa.ids[n_nodes] = node;
+      numa.cpus[n_nodes++] = cpus;
+    }
+  } else {
+    const int total = CPU_COUNT(&allowed);
+    n_nodes = forced_nodes < total ? forced_nodes : total;
+    if (n_nodes > NUMA_MAX_NODES)
+      n_nodes = NUMA_MAX_NODES;
+    for (uint32_t node = 0; node < n_nodes; node++) {
+      numa.ids[node] = node;
+      CPU_ZERO(&numa.cpus[node]);
+    }
+    // CPU contigue nello stesso nodo finto, come di solito sono quelle vere
+    int k = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && k < total; cpu++)
+      if (CPU_ISSET(cpu, &allowed))
+        CPU_SET(cpu, &numa.cpus[(uint64_t)k++ * n_nodes / total]);
+  }
+
+  if (n_nodes > 1) {
+    numa.n_nodes = n_nodes;
+    numa.pinned = TRUE;
+  }
+#endif
+}
+
+// Fissa il thread corrente sulle CPU di un nodo
+void numa_bind_thread(const uint32_t node) {
+  current_numa_node = node;
+#ifdef NUMA_AVAILABLE
+  if (numa.pinned &&
+      sched_setaffinity(0, sizeof(cpu_set_t), &numa.cpus[node]) != 0)
+    perror("sched_setaffinity error: ");
+#endif
+}
+
+// Tocca una volta ogni pagina di un buffer appena mappato da una CPU del nodo,
+// spostandosi per il tempo necessario se il thread gira su un altro nodo
+void numa_first_touch(png_bytep buffer, const size_t length,
+                      const uint32_t node) {
+#ifdef NUMA_AVAILABLE
+  if (!numa.pinned)
+    return;
+  cpu_set_t previous;
+  const uint8_t move = current_numa_node != node &&
+                       sched_getaffinity(0, sizeof(previous), &previous) == 0;
+  if (move)
+    sched_setaffinity(0, sizeof(cpu_set_t), &numa.cpus[node]);
+  for (size_t offset = 0; offset < length; offset += NUMA_TOUCH_STRIDE)
+    ((volatile png_bytep)buffer)[offset] = 0;
+  if (move)
+    sched_setaffinity(0, sizeof(previous), &previous);
+#endif
+}
+
+// Pool dei buffer dei frame, condiviso da tutti i worker e da tutti i job. I
+// buffer sono allocati con mmap() su huge pages da 2 MB (esplicite se il
+// sistema ne ha di riservate, altrimenti trasparenti) così un frame da 24.9
+// MB usa 12 pagine invece di oltre 6000, con meno page fault e meno TLB miss.
+// Un buffer tornato nel pool viene riusato dal frame successivo, di qualsiasi
+// job. Con --memory-limit la memoria dei frame (e dei frame compressi in coda
+// ai writer) ha un tetto: chi chiede un buffer oltre il tetto aspetta che un
+// altro ne restituisca uno.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define FRAME_BUFFER_SIZE                                                      \
+  (((size_t)PNG_TOTAL_BYTES + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *           \
+   HUGE_PAGE_SIZE)
+
+// Buffer liberi di un nodo NUMA
+struct FREE_BUFFERS {
+  png_bytep *buffers;
+  uint64_t count, capacity;
+} typedef free_buffers_t;
+
+// Nodo di ogni buffer mappato, per rimetterlo nella lista giusta
+struct MAPPED_BUFFER {
+  png_bytep buffer;
+  uint32_t node;
+} typedef mapped_buffer_t;
+
+struct FRAME_POOL {
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+  free_buffers_t free_lists[NUMA_MAX_NODES];
+  uint64_t n_free; // buffer liberi su tutti i nodi
+  mapped_buffer_t *mapped;
+  uint64_t mapped_capacity;
+  // memoria allocata (buffer liberi compresi) e tetto, 0 = nessun tetto
+  uint64_t allocated_bytes, peak_bytes, budget;
+  uint64_t buffers, hugetlb_buffers, transparent_buffers;
+  uint64_t acquired, reused, waits;
+  uint64_t remote; // buffer presi dalla lista di un altro nodo
+  double wait_seconds;
+  uint8_t hugetlb_failed; // dopo il primo fallimento non si riprova
+} typedef frame_pool_t;
+
+frame_pool_t frame_pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                           .released = PTHREAD_COND_INITIALIZER};
+
+// Alloca un nuovo buffer, prima con le huge pages esplicite e poi chiedendo
+// quelle trasparenti. Se nessuna delle due è disponibile restano le pagine
+// normali.
+png_bytep map_frame_buffer(const uint32_t node) {
+  void *buffer = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (!frame_pool.hugetlb_failed) {
+    buffer = mmap(NULL, FRAME_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (buffer == MAP_FAILED)
+      frame_pool.hugetlb_failed = TRUE;
+    else
+      frame_pool.hugetlb_buffers++;
+  }
+#endif
+  if (buffer == MAP_FAILED) {
+    buffer = mmap(NULL, FRAME_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+      perror("mmap error: ");
+      exit(EXIT_FAILURE);
+    }
+#ifdef MADV_HUGEPAGE
+    if (madvise(buffer, FRAME_BUFFER_SIZE, MADV_HUGEPAGE) == 0)
+      frame_pool.transparent_buffers++;
+#endif
+  }
+
+  if (frame_pool.buffers == frame_pool.mapped_capacity) {
+    frame_pool.mapped_capacity =
+        frame_pool.mapped_capacity ? 2 * frame_pool.mapped_capacity : 16;
+    frame_pool.mapped = (mapped_buffer_t *)realloc(
+        frame_pool.mapped, frame_pool.mapped_capacity * sizeof(mapped_buffer_t));
+    if (!frame_pool.mapped) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+  }
+  frame_pool.mapped[frame_pool.buffers].buffer = (png_bytep)buffer;
+  frame_pool.mapped[frame_pool.buffers].node = node;
+  frame_pool.buffers++;
+  return (png_bytep)buffer;
+}
+
+// Prende un buffer dal pool per un frame che verrà lavorato sul nodo 'node'.
+// Si usa prima un buffer libero dello stesso nodo, poi se ne alloca uno
+// nuovo, e solo se questo supera il tetto si prende quello di un altro nodo.
+// Senza buffer liberi e oltre il tetto, con 'wait', si aspetta che qualcuno
+// ne restituisca uno. Senza 'wait' (buffer tenuti per tutta la durata, come
+// quelli della modalità live) si alloca comunque.
+png_bytep frame_buffer_acquire_on(const uint32_t node, const uint8_t wait) {
+  pthread_mutex_lock(&frame_pool.lock);
+  frame_pool.acquired++;
+  if (wait && frame_pool.n_free == 0 && frame_pool.budget > 0 &&
+      frame_pool.allocated_bytes > 0 &&
+      frame_pool.allocated_bytes + FRAME_BUFFER_SIZE > frame_pool.budget) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    frame_pool.waits++;
+    while (frame_pool.n_free == 0 &&
+           frame_pool.allocated_bytes + FRAME_BUFFER_SIZE > frame_pool.budget)
+      pthread_cond_wait(&frame_pool.released, &frame_pool.lock);
+    frame_pool.wait_seconds += elapsed_seconds(&start);
+  }
+
+  png_bytep buffer = NULL;
+  free_buffers_t *local = &frame_pool.free_lists[node];
+  if (local->count > 0) {
+    buffer = local->buffers[--local->count];
+  } else if (frame_pool.n_free > 0 && wait && frame_pool.budget > 0 &&
+             frame_pool.allocated_bytes + FRAME_BUFFER_SIZE >
+                 frame_pool.budget) {
+    for (uint32_t i = 1; !buffer && i < numa.n_nodes; i++) {
+      free_buffers_t *other = &frame_pool.free_lists[(node + i) % numa.n_nodes];
+      if (other->count > 0)
+        buffer = other->buffers[--other->count];
+    }
+    frame_pool.remote++;
+  }
+
+  uint8_t fresh = FALSE;
+  if (buffer) {
+    frame_pool.n_free--;
+    frame_pool.reused++;
+  } else {
+    buffer = map_frame_buffer(node);
+    fresh = TRUE;
+    frame_pool.allocated_bytes += FRAME_BUFFER_SIZE;
+    if (frame_pool.allocated_bytes > frame_pool.peak_bytes)
+      frame_pool.peak_bytes = frame_pool.allocated_bytes;
+  }
+  pthread_mutex_unlock(&frame_pool.lock);
+
+  // Le pagine si toccano fuori dal lock, sono migliaia di page fault
+  if (fresh)
+    numa_first_touch(buffer, FRAME_BUFFER_SIZE, node);
+  return buffer;
+}
+
+// Prende un buffer per il nodo su cui gira il thread
+png_bytep frame_buffer_acquire(const uint8_t wait) {
+  return frame_buffer_acquire_on(current_numa_node, wait);
+}
+
+// Restituisce un buffer al pool, nella lista del suo nodo, resta allocato per
+// il prossimo frame
+void frame_buffer_release(png_bytep buffer) {
+  pthread_mutex_lock(&frame_pool.lock);
+  uint32_t node = 0;
+  for (uint64_t i = 0; i < frame_pool.buffers; i++)
+    if (frame_pool.mapped[i].buffer == buffer) {
+      node = frame_pool.mapped[i].node;
+      break;
+    }
+
+  free_buffers_t *list = &frame_pool.free_lists[node];
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? 2 * list->capacity : 16;
+    list->buffers =
+        (png_bytep *)realloc(list->buffers, list->capacity * sizeof(png_bytep));
+    if (!list->buffers) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+  }
+  list->buffers[list->count++] = buffer;
+  frame_pool.n_free++;
+  pthread_cond_signal(&frame_pool.released);
+  pthread_mutex_unlock(&frame_pool.lock);
+}
+
+// Conta nel tetto della memoria anche altri buffer grandi (i frame compressi
+// in coda ai writer). Non aspetta mai, le code sono già limitate, ma finchè
+// la memoria è oltre il tetto non si allocano nuovi buffer dei frame.
+void memory_charge(const int64_t bytes) {
+  pthread_mutex_lock(&frame_pool.lock);
+  frame_pool.allocated_bytes += bytes;
+  if (frame_pool.allocated_bytes > frame_pool.peak_bytes)
+    frame_pool.peak_bytes = frame_pool.allocated_bytes;
+  if (bytes < 0)
+    pthread_cond_broadcast(&frame_pool.released);
+  pthread_mutex_unlock(&frame_pool.lock);
+}
+
+void print_memory_stats() {
+  pthread_mutex_lock(&frame_pool.lock);
+  printf("Memoria: %llu buffer da %.1f MB (%llu con huge pages esplicite, "
+         "%llu trasparenti), %llu richieste di cui %llu con un buffer "
+         "riusato, picco %.1f MB",
+         frame_pool.buffers, FRAME_BUFFER_SIZE / 1e6,
+         frame_pool.hugetlb_buffers, frame_pool.transparent_buffers,
+         frame_pool.acquired, frame_pool.reused, frame_pool.peak_bytes / 1e6);
+  if (frame_pool.budget > 0)
+    printf(", tetto %.1f MB, %llu attese per %.3f s", frame_pool.budget / 1e6,
+           frame_pool.waits, frame_pool.wait_seconds);
+  if (numa.n_nodes > 1)
+    printf(", %llu presi da un altro nodo", frame_pool.remote);
+  printf("\n");
+  pthread_mutex_unlock(&frame_pool.lock);
+}
+
+// Limite di throughput con un secchiello di token: chi legge o scrive
+// consuma subito i suoi bytes, e se va in debito dorme per il tempo che serve
+// a ripagarlo. Con più thread il debito è comune, quindi il totale rispetta
+// il limite.
+struct TOKEN_BUCKET {
+  double limit; // bytes al secondo chiesti, 0 = nessun limite
+  double rate;  // limite attuale, ridotto quando il sistema è carico
+  double tokens;
+  struct timespec last;
+  double throttled_seconds;
+  uint64_t bytes;
+} typedef token_bucket_t;
+
+struct QOS {
+  pthread_mutex_t lock;
+  pthread_cond_t slot_free;
+  uint8_t enabled;
+  token_bucket_t input, output;
+  // worker che possono codificare insieme: max_workers è il tetto (0 = tutti),
+  // worker_limit quello attuale
+  uint32_t max_workers, worker_limit, active;
+  double concurrency_wait_seconds;
+  double load_threshold, latency_threshold; // per CPU, secondi
+  double load, latency, own_load, scale;
+  uint64_t backoffs;
+  const char *cpu_priority, *io_priority;
+  pthread_t monitor;
+} typedef qos_t;
+
+qos_t qos = {.lock = PTHREAD_MUTEX_INITIALIZER,
+             .slot_free = PTHREAD_COND_INITIALIZER};
+
+// Aggiunge i token maturati dall'ultima volta, al massimo QOS_BURST_SECONDS
+// di credito. Va chiamata con il lock preso.
+void token_bucket_refill(token_bucket_t *bucket) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const double elapsed = (now.tv_sec - bucket->last.tv_sec) +
+                         (now.tv_nsec - bucket->last.tv_nsec) / 1e9;
+  bucket->last = now;
+  bucket->tokens += elapsed * bucket->rate;
+  if (bucket->tokens > bucket->rate * QOS_BURST_SECONDS)
+    bucket->tokens = bucket->rate * QOS_BURST_SECONDS;
+}
+
+// Chiamata prima di leggere o scrivere 'bytes' bytes: aspetta finchè il
+// limite lo permette e segna l'inizio dell'operazione per misurarne la
+// latenza. Non fa niente senza --qos.
+void qos_io_begin(token_bucket_t *bucket, const uint64_t bytes,
+                  struct timespec *start) {
+  if (!qos.enabled)
+    return;
+  double wait = 0;
+  pthread_mutex_lock(&qos.lock);
+  bucket->bytes += bytes;
+  if (bucket->rate > 0) {
+    token_bucket_refill(bucket);
+    bucket->tokens -= bytes;
+    if (bucket->tokens < 0) {
+      wait = -bucket->tokens / bucket->rate;
+      bucket->throttled_seconds += wait;
+    }
+  }
+  pthread_mutex_unlock(&qos.lock);
+  if (wait > 0) {
+    struct timespec delay = {(time_t)wait,
+                             (long)((wait - (time_t)wait) * 1e9)};
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+      ;
+  }
+  clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+// Aggiunge la durata dell'operazione iniziata con qos_io_begin() alla media
+// mobile della latenza
+void qos_io_end(const struct timespec *start) {
+  if (!qos.enabled)
+    return;
+  const double latency = elapsed_seconds(start);
+  pthread_mutex_lock(&qos.lock);
+  qos.latency = qos.latency == 0 ? latency
+                                 : qos.latency * (1 - QOS_LATENCY_WEIGHT) +
+                                       latency * QOS_LATENCY_WEIGHT;
+  pthread_mutex_unlock(&qos.lock);
+}
+
+// Un worker prende un posto prima di lavorare un frame e lo lascia alla
+// fine, così non ne lavorano mai più di worker_limit insieme
+void qos_enter() {
+  if (!qos.enabled)
+    return;
+  pthread_mutex_lock(&qos.lock);
+  if (qos.active >= qos.worker_limit) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (qos.active >= qos.worker_limit)
+      pthread_cond_wait(&qos.slot_free, &qos.lock);
+    qos.concurrency_wait_seconds += elapsed_seconds(&start);
+  }
+  qos.active++;
+  pthread_mutex_unlock(&qos.lock);
+}
+
+void qos_leave() {
+  if (!qos.enabled)
+    return;
+  pthread_mutex_lock(&qos.lock);
+  qos.active--;
+  pthread_cond_signal(&qos.slot_free);
+  pthread_mutex_unlock(&qos.lock);
+}
+
+// Abbassa la priorità del thread che la chiama: SCHED_IDLE per la CPU e la
+// classe idle per l'I/O su linux, altrimenti solo nice 19. I thread creati
+// dopo la ereditano.
+void qos_lower_priority() {
+  if (!qos.enabled)
+    return;
+#if defined(__linux__) && defined(SCHED_IDLE)
+  struct sched_param param = {0};
+  if (sched_setscheduler(0, SCHED_IDLE, &param) == 0)
+    qos.cpu_priority = "SCHED_IDLE";
+  else
+#endif
+      if (setpriority(PRIO_PROCESS, 0, 19) == 0)
+    qos.cpu_priority = "nice 19";
+#if defined(__linux__) && defined(SYS_ioprio_set)
+  // IOPRIO_WHO_PROCESS = 1, classe IOPRIO_CLASS_IDLE = 3 nei bit dal 13
+  if (syscall(SYS_ioprio_set, 1, 0, 3 << 13) == 0)
+    qos.io_priority = "idle";
+#endif
+}
+
+// Ogni QOS_SAMPLE_MS confronta il carico e la latenza con le soglie: se le
+// supera dimezza i limiti (e i worker), altrimenti li fa risalire piano.
+// Il carico medio di getloadavg() comprende anche i nostri worker, quindi si
+// toglie una media calcolata allo stesso modo dei thread attivi.
+void *qos_monitor_main(void *arg) {
+  (void)arg;
+  trace_thread_name("qos");
+  const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  // il carico a un minuto del kernel decade di exp(-5/60) ogni 5 secondi
+  const double decay = exp(-(QOS_SAMPLE_MS / 1000.0) / 60.0);
+  const struct timespec interval = {QOS_SAMPLE_MS / 1000,
+                                    (QOS_SAMPLE_MS % 1000) * 1000000L};
+  while (TRUE) {
+    nanosleep(&interval, NULL);
+    double loadavg;
+    const uint8_t has_load = getloadavg(&loadavg, 1) == 1;
+    pthread_mutex_lock(&qos.lock);
+    qos.own_load = qos.own_load * decay + qos.active * (1 - decay);
+    qos.load = has_load && loadavg > qos.own_load
+                   ? (loadavg - qos.own_load) / (n_cpus > 0 ? n_cpus : 1)
+                   : 0;
+    if (qos.load > qos.load_threshold || qos.latency > qos.latency_threshold) {
+      qos.scale = fmax(qos.scale / 2, QOS_MIN_SCALE);
+      if (qos.worker_limit > 1)
+        qos.worker_limit /= 2;
+      qos.backoffs++;
+    } else {
+      qos.scale = fmin(qos.scale + QOS_RECOVERY_STEP, 1);
+      if (qos.worker_limit < qos.max_workers) {
+        qos.worker_limit++;
+        pthread_cond_broadcast(&qos.slot_free);
+      }
+    }
+    qos.input.rate = qos.input.limit * qos.scale;
+    qos.output.rate = qos.output.limit * qos.scale;
+    pthread_mutex_unlock(&qos.lock);
+  }
+  return NULL;
+}
+
+// Avvia la modalità QoS prima di creare i worker: il monitor parte con la
+// priorità normale, poi si abbassa quella del thread principale
+void qos_start(const uint32_t n_workers) {
+  if (!qos.enabled)
+    return;
+  if (qos.max_workers == 0 || qos.max_workers > n_workers)
+    qos.max_workers = n_workers;
+  qos.worker_limit = qos.max_workers;
+  qos.scale = 1;
+  qos.input.rate = qos.input.limit;
+  qos.output.rate = qos.output.limit;
+  clock_gettime(CLOCK_MONOTONIC, &qos.input.last);
+  qos.output.last = qos.input.last;
+  qos.cpu_priority = qos.io_priority = "normale";
+  if (pthread_create(&qos.monitor, NULL, qos_monitor_main, NULL) != 0) {
+    perror("pthread_create error: ");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(qos.monitor);
+  qos_lower_priority();
+}
+
+void print_token_bucket(const char *name, const token_bucket_t *bucket) {
+  if (bucket->limit > 0)
+    printf("%s %.1f MB/s (ora %.1f)", name, bucket->limit / 1e6,
+           bucket->rate / 1e6);
+  else
+    printf("%s senza limite", name);
+  printf(", %.1f MB in %.3f s di attesa; ", bucket->bytes / 1e6,
+         bucket->throttled_seconds);
+}
+
+void print_qos_stats() {
+  if (!qos.enabled)
+    return;
+  pthread_mutex_lock(&qos.lock);
+  printf("QoS: ");
+  print_token_bucket("input", &qos.input);
+  print_token_bucket("output", &qos.output);
+  printf("worker %u/%u (attese %.3f s), CPU %s, I/O %s, carico degli altri "
+         "%.2f per CPU (soglia %.2f), latenza I/O %.2f ms (soglia %.2f), "
+         "%llu rallentamenti\n",
+         qos.worker_limit, qos.max_workers, qos.concurrency_wait_seconds,
+         qos.cpu_priority, qos.io_priority, qos.load, qos.load_threshold,
+         qos.latency * 1e3, qos.latency_threshold * 1e3, qos.backoffs);
+  pthread_mutex_unlock(&qos.lock);
+}
+
+// Porta su disco i dati di un file. Su macOS fsync() non svuota la cache del
+// disco, serve F_FULLFSYNC.
+void sync_fd(const int fd, const char *filename) {
+#if defined(F_FULLFSYNC)
+  const int result = fcntl(fd, F_FULLFSYNC) == 0 ? 0 : fsync(fd);
+#else
+  const int result = fdatasync(fd);
+#endif
+  if (result != 0) {
+    perror(filename);
+    exit(ERROR_SYNC);
+  }
+}
+
+// Cartella che contiene 'filename', la stringa va liberata
+char *parent_directory(const char *filename) {
+  const char *slash = strrchr(filename, '/');
+  return slash ? strndup(filename, slash - filename + 1) : strdup(".");
+}
+
+// Sincronizza una cartella, serve perchè una rinomina sia davvero su disco
+void sync_directory(const char *directory) {
+  const int fd = open(directory, O_RDONLY);
+  if (fd < 0 || fsync(fd) != 0) {
+    perror(directory);
+    exit(ERROR_SYNC);
+  }
+  close(fd);
+}
+
+void sync_parent_directory(const char *filename) {
+  char *directory = parent_directory(filename);
+  sync_directory(directory);
+  free(directory);
 }
 
 // Calcola la lunghezza dell'estensione di un file a partire dal nome del file
@@ -176,8 +1398,10 @@ uint8_t get_extension_length(const char *filename) {
   // alla fine del nome del file, escludendo il punto, visto che tolgo 1 dal
   // totale e controllo che la lunghezza dell'estensione non superi il massimo
   // che ho stabilito
-  const uint8_t ext_size = ((strlen(dot) - 1) > EXTENSION_MAX_LENGTH)
-                               ? EXTENSION_MAX_LENGTH
+  // (il massimo è EXTENSION_MAX_LENGTH - 1 perchè la lunghezza deve stare
+  // nei 6 bit dell'header)
+  const uint8_t ext_size = ((strlen(dot) - 1) > EXTENSION_MAX_LENGTH - 1)
+                               ? EXTENSION_MAX_LENGTH - 1
                                : strlen(dot) - 1;
 
   dot = NULL;
@@ -213,59 +1437,162 @@ char *get_extension_string(const char *filename) {
   return ext_string;
 }
 
-uint8_t *read_buffered_file(FILE *fp, uint16_t *byte_to_reads) {
-  uint8_t *buffer = (uint8_t *)malloc(*byte_to_reads);
-  const unsigned long byte_reads = fread(buffer, 1, *byte_to_reads, fp);
-  return buffer;
+// Legge 'bytes_to_read' bytes a partire da 'offset' direttamente nel buffer,
+// a blocchi di al massimo io_chunk_size bytes. Usa pread() così più thread
+// possono leggere parti diverse dello stesso file senza spostare l'offset
+void read_buffered_file(const int fd, uint8_t *buffer, uint64_t offset,
+                        uint32_t bytes_to_read) {
+  PROBE2(read_buffered_start, offset, bytes_to_read);
+  while (bytes_to_read > 0) {
+    // leggo al massimo io_chunk_size byte, se ce ne sono meno leggo solo
+    // quelli che rimangono
+    const uint32_t byte_to_reads =
+        io_chunk_size > bytes_to_read ? bytes_to_read : io_chunk_size;
+    struct timespec io_start;
+    qos_io_begin(&qos.input, byte_to_reads, &io_start);
+    const ssize_t byte_reads = pread(fd, buffer, byte_to_reads, offset);
+    qos_io_end(&io_start);
+    if (byte_reads < 0 && errno == EINTR)
+      continue;
+    if (byte_reads <= 0) {
+      perror("read error: ");
+      exit(ERROR_INPUT_READ);
+    }
+    buffer += byte_reads;
+    offset += byte_reads;
+    bytes_to_read -= byte_reads;
+  }
+  PROBE2(read_buffered_done, offset, bytes_to_read);
+}
+
+// Scrive 'bytes_to_write' bytes a partire da 'offset', è l'operazione inversa
+// di read_buffered_file(). Ritorna FALSE se la scrittura fallisce. Con --qos
+// scrive a blocchi di io_chunk_size bytes, così il limite di output non
+// blocca un intero frame alla volta.
+uint8_t write_buffered_file(const int fd, const uint8_t *buffer,
+                            uint64_t offset, uint64_t bytes_to_write) {
+  while (bytes_to_write > 0) {
+    const uint64_t chunk = qos.enabled && bytes_to_write > io_chunk_size
+                               ? io_chunk_size
+                               : bytes_to_write;
+    struct timespec io_start;
+    qos_io_begin(&qos.output, chunk, &io_start);
+    const ssize_t byte_writes = pwrite(fd, buffer, chunk, offset);
+    qos_io_end(&io_start);
+    if (byte_writes < 0 && errno == EINTR)
+      continue;
+    if (byte_writes <= 0) {
+      perror("write error: ");
+      return FALSE;
+    }
+    buffer += byte_writes;
+    offset += byte_writes;
+    bytes_to_write -= byte_writes;
+  }
+  return TRUE;
+}
+
+// Sceglie il cifrario per --key: AES-256-GCM se la CPU ha le istruzioni AES e
+// la moltiplicazione senza riporto (AES-NI e PCLMUL su x86, le estensioni
+// crittografiche su ARMv8), altrimenti ChaCha20-Poly1305 che in software è
+// molto più veloce di AES
+aead_cipher_t detect_aead_cipher() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul")
+             ? AEAD_AES_256_GCM
+             : AEAD_CHACHA20_POLY1305;
+#elif defined(__aarch64__) && defined(__APPLE__)
+  return AEAD_AES_256_GCM;
+#else
+  return AEAD_CHACHA20_POLY1305;
+#endif
+}
+
+const char *aead_cipher_name(const aead_cipher_t cipher) {
+  return cipher == AEAD_AES_256_GCM ? "AES-256-GCM" : "ChaCha20-Poly1305";
+}
+
+// Legge la chiave da un file con 32 bytes binari oppure 64 cifre esadecimali
+// (ad esempio "openssl rand -hex 32 > chiave")
+void load_aead_key(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    perror(filename);
+    exit(ERROR_AEAD);
+  }
+  char buffer[2 * AEAD_KEY_LENGTH + 2];
+  size_t length = fread(buffer, 1, sizeof(buffer), fp);
+  fclose(fp);
+  while (length > AEAD_KEY_LENGTH &&
+         (buffer[length - 1] == '\n' || buffer[length - 1] == '\r'))
+    length--;
+
+  uint8_t is_valid = length == AEAD_KEY_LENGTH;
+  if (is_valid) {
+    memcpy(aead_key, buffer, AEAD_KEY_LENGTH);
+  } else if (length == 2 * AEAD_KEY_LENGTH) {
+    is_valid = TRUE;
+    for (int i = 0; i < AEAD_KEY_LENGTH && is_valid; i++) {
+      const char digits[3] = {buffer[2 * i], buffer[2 * i + 1], '\0'};
+      is_valid = isxdigit((unsigned char)digits[0]) &&
+                 isxdigit((unsigned char)digits[1]);
+      aead_key[i] = strtoul(digits, NULL, 16);
+    }
+  }
+  if (!is_valid) {
+    fprintf(stderr,
+            "%s: la chiave deve essere di %d bytes oppure %d cifre "
+            "esadecimali\n",
+            filename, AEAD_KEY_LENGTH, 2 * AEAD_KEY_LENGTH);
+    exit(ERROR_AEAD);
+  }
+}
+
+// Calcola quanti frame servono per 'payload_size' bytes di dati più l'header
+// e quanto è pieno l'ultimo frame, se ogni frame contiene 'frame_capacity'
+// bytes di cui i primi 'tag_length' sono la firma. C'è sempre almeno un
+// frame, perchè l'header va salvato anche per un file vuoto.
+layout_t plan_layout(const uint64_t payload_size,
+                     const uint32_t header_length,
+                     const uint32_t frame_capacity,
+                     const uint32_t tag_length) {
+  layout_t layout;
+  layout.payload_size = payload_size;
+  layout.header_length = header_length;
+
+  // Divisione intera arrotondata per eccesso, senza passare dai double che
+  // sopra i 2^53 bytes perdono precisione
+  const uint64_t bytes_with_header = payload_size + header_length;
+  const uint32_t data_capacity = frame_capacity - tag_length;
+  layout.total_frames = (bytes_with_header - 1) / data_capacity + 1;
+  layout.bytes_last_frame =
+      tag_length + bytes_with_header -
+      (layout.total_frames - 1) * data_capacity;
+  layout.padding_bytes = PNG_TOTAL_BYTES - layout.bytes_last_frame;
+  return layout;
 }
 
-// Allora in teoria ora sembra funzionare, ma va rivisitato perchè ho
-// "sistemato" il tutto togliendo 1 all'ultima riga e colonna, ma non penso che
-// sia il modo corretto
-header_info_t predict_last_data_position(const long file_size_with_header,
+// Calcola in quale punto dell'ultimo frame finiscono i dati e quindi iniziano i
+// pixel di riempimento: riga, colonna e canale del primo byte di riempimento.
+// Se l'ultimo frame è pieno fino all'ultimo byte la riga vale HEIGHT_DEFAULT.
+// In questo modo la posizione è sempre esatta e il decoder può ricavare la
+// dimensione del file con extract_file_size().
+header_info_t predict_last_data_position(const layout_t *layout,
                                          const uint8_t extension_length) {
   header_info_t info;
 
-  // Numero di chunk completi
-  const uint64_t complete_chunks =
-      floor((double)file_size_with_header / PNG_TOTAL_BYTES);
-  // Numeri di bytes che contiene l'ultimo chunk
-  const uint32_t bytes_last_chunk =
-      (PNG_TOTAL_BYTES >= file_size_with_header)
-          ? file_size_with_header
-          : file_size_with_header - (complete_chunks * PNG_TOTAL_BYTES);
-
-  // Numero di righe complete dell'ultimo chunk
-  const uint16_t complete_last_chunk_rows =
-      floor((double)bytes_last_chunk / BYTES_PER_ROW);
-  // Numero di bytes rimanenti null'ultima riga dell'ultimo chunk
-  const uint16_t bytes_last_chunk_row =
-      bytes_last_chunk - complete_last_chunk_rows * BYTES_PER_ROW;
-  // Numeri di pixels completi nell'ultima riga del'ultimo chunk
-  const uint16_t complete_last_row_pixels =
-      floor((double)bytes_last_chunk_row / BYTES_PER_PIXEL);
-  // bytes rimanenti escludendo i pixels completi, all'ultima riga
-  const uint16_t remaining_bytes_last_row =
-      bytes_last_chunk_row - complete_last_row_pixels * BYTES_PER_PIXEL;
-
-  /*if (remaining_bytes_last_row == 0) {
-    info.last_byte_column = 2160;
-    info.last_byte_row = 3840;
-    info.last_channel_and_extension_length = extension_length;
-    return info;
-  }*/
-
-  // indice dell'ultima riga
-  const uint16_t last_row =
-      ((complete_last_chunk_rows > 0 && bytes_last_chunk_row == 0) ||
-       (complete_last_chunk_rows == 0 && bytes_last_chunk_row > 0))
-          ? complete_last_chunk_rows
-          : complete_last_chunk_rows + 1;
-  // indice dell'ultima colonna
-  const uint16_t last_column = complete_last_row_pixels;
-  // indice dell'ultimo canale
-  // 0 = alpha, 1 = red, 2 = green, 3 = blue
-  const uint8_t last_channel = remaining_bytes_last_row;
+  // Numero di chunk completi, escluso l'ultimo (che può essere anche pieno)
+  const uint64_t complete_chunks = layout->total_frames - 1;
+  // Numeri di bytes che contiene l'ultimo chunk, da 1 a PNG_TOTAL_BYTES
+  const uint32_t bytes_last_chunk = layout->bytes_last_frame;
+
+  // indice dell'ultima riga, colonna e canale
+  // 0 = red, 1 = green, 2 = blue
+  const uint16_t last_row = bytes_last_chunk / BYTES_PER_ROW;
+  const uint16_t last_column =
+      (bytes_last_chunk % BYTES_PER_ROW) / BYTES_PER_PIXEL;
+  const uint8_t last_channel = bytes_last_chunk % BYTES_PER_PIXEL;
 
   info.last_byte_column = last_column;
   info.last_byte_row = last_row;
@@ -274,34 +1601,215 @@ header_info_t predict_last_data_position(const long file_size_with_header,
   info.last_channel_and_extension_length = last_channel << 6;
   info.last_channel_and_extension_length += extension_length;
 
-  // Ho messo if qui solo per ottenere informazioni di debug, quando è completo
-  // lo tolgo e lo rimpiazzo con quello che ho commentato sopra
-  if (remaining_bytes_last_row == 0) {
-    info.last_byte_column = 2160;
-    info.last_byte_row = 3840;
-    info.last_channel_and_extension_length = extension_length;
-  }
-
-  printf("\n(DEBUG)\n \
+  if (verbose)
+    printf("\n(DEBUG)\n \
   complete_chunks: %llu\n \
   bytes_last_chunk: %u\n \
-  complete_last_chunk_rows: %u\n \
-  bytes_last_chunk_row: %u\n \
-  complete_last_row_pixels: %u\n \
-  remaining_bytes_last_row: %u\n \
   last_row: %u\n \
   last_column: %u\n \
   last_channel: %u\n(END DEBUG)\n\n",
-         complete_chunks, bytes_last_chunk, complete_last_chunk_rows,
-         bytes_last_chunk_row, complete_last_row_pixels,
-         remaining_bytes_last_row, last_row, last_column, last_channel);
+           complete_chunks, bytes_last_chunk, last_row, last_column,
+           last_channel);
 
   return info;
 }
 
-// Funzione per scrivere un file PNG
-void write_png_file(char *filename) {
-  FILE *fp = fopen(filename,
+// Ricava dal primo frame le informazioni dell'header e la dimensione del file
+// originale, è l'inverso di pack_header(). 'data' punta all'header, cioè
+// dopo la firma se il frame ce l'ha (e allora job->tag_length è già
+// impostato). Ritorna FALSE se i bytes non sono un header valido.
+uint8_t extract_file_size(const uint8_t *data, job_t *job) {
+  job->header_info.data_formatted = join_bytes_into_uint32_t(&data[0]);
+  const uint64_t total_frames_and_flags =
+      join_bytes_into_uint64_t(&data[BYTES_INSIDE_INT32]);
+  job->header_info.total_frames =
+      total_frames_and_flags & ~(HEADER_FLAG_ZERO_EXTENTS | HEADER_FLAG_AEAD |
+                                 HEADER_FLAG_FRAME_TAGS);
+  if (!(total_frames_and_flags & HEADER_FLAG_FRAME_TAGS) !=
+      (job->tag_length == 0))
+    return FALSE;
+  job->header_info.last_frame =
+      join_bytes_into_uint64_t(&data[BYTES_INSIDE_INT32 + BYTES_INSIDE_INT64]);
+
+  const uint32_t formatted = job->header_info.data_formatted;
+  job->header_info.last_byte_row = formatted >> 20;
+  job->header_info.last_byte_column = (formatted >> 8) & 0xFFF;
+  job->header_info.last_channel_and_extension_length = formatted & 0xFF;
+  job->ext_length = formatted & 0x3F;
+  job->header_length = HEADER_INFO_LENGTH + job->ext_length;
+
+  // Il numero di zone di zeri sta subito dopo l'estensione, quindi sempre
+  // nella prima riga, le zone vere e proprie le legge extract_header()
+  if (total_frames_and_flags & HEADER_FLAG_ZERO_EXTENTS) {
+    job->n_zero_extents = join_bytes_into_uint64_t(&data[job->header_length]);
+    if (job->n_zero_extents == 0 || job->n_zero_extents > ZERO_EXTENTS_MAX)
+      return FALSE;
+    job->header_length +=
+        BYTES_INSIDE_INT64 + job->n_zero_extents * ZERO_EXTENT_LENGTH;
+  }
+  // Il cifrario e la base dei nonce li legge extract_header(), qui serve solo
+  // sapere che l'header è più lungo e che ogni frame finisce con il tag
+  if (total_frames_and_flags & HEADER_FLAG_AEAD) {
+    job->header_length += AEAD_HEADER_LENGTH;
+    job->frame_capacity = PNG_TOTAL_BYTES - AEAD_TAG_LENGTH;
+  }
+
+  const uint64_t bytes_last_chunk =
+      (uint64_t)job->header_info.last_byte_row * BYTES_PER_ROW +
+      job->header_info.last_byte_column * BYTES_PER_PIXEL +
+      ((formatted >> 6) & 0x3);
+
+  if (job->header_info.total_frames == 0 ||
+      job->header_info.last_frame != job->header_info.total_frames - 1 ||
+      job->header_info.last_byte_column >= WIDTH_DEFAULT ||
+      bytes_last_chunk <= job->tag_length ||
+      bytes_last_chunk > job->frame_capacity ||
+      (job->header_info.total_frames == 1 &&
+       bytes_last_chunk < job->tag_length + job->header_length))
+    return FALSE;
+
+  job->payload_size = job->header_info.last_frame *
+                          (job->frame_capacity - job->tag_length) +
+                      bytes_last_chunk - job->tag_length - job->header_length;
+  job->file_size = job->payload_size;
+  return TRUE;
+}
+
+// Copia l'header completo (letto con le righe necessarie a contenerlo) e
+// ricostruisce la tabella delle zone di zeri e i parametri della cifratura.
+// Ritorna FALSE se le zone non sono ordinate o escono dal file, oppure se il
+// cifrario non è conosciuto.
+uint8_t extract_header(const uint8_t *data, job_t *job) {
+  job->header = (uint8_t *)malloc(job->header_length);
+  if (!job->header) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(job->header, data, job->header_length);
+
+  if (job->frame_capacity < PNG_TOTAL_BYTES) {
+    const uint32_t aead_index = job->header_length - AEAD_HEADER_LENGTH;
+    job->cipher = data[aead_index];
+    if (job->cipher != AEAD_AES_256_GCM &&
+        job->cipher != AEAD_CHACHA20_POLY1305)
+      return FALSE;
+    memcpy(job->nonce_base, &data[aead_index + 1], AEAD_NONCE_LENGTH);
+  }
+
+  if (job->n_zero_extents == 0)
+    return TRUE;
+
+  job->zero_extents =
+      (zero_extent_t *)malloc(sizeof(zero_extent_t) * job->n_zero_extents);
+  if (!job->zero_extents) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t byte_index =
+      HEADER_INFO_LENGTH + job->ext_length + BYTES_INSIDE_INT64;
+  uint64_t zeros = 0, end_of_previous = 0;
+  for (uint64_t i = 0; i < job->n_zero_extents; i++) {
+    zero_extent_t *extent = &job->zero_extents[i];
+    extent->offset = join_bytes_into_uint64_t(&data[byte_index]);
+    byte_index += BYTES_INSIDE_INT64;
+    extent->length = join_bytes_into_uint64_t(&data[byte_index]);
+    byte_index += BYTES_INSIDE_INT64;
+
+    if (extent->offset < end_of_previous || extent->length == 0 ||
+        extent->offset - zeros > job->payload_size)
+      return FALSE;
+    extent->payload_offset = extent->offset - zeros;
+    zeros += extent->length;
+    end_of_previous = extent->offset + extent->length;
+  }
+
+  job->file_size = job->payload_size + zeros;
+  return TRUE;
+}
+
+// Costruisce il nome del frame "<base>_<n>.png", la stringa va liberata
+char *build_frame_filename(const char *base_output_filename,
+                           const uint64_t frame) {
+  // Calcolo prima la lunghezza necessaria, così alloco esattamente lo spazio
+  // che serve (+1 per il carattere terminatore)
+  const int length =
+      snprintf(NULL, 0, "%s_%llu.png", base_output_filename, frame);
+  char *output_filename = (char *)malloc(length + 1);
+  if (!output_filename) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(output_filename, length + 1, "%s_%llu.png", base_output_filename,
+           frame);
+  return output_filename;
+}
+
+// Aggiunge un suffisso ad un nome di file, usato per i file temporanei che poi
+// vengono rinominati, la stringa va liberata
+char *append_suffix(const char *filename, const char *suffix) {
+  char *tmp_filename = (char *)malloc(strlen(filename) + strlen(suffix) + 1);
+  if (!tmp_filename) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(tmp_filename, filename);
+  strcat(tmp_filename, suffix);
+  return tmp_filename;
+}
+
+// libpng scrive il PNG a blocchi di PNG_WRITE_BUFFER_SIZE bytes attraverso
+// write_buffered_file(), che rispetta il limite di --qos e misura la latenza.
+// Ogni blocco scritto è una fase write nella traccia, dentro la fase deflate,
+// così un disco lento non si confonde con la compressione.
+struct PNG_FILE_OUTPUT {
+  int fd;
+  uint64_t offset;
+  uint8_t *buffer;
+  uint32_t used;
+} typedef png_file_output_t;
+
+void png_file_flush(png_structp png) {
+  png_file_output_t *output = png_get_io_ptr(png);
+  if (output->used == 0)
+    return;
+  TRACE_BEGIN(write);
+  if (!write_buffered_file(output->fd, output->buffer, output->offset,
+                           output->used))
+    png_error(png, "write error");
+  TRACE_END(write);
+  output->offset += output->used;
+  output->used = 0;
+}
+
+void png_file_write(png_structp png, png_bytep data, png_size_t length) {
+  png_file_output_t *output = png_get_io_ptr(png);
+  while (length > 0) {
+    const uint32_t room = PNG_WRITE_BUFFER_SIZE - output->used;
+    const uint32_t n = length < room ? length : room;
+    memcpy(output->buffer + output->used, data, n);
+    output->used += n;
+    data += n;
+    length -= n;
+    if (output->used == PNG_WRITE_BUFFER_SIZE)
+      png_file_flush(png);
+  }
+}
+
+// Funzione per scrivere un file PNG, una riga alla volta: 'get_row' ritorna il
+// puntatore alla riga y, che può stare dentro un frame intero in memoria
+// oppure essere appena stata letta dal file (modalità --stream). Il frame è
+// alto 'rows' righe, meno di height solo per i frame live, e viene compresso
+// con il livello 'level' di zlib.
+// Il frame viene scritto prima in "<filename>.tmp" e solo alla fine rinominato,
+// così se il processo muore a metà non rimane mai un frame troncato con il nome
+// definitivo (stessa idea di create_temp_dir(): si lavora in un posto
+// temporaneo e poi si rende visibile il risultato)
+void write_png_rows(char *filename, const int rows,
+                    png_bytep (*get_row)(void *, int), void *context,
+                    const int level) {
+  char *tmp_filename = append_suffix(filename, TMP_SUFFIX);
+  FILE *fp = fopen(tmp_filename,
                    "wb"); // Apre il file per la scrittura in modalità binaria
   if (!fp)
     exit(EXIT_FAILURE);
@@ -324,250 +1832,4967 @@ void write_png_file(char *filename) {
     exit(ERROR_PNG_WRITE_ELABORATION);
   }
 
-  // Inizializza l'output per scrivere nel file
-  png_init_io(png, fp);
+  // Inizializza l'output per scrivere nel file, il buffer conta nella
+  // memoria dei frame
+  png_file_output_t output = {fileno(fp), 0, NULL, 0};
+  output.buffer = (uint8_t *)malloc(PNG_WRITE_BUFFER_SIZE);
+  if (!output.buffer) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  memory_charge(PNG_WRITE_BUFFER_SIZE);
+  png_set_write_fn(png, &output, png_file_write, png_file_flush);
 
   // Imposta le informazioni dell'immagine di output (larghezza, altezza,
   // formato RGBA)
-  png_set_IHDR(png, info, width, height,
+  png_set_IHDR(png, info, width, rows,
                8,                            // 8 bit di profondità
                PNG_COLOR_TYPE_RGB,           // Formato colore RGB
                PNG_INTERLACE_NONE,           // Senza interlacciamento
                PNG_COMPRESSION_TYPE_DEFAULT, // Compressione di default
                PNG_FILTER_TYPE_DEFAULT       // Filtro di default
   );
+  png_set_compression_level(png, level);
+  TRACE_BEGIN(deflate);
   png_write_info(png, info); // Scrive le informazioni dell'immagine nel file
 
-  // Controlla se l'immagine è stata allocata
-  if (!image_data)
-    exit(EXIT_FAILURE);
+  // Scrive i dati dell'immagine, è quello che fa png_write_image() ma senza
+  // bisogno dell'array con i puntatori a tutte le righe
+  for (int y = 0; y < rows; y++)
+    png_write_row(png, get_row(context, y));
+  png_write_end(png, NULL); // Termina la scrittura
+  png_file_flush(png);
+  free(output.buffer);
+  memory_charge(-(int64_t)PNG_WRITE_BUFFER_SIZE);
+  TRACE_END(deflate);
 
-  // Crea un array di puntatori, uno per ogni riga
-  png_bytep *row_pointers = (png_bytep *)malloc(sizeof(png_bytep) * height);
-  if (!row_pointers) {
-    fclose(fp);
-    exit(ERROR_ROWS_NOT_ALLOCATED);
-  }
+  // In strict il frame deve essere su disco prima di diventare visibile
+  TRACE_BEGIN(write);
+  struct timespec sync_start;
+  clock_gettime(CLOCK_MONOTONIC, &sync_start);
+  if (durability == DURABILITY_STRICT)
+    sync_fd(fileno(fp), tmp_filename);
 
-  // Imposta ciascun puntatore per puntare all'inizio di ogni riga in image_data
-  for (int y = 0; y < height; y++)
-    row_pointers[y] = &(image_data[calculate_offset(y, 0) * BYTES_PER_PIXEL]);
+  // Chiudo il file di output, se fallisce il frame potrebbe essere troncato
+  if (fclose(fp) != 0) {
+    perror("fclose error: ");
+    exit(ERROR_FRAME_COMMIT);
+  }
 
-  // Scrive i dati dell'immagine
-  png_write_image(png, row_pointers);
-  png_write_end(png, NULL); // Termina la scrittura
+  // Rendo visibile il frame solo ora che è completo
+  if (rename(tmp_filename, filename) != 0) {
+    perror("rename error: ");
+    exit(ERROR_FRAME_COMMIT);
+  }
+  if (durability == DURABILITY_STRICT) {
+    sync_parent_directory(filename);
+    record_latency(&sync_stats, elapsed_seconds(&sync_start), FALSE);
+  }
+  TRACE_END(write);
 
-  // Chiudo il file di output
-  fclose(fp);
+  free(tmp_filename);
 
   // Libera le strutture allocate per la scrittura dell'immagine
   png_destroy_write_struct(&png, &info);
 }
 
-// da finire
-void convert_file(FILE *fp, const char *filename,
+// Entropia di ordine 0 in bit per byte, 8 per dati casuali e 0 per un byte
+// ripetuto
+double byte_entropy(const uint64_t *counts, const uint64_t total) {
+  double entropy = 0.0;
+  for (int i = 0; i < 256; i++) {
+    if (counts[i] == 0)
+      continue;
+    const double p = (double)counts[i] / total;
+    entropy -= p * log2(p);
+  }
+  return entropy;
+}
+
+// Fascia di entropia di un blocco di dati
+uint32_t entropy_band(const double entropy) {
+  if (entropy < ENTROPY_LOW_MAX)
+    return 0;
+  return entropy < ENTROPY_HIGH_MIN ? 1 : 2;
+}
+
+// Livello di compressione per un frame in memoria: quello della sua fascia di
+// entropia se c'è un profilo, altrimenti quello globale
+int frame_compression_level(const uint8_t *data, const uint64_t length) {
+  if (!profile.loaded)
+    return compression_level;
+  uint64_t counts[256] = {0}, sampled = 0;
+  for (uint64_t i = 0; i < ENTROPY_SAMPLES; i++) {
+    const uint64_t offset = i * (length / ENTROPY_SAMPLES);
+    const uint64_t end = offset + ENTROPY_SAMPLE_BYTES < length
+                             ? offset + ENTROPY_SAMPLE_BYTES
+                             : length;
+    for (uint64_t j = offset; j < end; j++)
+      counts[data[j]]++;
+    sampled += end - offset;
+  }
+  return profile.levels[entropy_band(byte_entropy(counts, sampled))];
+}
+
+// Riga y di un frame che sta tutto in memoria
+png_bytep frame_row(void *context, const int y) {
+  return &((png_bytep)context)[calculate_offset(y, 0) * BYTES_PER_PIXEL];
+}
+
+// Scrive un frame che sta tutto in memoria in image_data
+void write_png_file(char *filename, png_bytep image_data) {
+  // Controlla se l'immagine è stata allocata
+  if (!image_data)
+    exit(EXIT_FAILURE);
+
+  PROBE1(png_start, filename);
+  write_png_rows(filename, height, frame_row, image_data,
+                 frame_compression_level(image_data, PNG_TOTAL_BYTES));
+  PROBE1(png_done, filename);
+}
+
+// Comprime le righe come write_png_rows() ma passa i bytes del PNG a
+// 'write_data' invece di scriverli in un file: --plan li conta soltanto e
+// --stripe li tiene in memoria per il writer della cartella del frame
+void write_png_rows_to(const int rows, png_bytep (*get_row)(void *, int),
+                       void *context, png_rw_ptr write_data, void *io,
+                       const int level) {
+  png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png)
+    exit(ERROR_PNG_STRUCT_WRITE_CREATION);
+  png_infop info = png_create_info_struct(png);
+  if (!info)
+    exit(ERROR_PNG_INFO_STRUCT_CREATION);
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_write_struct(&png, &info);
+    exit(ERROR_PNG_WRITE_ELABORATION);
+  }
+
+  png_set_write_fn(png, io, write_data, NULL);
+  png_set_IHDR(png, info, width, rows, 8, PNG_COLOR_TYPE_RGB,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_set_compression_level(png, level);
+  png_write_info(png, info);
+  for (int y = 0; y < rows; y++)
+    png_write_row(png, get_row(context, y));
+  png_write_end(png, NULL);
+
+  png_destroy_write_struct(&png, &info);
+}
+
+// Conta i bytes prodotti da libpng senza scriverli da nessuna parte
+static void count_png_bytes(png_structp png, png_bytep data, png_size_t length) {
+  (void)data;
+  *(uint64_t *)png_get_io_ptr(png) += length;
+}
+
+// Ritorna la dimensione del PNG con le prime 'rows' righe di image_data,
+// serve a --plan per misurare compressione e velocità sui dati veri e a
+// --tune per provare i livelli sui dati sintetici
+uint64_t measure_png_rows(png_bytep image_data, const int rows,
+                          const int level) {
+  uint64_t png_bytes = 0;
+  write_png_rows_to(rows, frame_row, image_data, count_png_bytes, &png_bytes,
+                    level);
+  return png_bytes;
+}
+
+// PNG compresso in memoria
+struct PNG_BUFFER {
+  uint8_t *data;
+  uint64_t length, capacity;
+} typedef png_buffer_t;
+
+static void append_png_bytes(png_structp png, png_bytep data,
+                             png_size_t length) {
+  png_buffer_t *buffer = (png_buffer_t *)png_get_io_ptr(png);
+  if (buffer->length + length > buffer->capacity) {
+    uint64_t capacity = buffer->capacity ? buffer->capacity : BUFFER_SIZE;
+    while (capacity < buffer->length + length)
+      capacity *= 2;
+    buffer->data = (uint8_t *)realloc(buffer->data, capacity);
+    if (!buffer->data) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+    buffer->capacity = capacity;
+  }
+  memcpy(&buffer->data[buffer->length], data, length);
+  buffer->length += length;
+}
+
+// Scrive un PNG già compresso, con la stessa rinomina atomica di
+// write_png_rows()
+void write_png_buffer(const char *filename, const png_buffer_t *buffer) {
+  TRACE_BEGIN(write);
+  char *tmp_filename = append_suffix(filename, TMP_SUFFIX);
+  const int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || !write_buffered_file(fd, buffer->data, 0, buffer->length)) {
+    perror(filename);
+    exit(ERROR_FRAME_COMMIT);
+  }
+
+  struct timespec sync_start;
+  clock_gettime(CLOCK_MONOTONIC, &sync_start);
+  if (durability == DURABILITY_STRICT)
+    sync_fd(fd, tmp_filename);
+  if (close(fd) != 0 || rename(tmp_filename, filename) != 0) {
+    perror(filename);
+    exit(ERROR_FRAME_COMMIT);
+  }
+  if (durability == DURABILITY_STRICT) {
+    sync_parent_directory(filename);
+    record_latency(&sync_stats, elapsed_seconds(&sync_start), FALSE);
+  }
+  free(tmp_filename);
+  TRACE_END(write);
+}
+
+// Frame letti con il lettore veloce e con libpng (formato inatteso o
+// rovinato)
+struct PNG_READ_STATS {
+  pthread_mutex_t lock;
+  uint64_t fast, fallback;
+} typedef png_read_stats_t;
+
+png_read_stats_t png_read_stats = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Riga di zeri, fa da riga precedente per la prima riga del frame
+static const uint8_t zero_row[BYTES_PER_ROW];
+
+#if defined(__SSE2__)
+// Un pixel (3 byte) nei byte bassi di un registro. Il valore si compone nei
+// registri: con memcpy() di 3 byte il compilatore passa dallo stack e ogni
+// pixel aspetta lo store precedente.
+static inline __m128i load_pixel(const uint8_t *p) {
+  uint16_t low;
+  memcpy(&low, p, 2);
+  return _mm_cvtsi32_si128(low | (uint32_t)p[2] << 16);
+}
+
+static inline void store_pixel(uint8_t *p, const __m128i pixel) {
+  const uint32_t value = _mm_cvtsi128_si32(pixel);
+  const uint16_t low = value;
+  memcpy(p, &low, 2);
+  p[2] = value >> 16;
+}
+
+// 'mask' ? x : y, per ogni lane
+static inline __m128i select_si128(const __m128i mask, const __m128i x,
+                                   const __m128i y) {
+  return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+static inline __m128i abs_epi16(const __m128i x) {
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+#endif
+
+// Predittore di Paeth della specifica PNG
+static inline uint8_t paeth_predictor(const int a, const int b, const int c) {
+  const int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+// Toglie il filtro dalla riga sul posto, 'prev' è la riga precedente già
+// ricostruita. Sub, Avg e Paeth dipendono dal pixel a sinistra, quindi con
+// SSE2 si lavora un pixel alla volta con i tre canali in parallelo; Up non
+// ha dipendenze e va a 16 byte alla volta. Ritorna FALSE per un filtro
+// sconosciuto.
+uint8_t unfilter_row(const uint8_t filter, uint8_t *row, const uint8_t *prev) {
+  uint32_t i = 0;
+  switch (filter) {
+  case PNG_FILTER_VALUE_NONE:
+    return TRUE;
+
+  case PNG_FILTER_VALUE_SUB:
+#if defined(__SSE2__)
+  {
+    __m128i a = _mm_setzero_si128();
+    for (; i < BYTES_PER_ROW; i += BYTES_PER_PIXEL) {
+      a = _mm_add_epi8(load_pixel(&row[i]), a);
+      store_pixel(&row[i], a);
+    }
+  }
+#else
+    for (i = BYTES_PER_PIXEL; i < BYTES_PER_ROW; i++)
+      row[i] += row[i - BYTES_PER_PIXEL];
+#endif
+    return TRUE;
+
+  case PNG_FILTER_VALUE_UP:
+#if defined(__SSE2__)
+    for (; i + 16 <= BYTES_PER_ROW; i += 16)
+      _mm_storeu_si128(
+          (__m128i *)&row[i],
+          _mm_add_epi8(_mm_loadu_si128((const __m128i *)&row[i]),
+                       _mm_loadu_si128((const __m128i *)&prev[i])));
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= BYTES_PER_ROW; i += 16)
+      vst1q_u8(&row[i], vaddq_u8(vld1q_u8(&row[i]), vld1q_u8(&prev[i])));
+#endif
+    for (; i < BYTES_PER_ROW; i++)
+      row[i] += prev[i];
+    return TRUE;
+
+  case PNG_FILTER_VALUE_AVG:
+#if defined(__SSE2__)
+  {
+    // _mm_avg_epu8 arrotonda per eccesso, il PNG per difetto
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+    for (; i < BYTES_PER_ROW; i += BYTES_PER_PIXEL) {
+      const __m128i b = load_pixel(&prev[i]);
+      const __m128i average = _mm_sub_epi8(
+          _mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+      a = _mm_add_epi8(load_pixel(&row[i]), average);
+      store_pixel(&row[i], a);
+    }
+  }
+#else
+    for (; i < BYTES_PER_PIXEL; i++)
+      row[i] += prev[i] >> 1;
+    for (; i < BYTES_PER_ROW; i++)
+      row[i] += (row[i - BYTES_PER_PIXEL] + prev[i]) >> 1;
+#endif
+    return TRUE;
+
+  case PNG_FILTER_VALUE_PAETH:
+#if defined(__SSE2__)
+  {
+    // a = pixel a sinistra, b = sopra, c = sopra a sinistra, a 16 bit
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero, c = zero;
+    for (; i < BYTES_PER_ROW; i += BYTES_PER_PIXEL) {
+      const __m128i b = _mm_unpacklo_epi8(load_pixel(&prev[i]), zero);
+      const __m128i p = _mm_sub_epi16(b, c), q = _mm_sub_epi16(a, c);
+      const __m128i pa = abs_epi16(p), pb = abs_epi16(q),
+                    pc = abs_epi16(_mm_add_epi16(p, q));
+      const __m128i smallest = _mm_min_epi16(_mm_min_epi16(pa, pb), pc);
+      const __m128i predictor =
+          select_si128(_mm_cmpeq_epi16(pa, smallest), a,
+                       select_si128(_mm_cmpeq_epi16(pb, smallest), b, c));
+      const __m128i pixel = _mm_add_epi8(
+          load_pixel(&row[i]), _mm_packus_epi16(predictor, predictor));
+      store_pixel(&row[i], pixel);
+      a = _mm_unpacklo_epi8(pixel, zero);
+      c = b;
+    }
+  }
+#else
+    for (; i < BYTES_PER_PIXEL; i++)
+      row[i] += prev[i];
+    for (; i < BYTES_PER_ROW; i++)
+      row[i] += paeth_predictor(row[i - BYTES_PER_PIXEL], prev[i],
+                                prev[i - BYTES_PER_PIXEL]);
+#endif
+    return TRUE;
+  }
+  return FALSE;
+}
+
+// Stato del lettore veloce: il file mappato in memoria e lo stream di zlib
+// che scorre i chunk IDAT
+struct PNG_FAST_READER {
+  const uint8_t *file;
+  uint64_t size, offset; // offset del prossimo chunk
+  z_stream stream;
+  uint8_t ended; // zlib ha trovato la fine dello stream
+} typedef png_fast_reader_t;
+
+// Passa al prossimo chunk IDAT saltando quelli ancillari. Ritorna FALSE alla
+// fine dei dati, se il file è troncato o se c'è un chunk critico sconosciuto.
+uint8_t next_idat(png_fast_reader_t *reader) {
+  while (reader->offset + 12 <= reader->size) {
+    const uint8_t *chunk = &reader->file[reader->offset];
+    const uint32_t length = join_bytes_into_uint32_t(chunk);
+    if (length > reader->size - reader->offset - 12)
+      return FALSE;
+    reader->offset += 12 + (uint64_t)length;
+    if (memcmp(&chunk[4], "IDAT", 4) == 0) {
+      reader->stream.next_in = (Bytef *)&chunk[8];
+      reader->stream.avail_in = length;
+      return TRUE;
+    }
+    // il quinto bit del primo carattere a 0 indica un chunk critico
+    if (!(chunk[4] & 0x20))
+      return FALSE;
+  }
+  return FALSE;
+}
+
+// Decomprime esattamente 'length' bytes in 'out', prendendo l'input dagli
+// IDAT uno dopo l'altro
+uint8_t inflate_exact(png_fast_reader_t *reader, uint8_t *out,
+                      const uint32_t length) {
+  reader->stream.next_out = out;
+  reader->stream.avail_out = length;
+  while (reader->stream.avail_out > 0) {
+    if (reader->ended ||
+        (reader->stream.avail_in == 0 && !next_idat(reader)))
+      return FALSE;
+    const int status = inflate(&reader->stream, Z_NO_FLUSH);
+    if (status == Z_STREAM_END)
+      reader->ended = TRUE;
+    else if (status != Z_OK &&
+             !(status == Z_BUF_ERROR && reader->stream.avail_in == 0))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+// Lettore veloce per i frame scritti da noi, riconosciuti dall'IHDR: RGB a 8
+// bit, largo width, senza interlacciamento. Il file viene mappato in memoria,
+// gli IDAT vengono decompressi con zlib direttamente nelle righe del frame e
+// i filtri tolti sul posto, senza le trasformazioni generiche di libpng e
+// senza copie. Il CRC degli IDAT non viene controllato, i dati sono coperti
+// dall'adler32 di zlib, che si controlla quando si legge tutto il frame.
+// Ritorna FALSE per qualsiasi cosa inattesa, e allora si riprova con libpng.
+uint8_t read_png_fast(const char *filename, png_bytep image_data,
+                      const int rows) {
+  static const uint8_t iend[12] = {0x00, 0x00, 0x00, 0x00, 'I',  'E',
+                                   'N',  'D',  0xAE, 0x42, 0x60, 0x82};
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return FALSE;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 33 + 12) {
+    close(fd);
+    return FALSE;
+  }
+  png_fast_reader_t reader;
+  memset(&reader, 0, sizeof(reader));
+  reader.size = st.st_size;
+  reader.file = (const uint8_t *)mmap(NULL, reader.size, PROT_READ,
+                                      MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (reader.file == MAP_FAILED)
+    return FALSE;
+#ifdef MADV_SEQUENTIAL
+  madvise((void *)reader.file, reader.size, MADV_SEQUENTIAL);
+#endif
+
+  // Firma e IHDR: 4 lunghezza + 4 tipo + 13 dati + 4 crc
+  const uint8_t *ihdr = &reader.file[8];
+  const uint32_t frame_height = join_bytes_into_uint32_t(&ihdr[12]);
+  uint8_t is_valid =
+      png_sig_cmp(reader.file, 0, 8) == 0 &&
+      join_bytes_into_uint32_t(ihdr) == 13 && memcmp(&ihdr[4], "IHDR", 4) == 0 &&
+      join_bytes_into_uint32_t(&ihdr[8]) == (uint32_t)width &&
+      frame_height >= (uint32_t)rows && frame_height <= (uint32_t)height &&
+      ihdr[16] == 8 && ihdr[17] == PNG_COLOR_TYPE_RGB && ihdr[18] == 0 &&
+      ihdr[19] == 0 && ihdr[20] == PNG_INTERLACE_NONE &&
+      crc32(0, &ihdr[4], 17) == join_bytes_into_uint32_t(&ihdr[21]);
+  reader.offset = 33;
+  if (!is_valid || inflateInit(&reader.stream) != Z_OK) {
+    munmap((void *)reader.file, reader.size);
+    return FALSE;
+  }
+
+  for (int y = 0; is_valid && y < rows; y++) {
+    png_bytep row = &image_data[calculate_offset(y, 0) * BYTES_PER_PIXEL];
+    uint8_t filter;
+    is_valid = inflate_exact(&reader, &filter, 1) &&
+               inflate_exact(&reader, row, BYTES_PER_ROW) &&
+               unfilter_row(filter, row,
+                            y > 0 ? row - BYTES_PER_ROW : zero_row);
+  }
+
+  // Se ho letto tutto il frame lo stream deve finire lì (così zlib controlla
+  // l'adler32) e il file deve terminare con IEND
+  if (is_valid && (uint32_t)rows == frame_height) {
+    uint8_t extra;
+    while (!reader.ended && is_valid) {
+      reader.stream.next_out = &extra;
+      reader.stream.avail_out = 1;
+      if (reader.stream.avail_in == 0 && !next_idat(&reader)) {
+        is_valid = FALSE;
+        break;
+      }
+      const int status = inflate(&reader.stream, Z_NO_FLUSH);
+      is_valid = reader.stream.avail_out == 1 &&
+                 (status == Z_OK || status == Z_STREAM_END ||
+                  (status == Z_BUF_ERROR && reader.stream.avail_in == 0));
+      reader.ended = status == Z_STREAM_END;
+    }
+    is_valid = is_valid &&
+               memcmp(&reader.file[reader.size - sizeof(iend)], iend,
+                      sizeof(iend)) == 0;
+  }
+
+  inflateEnd(&reader.stream);
+  munmap((void *)reader.file, reader.size);
+  return is_valid;
+}
+
+void print_png_read_stats() {
+  pthread_mutex_lock(&png_read_stats.lock);
+  if (png_read_stats.fast + png_read_stats.fallback > 0)
+    printf("Lettura PNG: %llu frame con il lettore veloce, %llu con libpng\n",
+           png_read_stats.fast, png_read_stats.fallback);
+  pthread_mutex_unlock(&png_read_stats.lock);
+}
+
+// Legge un frame PNG con libpng, per i file che il lettore veloce non
+// riconosce. Come read_png_file() di example_libpng.c ma senza conversioni,
+// visto che i frame sono sempre RGB a 8 bit.
+uint8_t read_png_libpng(const char *filename, png_bytep image_data,
+                        const int rows) {
+  FILE *fp = fopen(filename, "rb"); // Apre il file PNG in modalità binaria
+  if (!fp)
+    return FALSE;
+
+  // Crea una struttura per leggere il PNG
+  png_structp png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png) {
+    fclose(fp);
+    return FALSE;
+  }
+
+  // Crea una struttura per le informazioni del PNG
+  png_infop info = png_create_info_struct(png);
+  if (!info) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    fclose(fp);
+    return FALSE;
+  }
+
+  // Imposta il salto in caso di errore
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
+    return FALSE;
+  }
+
+  // Inizializza la lettura del file PNG e legge le informazioni principali
+  png_init_io(png, fp);
+  png_read_info(png, info);
+
+  // Deve essere un frame con la geometria usata in scrittura
+  const png_uint_32 frame_height = png_get_image_height(png, info);
+  if (png_get_image_width(png, info) != (png_uint_32)width ||
+      frame_height < (png_uint_32)rows || frame_height > (png_uint_32)height ||
+      png_get_color_type(png, info) != PNG_COLOR_TYPE_RGB ||
+      png_get_bit_depth(png, info) != 8 ||
+      png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
+    return FALSE;
+  }
+
+  // Legge le righe una alla volta direttamente nel buffer del frame
+  for (int y = 0; y < rows; y++)
+    png_read_row(png, &image_data[calculate_offset(y, 0) * BYTES_PER_PIXEL],
+                 NULL);
+
+  // Se ho letto tutto il frame controllo anche la fine del file (CRC e IEND)
+  if ((png_uint_32)rows == frame_height)
+    png_read_end(png, NULL);
+
+  png_destroy_read_struct(&png, &info, NULL);
+  fclose(fp);
+  return TRUE;
+}
+
+// Funzione per leggere un frame PNG scritto da write_png_file() dentro
+// image_data, prima con il lettore veloce e poi, se non ce la fa, con libpng.
+// Legge solo le prime 'rows' righe (per l'header basta la prima), un frame
+// live può essere più basso di height ma deve avere almeno 'rows' righe.
+// Invece di terminare il programma ritorna FALSE se il file manca o non è un
+// frame valido, così nel demone un frame rovinato fa fallire solo la sua
+// richiesta.
+uint8_t read_png_file(const char *filename, png_bytep image_data,
+                      const int rows) {
+  const uint8_t fast = read_png_fast(filename, image_data, rows);
+  pthread_mutex_lock(&png_read_stats.lock);
+  if (fast)
+    png_read_stats.fast++;
+  else
+    png_read_stats.fallback++;
+  pthread_mutex_unlock(&png_read_stats.lock);
+  return fast || read_png_libpng(filename, image_data, rows);
+}
+
+// Costruisce il nome del journal "<base>.journal", la stringa va liberata
+char *build_journal_filename(const char *base_output_filename) {
+  return append_suffix(base_output_filename, JOURNAL_SUFFIX);
+}
+
+// Salva il journal con i progressi della codifica. Anche qui scrivo prima su un
+// file temporaneo e poi rinomino, così il journal è sempre o quello vecchio o
+// quello nuovo, mai una via di mezzo
+void write_journal(const char *base_output_filename,
+                   const journal_info_t *journal) {
+  char *journal_filename = build_journal_filename(base_output_filename);
+  char *tmp_filename = append_suffix(journal_filename, TMP_SUFFIX);
+
+  FILE *fp = fopen(tmp_filename, "w");
+  if (!fp) {
+    perror("journal: error ->");
+    exit(ERROR_JOURNAL);
+  }
+
+  fprintf(fp, "%s\n", JOURNAL_MAGIC);
+  fprintf(fp, "file_size %llu\n", journal->file_size);
+  fprintf(fp, "total_frames %llu\n", journal->total_frames);
+  fprintf(fp, "completed_frames %llu\n", journal->completed_frames);
+  fprintf(fp, "input_offset %llu\n", journal->input_offset);
+
+  // Il journal non deve mai dire che ci sono frame che dopo un crash non ci
+  // sono, quindi con la durabilità attiva va su disco anche lui
+  if (durability != DURABILITY_NONE) {
+    if (fflush(fp) != 0) {
+      perror("journal: error ->");
+      exit(ERROR_JOURNAL);
+    }
+    sync_fd(fileno(fp), tmp_filename);
+  }
+  if (fclose(fp) != 0 || rename(tmp_filename, journal_filename) != 0) {
+    perror("journal: error ->");
+    exit(ERROR_JOURNAL);
+  }
+  if (durability != DURABILITY_NONE)
+    sync_parent_directory(journal_filename);
+
+  free(tmp_filename);
+  free(journal_filename);
+}
+
+// Legge il journal, ritorna FALSE se non esiste oppure non è valido
+uint8_t read_journal(const char *base_output_filename,
+                     journal_info_t *journal) {
+  char *journal_filename = build_journal_filename(base_output_filename);
+  FILE *fp = fopen(journal_filename, "r");
+  free(journal_filename);
+  if (!fp)
+    return FALSE;
+
+  char magic[16] = {0};
+  const int fields_read =
+      fscanf(fp,
+             "%15s file_size %llu total_frames %llu completed_frames %llu "
+             "input_offset %llu",
+             magic, &journal->file_size, &journal->total_frames,
+             &journal->completed_frames, &journal->input_offset);
+  fclose(fp);
+
+  return fields_read == 5 && strcmp(magic, JOURNAL_MAGIC) == 0;
+}
+
+// Elimina il journal, si usa quando la codifica è terminata
+void delete_journal(const char *base_output_filename) {
+  char *journal_filename = build_journal_filename(base_output_filename);
+  remove(journal_filename);
+  free(journal_filename);
+}
+
+// Alloca la divisione dei frame tra le cartelle 'roots_list' (separate da
+// virgole), senza ancora assegnare i frame
+stripe_t *allocate_stripe(const char *roots_list, const char *frames_base,
+                          const uint64_t total_frames) {
+  stripe_t *stripe = (stripe_t *)calloc(1, sizeof(stripe_t));
+  char *list = strdup(roots_list);
+  if (!stripe || !list) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+
+  char *save = NULL;
+  for (char *root = strtok_r(list, ",", &save); root;
+       root = strtok_r(NULL, ",", &save)) {
+    stripe->roots =
+        (char **)realloc(stripe->roots, sizeof(char *) * (stripe->n_roots + 1));
+    if (!stripe->roots) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+    stripe->roots[stripe->n_roots++] = strdup(root);
+  }
+  free(list);
+  if (stripe->n_roots == 0) {
+    printf("Nessuna cartella di output in --stripe\n");
+    exit(EXIT_FAILURE);
+  }
+
+  const char *name = strrchr(frames_base, '/');
+  name = name ? name + 1 : frames_base;
+  stripe->frame_bases = (char **)malloc(sizeof(char *) * stripe->n_roots);
+  stripe->total_frames = total_frames;
+  stripe->frame_root = (uint32_t *)calloc(total_frames, sizeof(uint32_t));
+  if (!stripe->frame_bases || !stripe->frame_root) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < stripe->n_roots; i++) {
+    stripe->frame_bases[i] =
+        (char *)malloc(strlen(stripe->roots[i]) + strlen(name) + 2);
+    sprintf(stripe->frame_bases[i], "%s/%s", stripe->roots[i], name);
+  }
+  return stripe;
+}
+
+// Divide i frame tra le cartelle 'roots_list', creando quelle che mancano.
+// Nel manifest finiscono i percorsi assoluti, così si può decodificare da
+// qualsiasi cartella. Con STRIPE_FREE_SPACE ogni frame va nella cartella che,
+// tolti i frame già assegnati (contati come frame non compressi), ha più
+// spazio libero.
+stripe_t *create_stripe(const char *roots_list,
+                        const char *base_output_filename,
+                        const stripe_policy_t policy,
+                        const uint64_t total_frames) {
+  char *list = strdup(roots_list);
+  char *absolute_list = (char *)calloc(strlen(roots_list) + 1, PATH_MAX);
+  if (!list || !absolute_list) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  char *save = NULL;
+  for (char *root = strtok_r(list, ",", &save); root;
+       root = strtok_r(NULL, ",", &save)) {
+    char absolute[PATH_MAX];
+    if ((mkdir(root, 0755) != 0 && errno != EEXIST) ||
+        !realpath(root, absolute)) {
+      perror(root);
+      exit(EXIT_FAILURE);
+    }
+    if (absolute_list[0] != '\0')
+      strcat(absolute_list, ",");
+    strcat(absolute_list, absolute);
+  }
+  free(list);
+
+  stripe_t *stripe =
+      allocate_stripe(absolute_list, base_output_filename, total_frames);
+  free(absolute_list);
+  uint64_t *free_bytes = (uint64_t *)calloc(stripe->n_roots, sizeof(uint64_t));
+  if (!free_bytes) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < stripe->n_roots; i++) {
+    struct statvfs fs;
+    if (statvfs(stripe->roots[i], &fs) == 0)
+      free_bytes[i] = (uint64_t)fs.f_bavail * fs.f_frsize;
+  }
+
+  for (uint64_t frame = 0; frame < total_frames; frame++) {
+    uint32_t root = frame % stripe->n_roots;
+    if (policy == STRIPE_FREE_SPACE) {
+      root = 0;
+      for (uint32_t i = 1; i < stripe->n_roots; i++) {
+        if (free_bytes[i] > free_bytes[root])
+          root = i;
+      }
+      free_bytes[root] = free_bytes[root] > PNG_TOTAL_BYTES
+                             ? free_bytes[root] - PNG_TOTAL_BYTES
+                             : 0;
+    }
+    stripe->frame_root[frame] = root;
+  }
+
+  free(free_bytes);
+  return stripe;
+}
+
+void destroy_stripe(stripe_t *stripe) {
+  for (uint32_t i = 0; i < stripe->n_roots; i++) {
+    free(stripe->roots[i]);
+    free(stripe->frame_bases[i]);
+  }
+  free(stripe->roots);
+  free(stripe->frame_bases);
+  free(stripe->frame_root);
+  free(stripe->writers);
+  free(stripe);
+}
+
+// Salva il manifest "<base>.manifest": le cartelle, una per riga, e poi la
+// cartella di ogni frame. Va scritto prima dei frame, così chi decodifica
+// trova sempre i frame che esistono.
+void write_manifest(const char *base_output_filename,
+                    const stripe_t *stripe) {
+  char *manifest_filename = append_suffix(base_output_filename, MANIFEST_SUFFIX);
+  char *tmp_filename = append_suffix(manifest_filename, TMP_SUFFIX);
+
+  FILE *fp = fopen(tmp_filename, "w");
+  if (!fp) {
+    perror(tmp_filename);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(fp, "%s\nroots %u\n", MANIFEST_MAGIC, stripe->n_roots);
+  for (uint32_t i = 0; i < stripe->n_roots; i++)
+    fprintf(fp, "%s\n", stripe->roots[i]);
+  fprintf(fp, "frames %llu\n", stripe->total_frames);
+  for (uint64_t frame = 0; frame < stripe->total_frames; frame++)
+    fprintf(fp, "%u\n", stripe->frame_root[frame]);
+
+  if (durability != DURABILITY_NONE) {
+    if (fflush(fp) != 0) {
+      perror(manifest_filename);
+      exit(EXIT_FAILURE);
+    }
+    sync_fd(fileno(fp), tmp_filename);
+  }
+  if (fclose(fp) != 0 || rename(tmp_filename, manifest_filename) != 0) {
+    perror(manifest_filename);
+    exit(EXIT_FAILURE);
+  }
+  if (durability != DURABILITY_NONE)
+    sync_parent_directory(manifest_filename);
+  free(tmp_filename);
+  free(manifest_filename);
+}
+
+// Legge il manifest se c'è. Ritorna NULL se i frame non sono divisi tra più
+// cartelle oppure se il manifest non è valido.
+stripe_t *read_manifest(const char *frames_base) {
+  char *manifest_filename = append_suffix(frames_base, MANIFEST_SUFFIX);
+  FILE *fp = fopen(manifest_filename, "r");
+  free(manifest_filename);
+  if (!fp)
+    return NULL;
+
+  char line[PATH_MAX];
+  uint32_t n_roots = 0;
+  uint64_t total_frames = 0;
+  uint8_t is_valid =
+      fgets(line, sizeof(line), fp) &&
+      strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) == 0 &&
+      fscanf(fp, "roots %u\n", &n_roots) == 1 && n_roots > 0;
+
+  // le cartelle vengono ricostruite in una lista come quella di --stripe
+  char *roots_list =
+      is_valid ? (char *)calloc((size_t)n_roots + 1, PATH_MAX) : NULL;
+  is_valid = is_valid && roots_list;
+  for (uint32_t i = 0; is_valid && i < n_roots; i++) {
+    is_valid = fgets(line, sizeof(line), fp) != NULL;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (i > 0)
+      strcat(roots_list, ",");
+    strcat(roots_list, line);
+  }
+  is_valid = is_valid && fscanf(fp, "frames %llu\n", &total_frames) == 1 &&
+             total_frames > 0;
+
+  stripe_t *stripe = NULL;
+  if (is_valid) {
+    stripe = allocate_stripe(roots_list, frames_base, total_frames);
+    for (uint64_t frame = 0; is_valid && frame < total_frames; frame++)
+      is_valid = fscanf(fp, "%u", &stripe->frame_root[frame]) == 1 &&
+                 stripe->frame_root[frame] < n_roots;
+  }
+  fclose(fp);
+  free(roots_list);
+
+  if (!is_valid) {
+    printf("Manifest non valido: %s%s\n", frames_base, MANIFEST_SUFFIX);
+    if (stripe)
+      destroy_stripe(stripe);
+    return NULL;
+  }
+  return stripe;
+}
+
+// Controlla che un frame già scritto sia integro: firma PNG, IHDR con la
+// risoluzione attesa e chunk IEND alla fine del file. Non decomprime i pixel,
+// perchè grazie alla rinomina atomica un frame con il nome definitivo è stato
+// scritto per intero, qui si vuole solo escludere file corrotti o estranei
+uint8_t verify_png_frame(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (!fp)
+    return FALSE;
+
+  // 8 byte di firma + IHDR (4 lunghezza + 4 tipo + 13 dati + 4 crc)
+  uint8_t head[33];
+  // chunk IEND: 4 lunghezza + 4 tipo + 4 crc
+  uint8_t tail[12];
+  static const uint8_t iend[12] = {0x00, 0x00, 0x00, 0x00, 'I',  'E',
+                                   'N',  'D',  0xAE, 0x42, 0x60, 0x82};
+
+  uint8_t is_valid =
+      fread(head, 1, sizeof(head), fp) == sizeof(head) &&
+      png_sig_cmp(head, 0, 8) == 0 && memcmp(&head[12], "IHDR", 4) == 0 &&
+      fseek(fp, -(long)sizeof(tail), SEEK_END) == 0 &&
+      fread(tail, 1, sizeof(tail), fp) == sizeof(tail) &&
+      memcmp(tail, iend, sizeof(iend)) == 0;
+
+  if (is_valid) {
+    const uint32_t frame_width = ((uint32_t)head[16] << 24) |
+                                 ((uint32_t)head[17] << 16) |
+                                 ((uint32_t)head[18] << 8) | head[19];
+    const uint32_t frame_height = ((uint32_t)head[20] << 24) |
+                                  ((uint32_t)head[21] << 16) |
+                                  ((uint32_t)head[22] << 8) | head[23];
+    is_valid = frame_width == (uint32_t)width &&
+               frame_height == (uint32_t)height && head[24] == 8 &&
+               head[25] == PNG_COLOR_TYPE_RGB;
+  }
+
+  fclose(fp);
+  return is_valid;
+}
+
+// Bytes all'inizio di un frame che vengono prima dei dati: la firma e, nel
+// frame 0, l'header
+uint32_t frame_prefix_length(const job_t *job, const uint64_t frame) {
+  return job->tag_length + (frame == 0 ? job->header_length : 0);
+}
+
+// Offset nei dati salvati (il file senza le zone di zeri) da cui parte un
+// certo frame: il primo frame contiene anche l'header, l'estensione e la
+// tabella delle zone di zeri, quindi tutti i successivi sono spostati indietro
+// di quei bytes
+uint64_t frame_input_offset(const job_t *job, const uint64_t frame) {
+  if (frame == 0)
+    return 0;
+  return frame * (job->frame_capacity - job->tag_length) - job->header_length;
+}
+
+// Bytes di dati (header e firma esclusi) contenuti in un frame
+uint32_t frame_data_bytes(const job_t *job, const uint64_t frame) {
+  const uint32_t capacity =
+      job->frame_capacity - frame_prefix_length(job, frame);
+  const uint64_t remaining = job->payload_size - frame_input_offset(job, frame);
+  return remaining < capacity ? remaining : capacity;
+}
+
+// Scrive in 'dest' la firma del frame 'frame' del job
+void pack_frame_tag(const job_t *job, const uint64_t frame, uint8_t *dest) {
+  const uint64_t fields[] = {job->archive_id, frame,
+                             job->header_info.total_frames};
+  uint32_t byte_index = 0;
+  memcpy(dest, FRAME_TAG_MAGIC, 4);
+  byte_index += 4;
+  for (int i = 0; i < 3; i++) {
+    uint8_t *splitted = split_uint64_t_into_bytes(fields[i]);
+    memcpy(&dest[byte_index], splitted, BYTES_INSIDE_INT64);
+    byte_index += BYTES_INSIDE_INT64;
+    free(splitted);
+  }
+  uint8_t *splitted = split_uint32_t_into_bytes(crc32(0, dest, byte_index));
+  memcpy(&dest[byte_index], splitted, BYTES_INSIDE_INT32);
+  free(splitted);
+}
+
+// Legge la firma all'inizio di un frame. Ritorna FALSE se non c'è (un archivio
+// vecchio, un frame live o un'immagine qualsiasi) o se il CRC non torna.
+uint8_t parse_frame_tag(const uint8_t *data, frame_tag_t *tag) {
+  const uint32_t crc_index = FRAME_TAG_LENGTH - BYTES_INSIDE_INT32;
+  if (memcmp(data, FRAME_TAG_MAGIC, 4) != 0 ||
+      crc32(0, data, crc_index) != join_bytes_into_uint32_t(&data[crc_index]))
+    return FALSE;
+  tag->archive_id = join_bytes_into_uint64_t(&data[4]);
+  tag->sequence = join_bytes_into_uint64_t(&data[4 + BYTES_INSIDE_INT64]);
+  tag->total_frames =
+      join_bytes_into_uint64_t(&data[4 + 2 * BYTES_INSIDE_INT64]);
+  return tag->total_frames > 0 && tag->sequence < tag->total_frames;
+}
+
+// Controlla che un frame decodificato sia davvero il frame 'frame' di questo
+// archivio, così un frame rinominato o di un altro archivio viene scartato
+// invece di finire nel posto sbagliato del file
+uint8_t check_frame_tag(const job_t *job, const uint64_t frame,
+                        const uint8_t *data) {
+  frame_tag_t tag;
+  return job->tag_length == 0 ||
+         (parse_frame_tag(data, &tag) && tag.archive_id == job->archive_id &&
+          tag.sequence == frame &&
+          tag.total_frames == job->header_info.total_frames);
+}
+
+// Determina da quale frame ripartire leggendo il journal e verificando i frame
+// già completati. Se un frame non passa la verifica si riparte da lì.
+uint64_t find_resume_frame(const char *base_output_filename,
+                           const job_t *job) {
+  const uint64_t total_frames = job->header_info.total_frames;
+  journal_info_t journal;
+  if (!read_journal(base_output_filename, &journal)) {
+    printf("Resume: nessun journal valido, riparto dal frame 0\n");
+    return 0;
+  }
+
+  // Il journal deve riferirsi allo stesso input, altrimenti non è affidabile
+  if (journal.file_size != job->file_size ||
+      journal.total_frames != total_frames ||
+      journal.completed_frames > total_frames ||
+      journal.input_offset !=
+          (journal.completed_frames == total_frames
+               ? job->payload_size
+               : frame_input_offset(job, journal.completed_frames))) {
+    printf("Resume: il journal non corrisponde all'input, riparto dal frame "
+           "0\n");
+    return 0;
+  }
+
+  for (uint64_t frame = 0; frame < journal.completed_frames; frame++) {
+    char *frame_filename = build_frame_filename(base_output_filename, frame);
+    const uint8_t is_valid = verify_png_frame(frame_filename);
+    free(frame_filename);
+
+    if (!is_valid) {
+      printf("Resume: il frame %llu non è valido, riparto da lì\n", frame);
+      return frame;
+    }
+  }
+
+  printf("Resume: %llu frame su %llu già completati\n",
+         journal.completed_frames, total_frames);
+  return journal.completed_frames;
+}
+
+// Compone i bytes dell'header che vanno all'inizio del primo frame:
+// 4 byte con ultima riga/colonna/canale e lunghezza dell'estensione, 8 byte con
+// il numero di frame, 8 byte con l'indice dell'ultimo frame, i caratteri
+// dell'estensione e poi, se servono, la tabella delle zone di zeri e i
+// parametri della cifratura. Ritorna il numero di bytes scritti in 'dest'.
+uint32_t pack_header(header_info_t *info, const header_info_t *predict_info,
+                     const char *ext_str, const uint8_t ext_length,
+                     const zero_extent_t *zero_extents,
+                     const uint64_t n_zero_extents, const aead_cipher_t cipher,
+                     const uint8_t *nonce_base, const uint8_t frame_tags,
+                     uint8_t *dest) {
+  // Formatto in un uint32_t le informazioni inerenti l'ultima riga,
+  // all'ultima colonna, ultimo canale e lunghezza dell'estensione
+  uint32_t tmp = 0;
+
+  // prima salvo il valore della riga formattata
+  tmp = predict_info->last_byte_row;
+  tmp = tmp << 20;
+  info->data_formatted = tmp;
+
+  // poi salvo il valore della colonna
+  tmp = predict_info->last_byte_column;
+  tmp = tmp << 8;
+  // aggiungo, perchè devo mantere i bit inerenti alla riga
+  info->data_formatted += tmp;
+
+  // aggiungo infine il canale e la lunghezza dell'estensione
+  info->data_formatted += predict_info->last_channel_and_extension_length;
+
+  if (verbose) {
+    printf("Last row: %u\n", predict_info->last_byte_row);
+    printf("Last column: %u\n", predict_info->last_byte_column);
+    printf("Last channel & ext length: %u\n",
+           predict_info->last_channel_and_extension_length);
+    printf("All info together: %u\n", info->data_formatted);
+  }
+
+  // separo in byte le informazioni dell'header
+  uint8_t *data_formatted_splitted =
+      split_uint32_t_into_bytes(info->data_formatted);
+  uint8_t *total_frames_splitted = split_uint64_t_into_bytes(
+      info->total_frames | (n_zero_extents > 0 ? HEADER_FLAG_ZERO_EXTENTS : 0) |
+      (cipher != AEAD_NONE ? HEADER_FLAG_AEAD : 0) |
+      (frame_tags ? HEADER_FLAG_FRAME_TAGS : 0));
+  uint8_t *last_frame_splitted = split_uint64_t_into_bytes(info->last_frame);
+
+  uint32_t byte_index = 0;
+  memcpy(&dest[byte_index], data_formatted_splitted, BYTES_INSIDE_INT32);
+  byte_index += BYTES_INSIDE_INT32;
+  memcpy(&dest[byte_index], total_frames_splitted, BYTES_INSIDE_INT64);
+  byte_index += BYTES_INSIDE_INT64;
+  memcpy(&dest[byte_index], last_frame_splitted, BYTES_INSIDE_INT64);
+  byte_index += BYTES_INSIDE_INT64;
+  for (uint8_t i = 0; i < ext_length; i++)
+    dest[byte_index++] = ext_str[i];
+
+  free(data_formatted_splitted);
+  free(total_frames_splitted);
+  free(last_frame_splitted);
+
+  // Tabella delle zone di zeri: numero di zone e poi offset e lunghezza di
+  // ognuna
+  if (n_zero_extents > 0) {
+    uint8_t *splitted = split_uint64_t_into_bytes(n_zero_extents);
+    memcpy(&dest[byte_index], splitted, BYTES_INSIDE_INT64);
+    byte_index += BYTES_INSIDE_INT64;
+    free(splitted);
+
+    for (uint64_t i = 0; i < n_zero_extents; i++) {
+      splitted = split_uint64_t_into_bytes(zero_extents[i].offset);
+      memcpy(&dest[byte_index], splitted, BYTES_INSIDE_INT64);
+      byte_index += BYTES_INSIDE_INT64;
+      free(splitted);
+
+      splitted = split_uint64_t_into_bytes(zero_extents[i].length);
+      memcpy(&dest[byte_index], splitted, BYTES_INSIDE_INT64);
+      byte_index += BYTES_INSIDE_INT64;
+      free(splitted);
+    }
+  }
+
+  // Cifrario e base dei nonce
+  if (cipher != AEAD_NONE) {
+    dest[byte_index++] = cipher;
+    memcpy(&dest[byte_index], nonce_base, AEAD_NONCE_LENGTH);
+    byte_index += AEAD_NONCE_LENGTH;
+  }
+
+  return byte_index;
+}
+
+// Ritorna TRUE se il blocco contiene solo zeri. Fa l'OR di 64 bytes alla volta
+// con i registri SIMD e controlla il risultato ogni 256 bytes, così sui dati
+// normali si esce quasi subito
+uint8_t is_zero_block(const uint8_t *data, const size_t length) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 256 <= length; i += 256) {
+    __m128i acc = zero;
+    for (size_t j = i; j < i + 256; j += 64) {
+      acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)&data[j]));
+      acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)&data[j + 16]));
+      acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)&data[j + 32]));
+      acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)&data[j + 48]));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+      return FALSE;
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 256 <= length; i += 256) {
+    uint8x16_t acc = vdupq_n_u8(0);
+    for (size_t j = i; j < i + 256; j += 64) {
+      acc = vorrq_u8(acc, vld1q_u8(&data[j]));
+      acc = vorrq_u8(acc, vld1q_u8(&data[j + 16]));
+      acc = vorrq_u8(acc, vld1q_u8(&data[j + 32]));
+      acc = vorrq_u8(acc, vld1q_u8(&data[j + 48]));
+    }
+    if (vmaxvq_u8(acc) != 0)
+      return FALSE;
+  }
+#endif
+  for (; i < length; i++) {
+    if (data[i] != 0)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+// Aggiunge una zona di zeri in fondo alla lista, unendola alla precedente se
+// sono attaccate. Le zone oltre ZERO_EXTENTS_MAX vengono lasciate nei dati.
+void add_zero_extent(job_t *job, uint64_t *capacity, const uint64_t offset,
+                     const uint64_t length) {
+  if (job->n_zero_extents > 0) {
+    zero_extent_t *last = &job->zero_extents[job->n_zero_extents - 1];
+    if (last->offset + last->length == offset) {
+      last->length += length;
+      return;
+    }
+  }
+  if (job->n_zero_extents == ZERO_EXTENTS_MAX)
+    return;
+
+  if (job->n_zero_extents == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    job->zero_extents = (zero_extent_t *)realloc(
+        job->zero_extents, sizeof(zero_extent_t) * *capacity);
+    if (!job->zero_extents) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+  }
+  job->zero_extents[job->n_zero_extents].offset = offset;
+  job->zero_extents[job->n_zero_extents].length = length;
+  job->n_zero_extents++;
+}
+
+// Cerca con la SIMD i blocchi di soli zeri tra 'start' e 'end'
+void scan_zero_blocks(job_t *job, uint64_t *capacity, const int fd,
+                      const uint64_t start, const uint64_t end) {
+  uint8_t *buffer = (uint8_t *)malloc(ZERO_SCAN_BUFFER);
+  if (!buffer) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+
+  for (uint64_t offset = start; offset < end; offset += ZERO_SCAN_BUFFER) {
+    const uint64_t length =
+        end - offset > ZERO_SCAN_BUFFER ? ZERO_SCAN_BUFFER : end - offset;
+    read_buffered_file(fd, buffer, offset, length);
+
+    // solo i blocchi interi, uno spezzone alla fine non vale la pena
+    for (uint64_t block = 0; block + ZERO_SCAN_BLOCK <= length;
+         block += ZERO_SCAN_BLOCK) {
+      if (is_zero_block(&buffer[block], ZERO_SCAN_BLOCK))
+        add_zero_extent(job, capacity, offset + block, ZERO_SCAN_BLOCK);
+    }
+  }
+
+  free(buffer);
+}
+
+// Trova le zone di zeri del file: i buchi con SEEK_DATA/SEEK_HOLE, che non
+// costano nessuna lettura, e con --sparse anche i blocchi di zeri dentro i
+// dati. Alla fine calcola la dimensione dei dati da salvare nei frame.
+void find_zero_extents(job_t *job, const int fd) {
+  uint64_t capacity = 0;
+  uint64_t offset = 0;
+
+  while (offset < job->file_size) {
+    uint64_t data = offset, hole = job->file_size;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    const off_t next_data = lseek(fd, offset, SEEK_DATA);
+    if (next_data >= 0) {
+      data = next_data;
+      const off_t next_hole = lseek(fd, data, SEEK_HOLE);
+      hole = next_hole >= 0 ? (uint64_t)next_hole : job->file_size;
+    } else if (errno == ENXIO) {
+      // da qui alla fine del file è tutto un buco
+      data = job->file_size;
+    }
+#endif
+    if (data > offset)
+      add_zero_extent(job, &capacity, offset, data - offset);
+    if (sparse_scan && hole > data)
+      scan_zero_blocks(job, &capacity, fd, data, hole);
+    offset = hole;
+  }
+
+  // Posizione di ogni zona nei dati salvati
+  uint64_t zeros = 0;
+  for (uint64_t i = 0; i < job->n_zero_extents; i++) {
+    job->zero_extents[i].payload_offset = job->zero_extents[i].offset - zeros;
+    zeros += job->zero_extents[i].length;
+  }
+  job->payload_size = job->file_size - zeros;
+}
+
+// Converte una posizione nei dati salvati nella posizione nel file originale,
+// e dice quanti bytes da lì in poi sono contigui (cioè fino alla prossima zona
+// di zeri)
+uint64_t payload_to_logical(const job_t *job, const uint64_t payload_offset,
+                            uint64_t *contiguous) {
+  // ricerca binaria del numero di zone che stanno prima di payload_offset
+  uint64_t low = 0, high = job->n_zero_extents;
+  while (low < high) {
+    const uint64_t middle = low + (high - low) / 2;
+    if (job->zero_extents[middle].payload_offset <= payload_offset)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  uint64_t logical = payload_offset;
+  if (low > 0) {
+    const zero_extent_t *previous = &job->zero_extents[low - 1];
+    logical = previous->offset + previous->length +
+              (payload_offset - previous->payload_offset);
+  }
+  *contiguous = (low < job->n_zero_extents
+                     ? job->zero_extents[low].payload_offset
+                     : job->payload_size) -
+                payload_offset;
+  return logical;
+}
+
+// Alloca un job vuoto, comune a codifica e decodifica
+job_t *allocate_job(const job_type_t type, const char *filename, const int fd,
+                    const char *frames_base) {
+  job_t *job = (job_t *)calloc(1, sizeof(job_t));
+  if (!job) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  job->type = type;
+  job->filename = strdup(filename);
+  job->fd = fd;
+  job->frames_base = strdup(frames_base);
+  job->frame_capacity = PNG_TOTAL_BYTES;
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->done, NULL);
+  return job;
+}
+
+void destroy_job(job_t *job) {
+  if (job->fd >= 0)
+    close(job->fd);
+  pthread_cond_destroy(&job->done);
+  pthread_mutex_destroy(&job->lock);
+  free(job->frame_done);
+  free(job->leaf_hashes);
+  free(job->frame_corrupt);
+  free(job->header);
+  free(job->zero_extents);
+  free(job->filename);
+  free(job->frames_base);
+  if (job->stripe)
+    destroy_stripe(job->stripe);
+  free(job);
+}
+
+// Identificativo dell'archivio messo nella firma dei frame: i primi 8 byte
+// dello SHA-256 dell'header e di dispositivo, inode e data di modifica
+// dell'input. Non è casuale così un --resume dello stesso file continua con lo
+// stesso identificativo, ma due file diversi (o lo stesso file modificato)
+// hanno archivi diversi anche se hanno la stessa dimensione.
+uint64_t compute_archive_id(const job_t *job, const struct stat *st) {
+  // su macOS la data di modifica con i nanosecondi si chiama st_mtimespec
+#if defined(__APPLE__)
+  const uint64_t identity[] = {st->st_dev, st->st_ino,
+                               st->st_mtimespec.tv_sec,
+                               st->st_mtimespec.tv_nsec};
+#elif defined(__linux__)
+  const uint64_t identity[] = {st->st_dev, st->st_ino, st->st_mtim.tv_sec,
+                               st->st_mtim.tv_nsec};
+#else
+  const uint64_t identity[] = {st->st_dev, st->st_ino, st->st_mtime, 0};
+#endif
+  uint8_t digest[HASH_LENGTH];
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1 ||
+      EVP_DigestUpdate(ctx, job->header, job->header_length) != 1 ||
+      EVP_DigestUpdate(ctx, identity, sizeof(identity)) != 1 ||
+      EVP_DigestFinal_ex(ctx, digest, NULL) != 1) {
+    fprintf(stderr, "Errore nel calcolo di SHA-256\n");
+    exit(EXIT_FAILURE);
+  }
+  EVP_MD_CTX_free(ctx);
+  return join_bytes_into_uint64_t(digest);
+}
+
+// Crea un job di codifica per un file: calcola quanti frame servono e prepara
+// l'header del primo frame. Se 'fd' è >= 0 il file viene letto da lì, il job
+// ne diventa proprietario e 'filename' serve solo per l'estensione. Ritorna
+// NULL se il file non si può leggere.
+job_t *create_job(const char *filename, const int fd,
                   const char *base_output_filename) {
-  // Alloca un array unidimensionale per memorizzare tutti i bytes dell'immagine
-  image_data = (png_bytep)malloc(width * height * BYTES_PER_PIXEL);
-
-  // Nel primo frame i primi HEADER_INFO_LENGTH bytes sono occupati per l'header
-  const long file_size = get_file_size(fp);
-  const uint8_t ext_length = get_extension_length(filename);
-  const uint64_t file_size_with_header =
-      file_size + ext_length + HEADER_INFO_LENGTH;
-  const uint64_t n_chunks =
-      (file_size_with_header / PNG_TOTAL_BYTES) == 0
-          ? 1
-          : ceil((double)file_size_with_header / PNG_TOTAL_BYTES);
-
-  header_info.total_frames = n_chunks;
-  header_info.last_frame = n_chunks - 1;
-  printf("Total frames: %llu\nLast frame index: %llu\n",
-         header_info.total_frames, header_info.last_frame);
-  printf("Dimensione del file = %lu bytes\n", get_file_size(fp));
-  printf("Dimensione del file con info = %llu bytes\n", file_size_with_header);
-
-  // valori default iniziali
-  header_info.last_byte_column = 0;
-  header_info.last_byte_row = 0;
-  header_info.last_channel_and_extension_length = 0;
-  pixel_t *pixels_buffered = NULL; // non serve più si può togliere
-
-  uint64_t remaining_bytes = file_size;
-  uint8_t is_last_frame = FALSE;
-  uint32_t current_frame_bytes_to_read = 0;
-  for (uint64_t chunk = 0; chunk < n_chunks; chunk++) {
-    // Se è il primo chunk, aggiungi la dimensione dell'header e dell'estensione
-    if (chunk == 0)
-      remaining_bytes += HEADER_INFO_LENGTH + ext_length;
-
-    // Se i bytes rimanenti più l'header e l'estensione sono minori del limite
-    // del chunk, solo nel primo chunk, sennò controlla solo se i bytes
-    // rimanenti da leggere sono minori dei bytes di una singola immagine
-    if (PNG_TOTAL_BYTES > remaining_bytes) {
-      is_last_frame = TRUE;                          // Questo è l'ultimo frame
-      current_frame_bytes_to_read = remaining_bytes; // Leggi i bytes rimanenti
-      // Pulisci l'array solo se non riempie tutto l'array (evita dati sporchi)
-      memset(image_data, 0, width * height * BYTES_PER_PIXEL);
+  struct stat st;
+  if ((fd >= 0 ? fstat(fd, &st) : stat(filename, &st)) != 0 ||
+      !S_ISREG(st.st_mode))
+    return NULL;
+
+  job_t *job = allocate_job(JOB_ENCODE, filename, fd, base_output_filename);
+
+  // Le zone di zeri non finiscono nei frame, quindi vanno trovate prima di
+  // sapere quanti frame servono
+  job->file_size = st.st_size;
+  const int scan_fd = fd >= 0 ? fd : open(filename, O_RDONLY);
+  if (scan_fd < 0) {
+    job->fd = -1;
+    destroy_job(job);
+    return NULL;
+  }
+  find_zero_extents(job, scan_fd);
+  if (scan_fd != fd)
+    close(scan_fd);
+
+  // Ogni frame inizia con la firma. Nel primo frame dopo la firma ci sono
+  // HEADER_INFO_LENGTH bytes di header, l'estensione e la tabella delle zone
+  // di zeri.
+  job->tag_length = FRAME_TAG_LENGTH;
+  job->ext_length = get_extension_length(filename);
+  job->header_length = HEADER_INFO_LENGTH + job->ext_length;
+  if (job->n_zero_extents > 0)
+    job->header_length +=
+        BYTES_INSIDE_INT64 + job->n_zero_extents * ZERO_EXTENT_LENGTH;
+  // Con una chiave ogni file ha la sua base dei nonce casuale, così due file
+  // cifrati con la stessa chiave non usano mai lo stesso nonce
+  job->cipher = aead_cipher;
+  if (job->cipher != AEAD_NONE) {
+    job->header_length += AEAD_HEADER_LENGTH;
+    job->frame_capacity = PNG_TOTAL_BYTES - AEAD_TAG_LENGTH;
+    if (RAND_bytes(job->nonce_base, AEAD_NONCE_LENGTH) != 1) {
+      fprintf(stderr, "Impossibile generare la base dei nonce\n");
+      exit(ERROR_AEAD);
+    }
+  }
+  const layout_t layout =
+      plan_layout(job->payload_size, job->header_length, job->frame_capacity,
+                  job->tag_length);
+  const uint64_t n_chunks = layout.total_frames;
+
+  job->header_info.total_frames = n_chunks;
+  job->header_info.last_frame = n_chunks - 1;
+  if (verbose) {
+    printf("Total frames: %llu\nLast frame index: %llu\n",
+           job->header_info.total_frames, job->header_info.last_frame);
+    printf("Dimensione del file = %llu bytes\n", job->file_size);
+    printf("Zone di zeri: %llu, dati da salvare = %llu bytes\n",
+           job->n_zero_extents, job->payload_size);
+    printf("Dimensione del file con info = %llu bytes\n",
+           job->payload_size + job->header_length);
+  }
+
+  const header_info_t predict_info =
+      predict_last_data_position(&layout, job->ext_length);
+  char *ext_str = get_extension_string(filename);
+  if (verbose) {
+    printf("Extension: %s\n", ext_str);
+    printf("Extension Length: %u\n", job->ext_length);
+  }
+  job->header = (uint8_t *)malloc(job->header_length);
+  if (!job->header) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  TRACE_BEGIN(pack);
+  pack_header(&job->header_info, &predict_info, ext_str, job->ext_length,
+              job->zero_extents, job->n_zero_extents, job->cipher,
+              job->nonce_base, job->tag_length > 0, job->header);
+  TRACE_END(pack);
+  free(ext_str);
+  job->archive_id = compute_archive_id(job, &st);
+
+  job->frame_done = (uint8_t *)calloc(n_chunks, sizeof(uint8_t));
+  job->leaf_hashes = (uint8_t *)malloc(n_chunks * HASH_LENGTH);
+  if (!job->frame_done || !job->leaf_hashes) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+
+  return job;
+}
+
+// Nome del file di un frame del job, nella sua cartella se i frame sono
+// divisi con --stripe. La stringa va liberata.
+char *job_frame_filename(const job_t *job, const uint64_t frame) {
+  if (!job->stripe || frame >= job->stripe->total_frames)
+    return build_frame_filename(job->frames_base, frame);
+  return build_frame_filename(
+      job->stripe->frame_bases[job->stripe->frame_root[frame]], frame);
+}
+
+// Legge l'header dal frame 0 del job (cercato anche tramite il manifest):
+// dimensione, disposizione dei frame, zone di zeri e cifratura. Ritorna FALSE
+// se il frame 0 manca o non è valido, o se i frame sono cifrati e non c'è la
+// chiave.
+uint8_t load_frame_header(job_t *job) {
+  job->stripe = read_manifest(job->frames_base);
+
+  // L'header inizia nella prima riga, subito dopo la firma se il frame ce
+  // l'ha, non serve decodificare tutto il frame. Se c'è una tabella di zone di
+  // zeri lunga si leggono le righe che servono.
+  uint8_t first_row[BYTES_PER_ROW];
+  char *frame_filename = job_frame_filename(job, 0);
+  uint8_t is_valid = read_png_file(frame_filename, first_row, 1);
+  frame_tag_t tag;
+  if (is_valid && parse_frame_tag(first_row, &tag)) {
+    job->tag_length = FRAME_TAG_LENGTH;
+    job->archive_id = tag.archive_id;
+  }
+  is_valid = is_valid &&
+             extract_file_size(&first_row[job->tag_length], job) &&
+             check_frame_tag(job, 0, first_row);
+  const uint32_t prefix_length = job->tag_length + job->header_length;
+  if (is_valid && prefix_length > BYTES_PER_ROW) {
+    const int rows = (prefix_length + BYTES_PER_ROW - 1) / BYTES_PER_ROW;
+    uint8_t *header_rows = (uint8_t *)malloc((size_t)rows * BYTES_PER_ROW);
+    if (!header_rows) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+    is_valid = read_png_file(frame_filename, header_rows, rows) &&
+               extract_header(&header_rows[job->tag_length], job);
+    free(header_rows);
+  } else if (is_valid) {
+    is_valid = extract_header(&first_row[job->tag_length], job);
+  }
+  free(frame_filename);
+  if (is_valid && job->cipher != AEAD_NONE && aead_cipher == AEAD_NONE) {
+    fprintf(stderr, "I frame di %s sono cifrati con %s, serve --key\n",
+            job->frames_base, aead_cipher_name(job->cipher));
+    is_valid = FALSE;
+  }
+  return is_valid;
+}
+
+// Crea un job di decodifica: legge l'header dalla prima riga del frame 0 e
+// prepara il file di output della dimensione giusta. Se c'è un manifest i
+// frame vengono cercati nelle cartelle indicate lì. Se 'fd' è >= 0 l'output
+// viene scritto lì e il job ne diventa proprietario. Ritorna NULL se il frame
+// 0 manca o non è valido (in quel caso 'fd' resta al chiamante).
+job_t *create_decode_job(const char *frames_base, const char *output_filename,
+                         const int fd) {
+  job_t *job = allocate_job(JOB_DECODE, output_filename, -1, frames_base);
+  if (!load_frame_header(job)) {
+    destroy_job(job);
+    return NULL;
+  }
+
+  // Riporto il file a zero e poi alla dimensione giusta, così le zone di zeri
+  // (che non vengono mai scritte) diventano buchi del file
+  const int output_fd =
+      fd >= 0 ? fd : open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (output_fd < 0 || ftruncate(output_fd, 0) != 0 ||
+      ftruncate(output_fd, job->file_size) != 0) {
+    perror(output_filename);
+    if (output_fd >= 0 && fd < 0)
+      close(output_fd);
+    destroy_job(job);
+    return NULL;
+  }
+  job->fd = output_fd;
+
+  job->frame_done =
+      (uint8_t *)calloc(job->header_info.total_frames, sizeof(uint8_t));
+  if (!job->frame_done) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+
+  return job;
+}
+
+// Segna come già completati i primi 'frames' frame (usato da --resume)
+void skip_job_frames(job_t *job, const uint64_t frames) {
+  for (uint64_t frame = 0; frame < frames; frame++)
+    job->frame_done[frame] = TRUE;
+  job->frames_done = frames;
+  job->completed_frames = frames;
+}
+
+// Apre il file di input del job, a meno che il job non abbia già il suo fd.
+// Il file viene aperto per ogni frame, così anche con migliaia di input in
+// batch non si tengono aperti migliaia di file descriptor
+int open_job_input(const job_t *job) {
+  const int fd = job->fd >= 0 ? job->fd : open(job->filename, O_RDONLY);
+  if (fd == -1) {
+    perror(job->filename);
+    exit(ERROR_INPUT_READ);
+  }
+  return fd;
+}
+
+void close_job_input(const job_t *job, const int fd) {
+  if (fd != job->fd)
+    close(fd);
+}
+
+// Copia in 'dest' i bytes [start, start + length) di un frame: la firma,
+// l'header (solo nel frame 0), poi i dati del file letti dall'offset giusto e
+// infine gli zeri di riempimento. Serve sia per riempire un frame intero che
+// una sola riga.
+void fill_frame_range(const job_t *job, const int fd, const uint64_t frame,
+                      uint32_t start, uint32_t length, uint8_t *dest) {
+  if (start < job->tag_length) {
+    uint8_t tag[FRAME_TAG_LENGTH];
+    pack_frame_tag(job, frame, tag);
+    const uint32_t n =
+        job->tag_length - start < length ? job->tag_length - start : length;
+    memcpy(dest, &tag[start], n);
+    dest += n;
+    start += n;
+    length -= n;
+  }
+  const uint32_t header_length = frame_prefix_length(job, frame);
+  if (start < header_length) {
+    const uint32_t n =
+        header_length - start < length ? header_length - start : length;
+    memcpy(dest, &job->header[start - job->tag_length], n);
+    dest += n;
+    start += n;
+    length -= n;
+  }
+
+  // Bytes di dati contenuti in questo frame, dopo l'header
+  const uint64_t input_offset = frame_input_offset(job, frame);
+  const uint32_t data_end = header_length + frame_data_bytes(job, frame);
+
+  if (length > 0 && start < data_end) {
+    const uint32_t bytes_to_read =
+        data_end - start < length ? data_end - start : length;
+    const uint64_t payload_offset = input_offset + (start - header_length);
+
+    // I dati salvati saltano le zone di zeri, quindi la lettura viene spezzata
+    // nei pezzi contigui del file originale
+    for (uint64_t done = 0; done < bytes_to_read;) {
+      uint64_t contiguous = 0;
+      const uint64_t logical =
+          payload_to_logical(job, payload_offset + done, &contiguous);
+      if (contiguous > bytes_to_read - done)
+        contiguous = bytes_to_read - done;
+      read_buffered_file(fd, &dest[done], logical, contiguous);
+      done += contiguous;
+    }
+    dest += bytes_to_read;
+    length -= bytes_to_read;
+  }
+
+  // Pulisci solo la parte che non è stata riempita (evita dati sporchi del
+  // frame precedente)
+  if (length > 0)
+    memset(dest, 0, length);
+}
+
+// Prepara la cifratura (o la decifratura) di un frame. Il nonce è la base del
+// file con il numero del frame in xor negli ultimi 8 byte, quindi è diverso
+// per ogni frame. Il numero del frame e il numero di frame sono autenticati
+// insieme ai dati, e nel frame 0 anche l'header che resta in chiaro: un frame
+// spostato, preso da un altro file o con l'header modificato non passa la
+// verifica.
+EVP_CIPHER_CTX *aead_begin(const job_t *job, const uint64_t frame,
+                           const int encrypt) {
+  uint8_t nonce[AEAD_NONCE_LENGTH];
+  memcpy(nonce, job->nonce_base, AEAD_NONCE_LENGTH);
+  for (int i = 0; i < BYTES_INSIDE_INT64; i++)
+    nonce[AEAD_NONCE_LENGTH - 1 - i] ^= (frame >> (8 * i)) & 0xFF;
+
+  uint8_t aad[2 * BYTES_INSIDE_INT64];
+  uint8_t *splitted = split_uint64_t_into_bytes(frame);
+  memcpy(aad, splitted, BYTES_INSIDE_INT64);
+  free(splitted);
+  splitted = split_uint64_t_into_bytes(job->header_info.total_frames);
+  memcpy(&aad[BYTES_INSIDE_INT64], splitted, BYTES_INSIDE_INT64);
+  free(splitted);
+
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  int length;
+  if (!ctx ||
+      EVP_CipherInit_ex(ctx,
+                        job->cipher == AEAD_AES_256_GCM
+                            ? EVP_aes_256_gcm()
+                            : EVP_chacha20_poly1305(),
+                        NULL, aead_key, nonce, encrypt) != 1 ||
+      EVP_CipherUpdate(ctx, NULL, &length, aad, sizeof(aad)) != 1 ||
+      (frame == 0 && EVP_CipherUpdate(ctx, NULL, &length, job->header,
+                                      job->header_length) != 1)) {
+    fprintf(stderr, "Errore nell'inizializzazione di %s\n",
+            aead_cipher_name(job->cipher));
+    exit(ERROR_AEAD);
+  }
+  return ctx;
+}
+
+// Cifra 'length' bytes di dati sul posto
+void aead_update(EVP_CIPHER_CTX *ctx, uint8_t *data, const uint32_t length) {
+  int written;
+  if (length > 0 && EVP_CipherUpdate(ctx, data, &written, data, length) != 1) {
+    fprintf(stderr, "Errore nella cifratura di un frame\n");
+    exit(ERROR_AEAD);
+  }
+}
+
+// Chiude la cifratura e copia il tag in 'tag'
+void aead_seal(EVP_CIPHER_CTX *ctx, uint8_t *tag) {
+  int written;
+  if (EVP_CipherFinal_ex(ctx, tag, &written) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_LENGTH, tag) !=
+          1) {
+    fprintf(stderr, "Errore nella cifratura di un frame\n");
+    exit(ERROR_AEAD);
+  }
+  EVP_CIPHER_CTX_free(ctx);
+}
+
+// Cifra i dati di un frame già riempito e mette il tag negli ultimi bytes.
+// La firma, l'header e il riempimento restano come sono.
+void seal_frame(const job_t *job, const uint64_t frame,
+                png_bytep image_data) {
+  const uint32_t header_length = frame_prefix_length(job, frame);
+  EVP_CIPHER_CTX *ctx = aead_begin(job, frame, 1);
+  aead_update(ctx, &image_data[header_length], frame_data_bytes(job, frame));
+  aead_seal(ctx, &image_data[job->frame_capacity]);
+}
+
+// Verifica il tag di un frame decodificato e ne decifra i dati sul posto.
+// Ritorna FALSE se il frame è stato modificato o la chiave è sbagliata.
+uint8_t open_frame(const job_t *job, const uint64_t frame,
+                   png_bytep image_data) {
+  const uint32_t header_length = frame_prefix_length(job, frame);
+  EVP_CIPHER_CTX *ctx = aead_begin(job, frame, 0);
+  aead_update(ctx, &image_data[header_length], frame_data_bytes(job, frame));
+
+  int written;
+  const uint8_t is_valid =
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_LENGTH,
+                          &image_data[job->frame_capacity]) == 1 &&
+      EVP_CipherFinal_ex(ctx, &image_data[job->frame_capacity], &written) ==
+          1;
+  EVP_CIPHER_CTX_free(ctx);
+  return is_valid;
+}
+
+// Bytes usati di un frame: la firma, l'header (nel frame 0) e i dati, senza
+// il riempimento e senza il tag
+uint32_t frame_used_bytes(const job_t *job, const uint64_t frame) {
+  return frame_prefix_length(job, frame) + frame_data_bytes(job, frame);
+}
+
+// L'hash di un frame (una foglia dell'albero di Merkle) è lo SHA-256 di un
+// byte 0x00, del numero del frame e dei bytes usati del frame così come sono
+// salvati nei pixel (cifrati, con il tag in fondo, se il frame è cifrato).
+// Così un frame spostato ha un hash diverso e la verifica non ha bisogno
+// della chiave. SHA-256 passa dalle istruzioni SHA della CPU quando ci sono.
+EVP_MD_CTX *hash_begin(const uint64_t frame) {
+  uint8_t prefix[1 + BYTES_INSIDE_INT64] = {0x00};
+  uint8_t *splitted = split_uint64_t_into_bytes(frame);
+  memcpy(&prefix[1], splitted, BYTES_INSIDE_INT64);
+  free(splitted);
+
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1 ||
+      EVP_DigestUpdate(ctx, prefix, sizeof(prefix)) != 1) {
+    fprintf(stderr, "Errore nell'inizializzazione di SHA-256\n");
+    exit(EXIT_FAILURE);
+  }
+  return ctx;
+}
+
+void hash_update(EVP_MD_CTX *ctx, const uint8_t *data, const uint32_t length) {
+  if (length > 0 && EVP_DigestUpdate(ctx, data, length) != 1) {
+    fprintf(stderr, "Errore nel calcolo di SHA-256\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void hash_end(EVP_MD_CTX *ctx, uint8_t *hash) {
+  if (EVP_DigestFinal_ex(ctx, hash, NULL) != 1) {
+    fprintf(stderr, "Errore nel calcolo di SHA-256\n");
+    exit(EXIT_FAILURE);
+  }
+  EVP_MD_CTX_free(ctx);
+}
+
+// Calcola l'hash di un frame intero già in memoria
+void hash_frame(const job_t *job, const uint64_t frame,
+                const png_bytep image_data, uint8_t *hash) {
+  EVP_MD_CTX *ctx = hash_begin(frame);
+  hash_update(ctx, image_data, frame_used_bytes(job, frame));
+  if (job->frame_capacity < PNG_TOTAL_BYTES)
+    hash_update(ctx, &image_data[job->frame_capacity], AEAD_TAG_LENGTH);
+  hash_end(ctx, hash);
+}
+
+// Riempie image_data con il contenuto di un frame intero, cifrato se il job
+// ha una chiave, e ne calcola l'hash finchè è ancora in memoria. Ogni frame è
+// indipendente dagli altri, quindi i frame si possono codificare in parallelo
+void fill_frame(const job_t *job, const uint64_t frame,
+                png_bytep image_data) {
+  TRACE_BEGIN(read);
+  const int fd = open_job_input(job);
+  fill_frame_range(job, fd, frame, 0, PNG_TOTAL_BYTES, image_data);
+  close_job_input(job, fd);
+  TRACE_END(read);
+
+  if (job->cipher != AEAD_NONE) {
+    TRACE_BEGIN(encrypt);
+    seal_frame(job, frame, image_data);
+    TRACE_END(encrypt);
+  }
+
+  TRACE_BEGIN(hash);
+  hash_frame(job, frame, image_data, &job->leaf_hashes[frame * HASH_LENGTH]);
+  TRACE_END(hash);
+}
+
+// Stato della codifica in streaming di un frame: c'è in memoria solo la riga
+// che libpng sta comprimendo
+struct ROW_STREAM {
+  const job_t *job;
+  int fd;
+  uint64_t frame;
+  png_bytep row;
+  // cifratura del frame, le righe arrivano in ordine e vengono cifrate una
+  // dopo l'altra. NULL se il job non ha una chiave.
+  EVP_CIPHER_CTX *aead;
+  EVP_MD_CTX *hash; // hash del frame, calcolato anche lui riga per riga
+} typedef row_stream_t;
+
+// Legge dal file la riga y del frame, cifrando la parte che contiene dati e
+// aggiornando l'hash. Il tag è in fondo all'ultima riga, che arriva quando i
+// dati sono finiti.
+png_bytep stream_row(void *context, const int y) {
+  row_stream_t *stream = (row_stream_t *)context;
+  const job_t *job = stream->job;
+  const uint32_t row_start = y * BYTES_PER_ROW;
+  fill_frame_range(job, stream->fd, stream->frame, row_start, BYTES_PER_ROW,
+                   stream->row);
+
+  if (stream->aead) {
+    const uint32_t data_start = frame_prefix_length(job, stream->frame);
+    const uint32_t data_end =
+        data_start + frame_data_bytes(job, stream->frame);
+    const uint32_t start = row_start > data_start ? row_start : data_start;
+    const uint32_t end = row_start + BYTES_PER_ROW < data_end
+                             ? row_start + BYTES_PER_ROW
+                             : data_end;
+    if (start < end)
+      aead_update(stream->aead, &stream->row[start - row_start], end - start);
+    if (y == height - 1)
+      aead_seal(stream->aead, &stream->row[job->frame_capacity - row_start]);
+  }
+
+  const uint32_t used = frame_used_bytes(job, stream->frame);
+  if (row_start < used)
+    hash_update(stream->hash, stream->row,
+                used - row_start < BYTES_PER_ROW ? used - row_start
+                                                 : BYTES_PER_ROW);
+  if (y == height - 1) {
+    if (job->frame_capacity < PNG_TOTAL_BYTES)
+      hash_update(stream->hash, &stream->row[job->frame_capacity - row_start],
+                  AEAD_TAG_LENGTH);
+    hash_end(stream->hash,
+             &job->leaf_hashes[stream->frame * HASH_LENGTH]);
+  }
+  return stream->row;
+}
+
+// Codifica un frame leggendo l'input una riga (BYTES_PER_ROW bytes) alla
+// volta, così la memoria usata non dipende dalla dimensione del frame
+void encode_frame_streaming(const job_t *job, const uint64_t frame,
+                            png_bytep row) {
+  row_stream_t stream;
+  stream.job = job;
+  stream.fd = open_job_input(job);
+  stream.frame = frame;
+  stream.row = row;
+  stream.aead = job->cipher != AEAD_NONE ? aead_begin(job, frame, 1) : NULL;
+  stream.hash = hash_begin(frame);
+
+  char *output_filename = job_frame_filename(job, frame);
+  write_png_rows(output_filename, height, stream_row, &stream,
+                 compression_level);
+  free(output_filename);
+
+  close_job_input(job, stream.fd);
+}
+
+// Codifica un singolo frame di un job usando il buffer del worker
+uint8_t encode_frame(const job_t *job, const uint64_t frame,
+                     png_bytep image_data) {
+  fill_frame(job, frame, image_data);
+
+  char *output_filename = job_frame_filename(job, frame);
+  write_png_file(output_filename, image_data);
+  free(output_filename);
+  return TRUE;
+}
+
+// Decodifica un singolo frame e scrive i suoi dati nel punto giusto del file
+// di output. Ritorna FALSE se il frame manca o è rovinato.
+uint8_t decode_frame(const job_t *job, const uint64_t frame,
+                     png_bytep image_data) {
+  char *frame_filename = job_frame_filename(job, frame);
+  TRACE_BEGIN(decode);
+  uint8_t is_valid = read_png_file(frame_filename, image_data, height);
+  TRACE_END(decode);
+  if (!is_valid)
+    fprintf(stderr, "Frame non valido: %s\n", frame_filename);
+  if (is_valid && !check_frame_tag(job, frame, image_data)) {
+    fprintf(stderr, "Frame fuori posto o di un altro archivio: %s\n",
+            frame_filename);
+    is_valid = FALSE;
+  }
+  if (is_valid && job->cipher != AEAD_NONE) {
+    TRACE_BEGIN(decrypt);
+    is_valid = open_frame(job, frame, image_data);
+    TRACE_END(decrypt);
+    if (!is_valid)
+      fprintf(stderr, "Frame manomesso o chiave sbagliata: %s\n",
+              frame_filename);
+  }
+  free(frame_filename);
+  if (!is_valid)
+    return FALSE;
+
+  // I dati iniziano dopo la firma e, nel frame 0, dopo l'header e
+  // l'estensione
+  const uint32_t byte_pointer = frame_prefix_length(job, frame);
+  const uint64_t output_offset = frame_input_offset(job, frame);
+  const uint64_t bytes_to_write = frame_data_bytes(job, frame);
+
+  // Le zone di zeri vengono saltate e restano buchi nel file di output
+  TRACE_BEGIN(write);
+  for (uint64_t done = 0; done < bytes_to_write;) {
+    uint64_t contiguous = 0;
+    const uint64_t logical =
+        payload_to_logical(job, output_offset + done, &contiguous);
+    if (contiguous > bytes_to_write - done)
+      contiguous = bytes_to_write - done;
+    if (!write_buffered_file(job->fd, &image_data[byte_pointer + done],
+                             logical, contiguous))
+      return FALSE;
+    done += contiguous;
+  }
+  TRACE_END(write);
+  return TRUE;
+}
+
+// Nodo dell'albero di Merkle: SHA-256 di un byte 0x01 e dei due figli. Un
+// nodo senza fratello (l'ultimo di un livello dispari) sale così com'è.
+void merkle_parent(const uint8_t *left, const uint8_t *right,
+                   uint8_t *parent) {
+  if (!right) {
+    memcpy(parent, left, HASH_LENGTH);
+    return;
+  }
+  uint8_t pair[1 + 2 * HASH_LENGTH];
+  pair[0] = 0x01;
+  memcpy(&pair[1], left, HASH_LENGTH);
+  memcpy(&pair[1 + HASH_LENGTH], right, HASH_LENGTH);
+  if (EVP_Digest(pair, sizeof(pair), parent, NULL, EVP_sha256(), NULL) != 1) {
+    fprintf(stderr, "Errore nel calcolo di SHA-256\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Costruisce l'albero a partire dalle foglie: i nodi sono salvati livello per
+// livello, prima le foglie e per ultima la radice
+uint8_t *build_merkle_tree(const uint8_t *leaves, const uint64_t n_leaves,
+                           uint64_t *n_nodes) {
+  *n_nodes = 0;
+  for (uint64_t size = n_leaves;; size = (size + 1) / 2) {
+    *n_nodes += size;
+    if (size == 1)
+      break;
+  }
+
+  uint8_t *tree = (uint8_t *)malloc(*n_nodes * HASH_LENGTH);
+  if (!tree) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(tree, leaves, n_leaves * HASH_LENGTH);
+
+  uint64_t level_start = 0;
+  for (uint64_t size = n_leaves; size > 1; size = (size + 1) / 2) {
+    const uint8_t *level = &tree[level_start * HASH_LENGTH];
+    uint8_t *parents = &tree[(level_start + size) * HASH_LENGTH];
+    for (uint64_t i = 0; i < size; i += 2)
+      merkle_parent(&level[i * HASH_LENGTH],
+                    i + 1 < size ? &level[(i + 1) * HASH_LENGTH] : NULL,
+                    &parents[i / 2 * HASH_LENGTH]);
+    level_start += size;
+  }
+  return tree;
+}
+
+void print_hash(FILE *fp, const uint8_t *hash) {
+  for (int i = 0; i < HASH_LENGTH; i++)
+    fprintf(fp, "%02x", hash[i]);
+}
+
+// Converte HASH_LENGTH * 2 cifre esadecimali, ritorna FALSE se non lo sono
+uint8_t parse_hash(const char *hex, uint8_t *hash) {
+  for (int i = 0; i < HASH_LENGTH; i++) {
+    const char digits[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+    if (!isxdigit((unsigned char)digits[0]) ||
+        !isxdigit((unsigned char)digits[1]))
+      return FALSE;
+    hash[i] = strtoul(digits, NULL, 16);
+  }
+  return TRUE;
+}
+
+// Salva l'albero di Merkle dei frame del job in "<base>.merkle", insieme a
+// quello che serve per verificare i frame senza leggere l'header dal frame 0
+// (che potrebbe essere proprio quello rovinato). La radice è l'hash di tutto
+// l'archivio.
+void write_merkle(const job_t *job) {
+  const uint64_t n_frames = job->header_info.total_frames;
+  uint64_t n_nodes;
+  uint8_t *tree = build_merkle_tree(job->leaf_hashes, n_frames, &n_nodes);
+  const uint8_t *root = &tree[(n_nodes - 1) * HASH_LENGTH];
+
+  char *merkle_filename = append_suffix(job->frames_base, MERKLE_SUFFIX);
+  char *tmp_filename = append_suffix(merkle_filename, TMP_SUFFIX);
+  FILE *fp = fopen(tmp_filename, "w");
+  if (!fp) {
+    perror(tmp_filename);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(fp,
+          "%s\nframes %llu\nframe_capacity %u\nheader_length %u\n"
+          "frame_tag %u\npayload_size %llu\nroot ",
+          MERKLE_MAGIC, n_frames, job->frame_capacity, job->header_length,
+          job->tag_length, job->payload_size);
+  print_hash(fp, root);
+  fprintf(fp, "\n");
+  for (uint64_t i = 0; i < n_nodes; i++) {
+    print_hash(fp, &tree[i * HASH_LENGTH]);
+    fprintf(fp, "\n");
+  }
+
+  if (durability != DURABILITY_NONE) {
+    if (fflush(fp) != 0) {
+      perror(merkle_filename);
+      exit(EXIT_FAILURE);
+    }
+    sync_fd(fileno(fp), tmp_filename);
+  }
+  if (fclose(fp) != 0 || rename(tmp_filename, merkle_filename) != 0) {
+    perror(merkle_filename);
+    exit(EXIT_FAILURE);
+  }
+  if (durability != DURABILITY_NONE)
+    sync_parent_directory(merkle_filename);
+
+  if (verbose) {
+    printf("Radice Merkle: ");
+    print_hash(stdout, root);
+    printf("\n");
+  }
+  free(tmp_filename);
+  free(merkle_filename);
+  free(tree);
+}
+
+// Intestazione di "<base>.merkle", i nodi vengono letti quando servono
+struct MERKLE_INFO {
+  FILE *fp;
+  off_t nodes_offset; // posizione del primo nodo nel file
+  uint64_t total_frames, payload_size;
+  uint32_t frame_capacity, header_length;
+  uint32_t tag_length; // manca negli indici degli archivi senza firma
+  uint8_t root[HASH_LENGTH];
+} typedef merkle_info_t;
+
+// Apre "<base>.merkle" e ne legge l'intestazione. Ritorna FALSE se manca o
+// non è valido.
+uint8_t open_merkle(const char *frames_base, merkle_info_t *info) {
+  char *merkle_filename = append_suffix(frames_base, MERKLE_SUFFIX);
+  info->fp = fopen(merkle_filename, "r");
+  free(merkle_filename);
+  if (!info->fp)
+    return FALSE;
+
+  char magic[16] = {0};
+  char root[2 * HASH_LENGTH + 1] = {0};
+  info->tag_length = 0;
+  // "frame_tag" è facoltativo: se non c'è fscanf si ferma sulla 'p' di
+  // "payload_size" senza consumarla
+  const uint8_t is_valid =
+      fscanf(info->fp,
+             "%15s frames %llu frame_capacity %u header_length %u", magic,
+             &info->total_frames, &info->frame_capacity,
+             &info->header_length) == 4 &&
+      fscanf(info->fp, " frame_tag %u", &info->tag_length) >= 0 &&
+      fscanf(info->fp, " payload_size %llu root %64s", &info->payload_size,
+             root) == 2 &&
+      fgetc(info->fp) == '\n' && strcmp(magic, MERKLE_MAGIC) == 0 &&
+      info->total_frames > 0 && info->frame_capacity <= PNG_TOTAL_BYTES &&
+      info->frame_capacity >= PNG_TOTAL_BYTES - AEAD_TAG_LENGTH &&
+      (info->tag_length == 0 || info->tag_length == FRAME_TAG_LENGTH) &&
+      info->tag_length + info->header_length < info->frame_capacity &&
+      parse_hash(root, info->root);
+  info->nodes_offset = ftello(info->fp);
+  if (!is_valid) {
+    fclose(info->fp);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// Legge il nodo 'index' dell'albero con un seek
+uint8_t read_merkle_node(const merkle_info_t *info, const uint64_t index,
+                         uint8_t *hash) {
+  char line[MERKLE_LINE_LENGTH];
+  return fseeko(info->fp, info->nodes_offset + index * MERKLE_LINE_LENGTH,
+                SEEK_SET) == 0 &&
+         fread(line, 1, MERKLE_LINE_LENGTH, info->fp) == MERKLE_LINE_LENGTH &&
+         line[MERKLE_LINE_LENGTH - 1] == '\n' && parse_hash(line, hash);
+}
+
+// Decodifica le righe di un frame che servono per il suo hash (tutte se il
+// frame è cifrato, perchè il tag è in fondo) e lo calcola. Ritorna FALSE se
+// il frame manca o non si legge.
+uint8_t compute_frame_hash(const job_t *job, const uint64_t frame,
+                           png_bytep image_data, uint8_t *hash) {
+  const uint32_t used = frame_used_bytes(job, frame);
+  const int rows = job->frame_capacity < PNG_TOTAL_BYTES
+                       ? height
+                       : (used + BYTES_PER_ROW - 1) / BYTES_PER_ROW;
+  char *frame_filename = job_frame_filename(job, frame);
+  TRACE_BEGIN(decode);
+  const uint8_t is_valid =
+      read_png_file(frame_filename, image_data, rows > 0 ? rows : 1);
+  TRACE_END(decode);
+  free(frame_filename);
+  if (is_valid) {
+    TRACE_BEGIN(hash);
+    hash_frame(job, frame, image_data, hash);
+    TRACE_END(hash);
+  }
+  return is_valid;
+}
+
+// Verifica un frame del job confrontando il suo hash con la foglia salvata
+uint8_t verify_frame(job_t *job, const uint64_t frame, png_bytep image_data) {
+  uint8_t hash[HASH_LENGTH];
+  const uint8_t is_valid =
+      compute_frame_hash(job, frame, image_data, hash) &&
+      memcmp(hash, &job->leaf_hashes[frame * HASH_LENGTH], HASH_LENGTH) == 0;
+  if (!is_valid)
+    job->frame_corrupt[frame] = TRUE;
+  return is_valid;
+}
+
+// Scrive un frame live, alto solo le righe che contengono dati. La latenza va
+// dall'arrivo del primo byte del frame al momento in cui il frame è visibile
+// con il suo nome definitivo.
+void encode_live_frame(job_t *job, const uint64_t sequence) {
+  live_frame_t *slot = &job->live_frames[sequence % job->live_slots];
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  const int rows =
+      (LIVE_HEADER_LENGTH + slot->length + BYTES_PER_ROW - 1) / BYTES_PER_ROW;
+  char *output_filename = build_frame_filename(job->frames_base, sequence);
+  write_png_rows(output_filename, rows, frame_row, slot->data,
+                 compression_level);
+  free(output_filename);
+
+  const double latency = elapsed_seconds(&slot->first_arrival);
+  const double write_seconds = elapsed_seconds(&start);
+  record_latency(&live_stats, latency, FALSE);
+
+  // La stima sale subito se un frame è lento e scende piano, così la
+  // scadenza segue i frame più lenti e non quelli medi
+  pthread_mutex_lock(&job->lock);
+  job->write_estimate = job->write_estimate * (1 - LIVE_ESTIMATE_WEIGHT) +
+                        write_seconds * LIVE_ESTIMATE_WEIGHT;
+  if (write_seconds > job->write_estimate)
+    job->write_estimate = write_seconds;
+  if (latency > job->live_target)
+    job->over_target++;
+  job->frames_done++;
+  slot->busy = FALSE;
+  pthread_cond_broadcast(&job->done);
+  pthread_mutex_unlock(&job->lock);
+}
+
+// Da chiamare quando un frame è stato scritto: aggiorna i progressi del job e,
+// se richiesto, il journal. I frame possono finire in qualsiasi ordine, ma il
+// journal registra solo i frame completati senza buchi a partire dal primo,
+// così --resume riparte sempre da un punto sicuro
+void job_frame_done(job_t *job, const uint64_t frame, const uint8_t ok) {
+  pthread_mutex_lock(&job->lock);
+
+  job->frame_done[frame] = TRUE;
+  job->frames_done++;
+  if (!ok)
+    job->failed = TRUE;
+
+  const uint64_t previous_completed = job->completed_frames;
+  while (job->completed_frames < job->header_info.total_frames &&
+         job->frame_done[job->completed_frames])
+    job->completed_frames++;
+
+  if (job->use_journal && job->completed_frames != previous_completed) {
+    journal_info_t journal;
+    journal.file_size = job->file_size;
+    journal.total_frames = job->header_info.total_frames;
+    journal.completed_frames = job->completed_frames;
+    journal.input_offset =
+        job->completed_frames == job->header_info.total_frames
+            ? job->payload_size
+            : frame_input_offset(job, job->completed_frames);
+    write_journal(job->frames_base, &journal);
+  }
+
+  if (job->frames_done == job->header_info.total_frames)
+    pthread_cond_broadcast(&job->done);
+
+  pthread_mutex_unlock(&job->lock);
+}
+
+// Aspetta che tutti i frame del job siano stati elaborati
+void job_wait(job_t *job) {
+  pthread_mutex_lock(&job->lock);
+  while (job->frames_done < job->header_info.total_frames)
+    pthread_cond_wait(&job->done, &job->lock);
+  pthread_mutex_unlock(&job->lock);
+}
+
+// Frame scritti e rinominati in attesa di essere sincronizzati su disco
+// (--durability batch). Il thread che sincronizza parte al primo frame.
+struct SYNC_QUEUE {
+  pthread_mutex_t lock;
+  pthread_cond_t wake, drained;
+  task_t *frames;
+  uint64_t count, capacity;
+  struct timespec oldest; // arrivo del primo frame in coda
+  uint8_t syncing, flush, running;
+  pthread_t thread;
+} typedef sync_queue_t;
+
+sync_queue_t sync_queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                           .wake = PTHREAD_COND_INITIALIZER,
+                           .drained = PTHREAD_COND_INITIALIZER};
+
+// Porta su disco un gruppo di frame. Su Linux basta una syncfs() per ogni
+// cartella, altrimenti si sincronizza ogni frame e poi ogni cartella.
+void sync_frames(const task_t *frames, const uint64_t n_frames) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  char **directories = (char **)malloc(sizeof(char *) * n_frames);
+  uint64_t n_directories = 0;
+  if (!directories) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  for (uint64_t i = 0; i < n_frames; i++) {
+    char *filename = job_frame_filename(frames[i].job, frames[i].frame);
+#if !(defined(__linux__) && defined(_GNU_SOURCE))
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      perror(filename);
+      exit(ERROR_SYNC);
+    }
+    sync_fd(fd, filename);
+    close(fd);
+#endif
+    char *directory = parent_directory(filename);
+    free(filename);
+    uint64_t j = 0;
+    while (j < n_directories && strcmp(directories[j], directory) != 0)
+      j++;
+    if (j == n_directories)
+      directories[n_directories++] = directory;
+    else
+      free(directory);
+  }
+
+  for (uint64_t j = 0; j < n_directories; j++) {
+#if defined(__linux__) && defined(_GNU_SOURCE)
+    const int fd = open(directories[j], O_RDONLY);
+    if (fd < 0 || syncfs(fd) != 0) {
+      perror(directories[j]);
+      exit(ERROR_SYNC);
+    }
+    close(fd);
+#else
+    sync_directory(directories[j]);
+#endif
+    free(directories[j]);
+  }
+  free(directories);
+
+  record_latency(&sync_stats, elapsed_seconds(&start), FALSE);
+}
+
+void *syncer_main(void *arg) {
+  (void)arg;
+  trace_thread_name("sync");
+  for (;;) {
+    pthread_mutex_lock(&sync_queue.lock);
+    // Si sincronizza quando il gruppo è completo, quando il frame più vecchio
+    // aspetta da troppo o quando qualcuno aspetta con sync_flush()
+    while (sync_queue.count == 0 ||
+           (sync_queue.count < sync_every && !sync_queue.flush &&
+            elapsed_seconds(&sync_queue.oldest) * 1e3 < SYNC_MAX_DELAY_MS)) {
+      struct timespec timeout;
+      clock_gettime(CLOCK_REALTIME, &timeout);
+      timeout.tv_nsec += SYNC_MAX_DELAY_MS * 1000000L;
+      timeout.tv_sec += timeout.tv_nsec / 1000000000L;
+      timeout.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&sync_queue.wake, &sync_queue.lock, &timeout);
+    }
+    task_t *frames = sync_queue.frames;
+    const uint64_t n_frames = sync_queue.count;
+    sync_queue.frames = NULL;
+    sync_queue.count = sync_queue.capacity = 0;
+    sync_queue.syncing = TRUE;
+    pthread_mutex_unlock(&sync_queue.lock);
+
+    TRACE_BEGIN(sync);
+    sync_frames(frames, n_frames);
+    TRACE_END(sync);
+    // solo ora i frame contano come completati, e finiscono nel journal
+    for (uint64_t i = 0; i < n_frames; i++) {
+      if (frames[i].job->type != JOB_LIVE)
+        job_frame_done(frames[i].job, frames[i].frame, TRUE);
+    }
+    free(frames);
+
+    pthread_mutex_lock(&sync_queue.lock);
+    sync_queue.syncing = FALSE;
+    pthread_cond_broadcast(&sync_queue.drained);
+    pthread_mutex_unlock(&sync_queue.lock);
+  }
+  return NULL;
+}
+
+// Mette un frame scritto in coda per la sincronizzazione
+void sync_queue_push(job_t *job, const uint64_t frame) {
+  pthread_mutex_lock(&sync_queue.lock);
+  if (!sync_queue.running) {
+    if (pthread_create(&sync_queue.thread, NULL, syncer_main, NULL) != 0) {
+      perror("pthread_create error: ");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(sync_queue.thread);
+    sync_queue.running = TRUE;
+  }
+  if (sync_queue.count == sync_queue.capacity) {
+    sync_queue.capacity = sync_queue.capacity ? sync_queue.capacity * 2 : 64;
+    sync_queue.frames = (task_t *)realloc(
+        sync_queue.frames, sizeof(task_t) * sync_queue.capacity);
+    if (!sync_queue.frames) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (sync_queue.count == 0)
+    clock_gettime(CLOCK_MONOTONIC, &sync_queue.oldest);
+  sync_queue.frames[sync_queue.count].job = job;
+  sync_queue.frames[sync_queue.count].frame = frame;
+  if (++sync_queue.count >= sync_every)
+    pthread_cond_signal(&sync_queue.wake);
+  pthread_mutex_unlock(&sync_queue.lock);
+}
+
+// Aspetta che tutti i frame in coda siano stati sincronizzati
+void sync_flush() {
+  pthread_mutex_lock(&sync_queue.lock);
+  sync_queue.flush = TRUE;
+  pthread_cond_signal(&sync_queue.wake);
+  while (sync_queue.count > 0 || sync_queue.syncing)
+    pthread_cond_wait(&sync_queue.drained, &sync_queue.lock);
+  sync_queue.flush = FALSE;
+  pthread_mutex_unlock(&sync_queue.lock);
+}
+
+// Da chiamare quando un frame è stato scritto (o decodificato). In batch un
+// frame codificato viene segnato come completato solo dopo la sincronizzazione.
+void frame_written(job_t *job, const uint64_t frame, const uint8_t ok) {
+  if (durability == DURABILITY_BATCH && ok &&
+      (job->type == JOB_ENCODE || job->type == JOB_LIVE))
+    sync_queue_push(job, frame);
+  else if (job->type != JOB_LIVE)
+    job_frame_done(job, frame, ok);
+}
+
+// Frame compresso in attesa di essere scritto nella sua cartella
+struct WRITE_REQUEST {
+  job_t *job;
+  uint64_t frame;
+  png_buffer_t png;
+} typedef write_request_t;
+
+// Writer di una cartella di output (--stripe): scrive i frame compressi dai
+// worker, così i dischi lavorano in parallelo e un disco lento rallenta solo i
+// worker che hanno frame per lui
+struct WRITER {
+  const char *root;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full;
+  write_request_t requests[WRITER_QUEUE_MAX];
+  uint32_t head, count;
+  uint8_t shutdown;
+  uint64_t frames_written, bytes_written;
+  double busy_seconds;
+} typedef writer_t;
+
+void *writer_main(void *arg) {
+  writer_t *writer = (writer_t *)arg;
+  trace_thread_name("writer %s", writer->root);
+
+  for (;;) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->count == 0 && !writer->shutdown)
+      pthread_cond_wait(&writer->not_empty, &writer->lock);
+    if (writer->count == 0) {
+      pthread_mutex_unlock(&writer->lock);
+      break;
+    }
+    write_request_t request = writer->requests[writer->head];
+    writer->head = (writer->head + 1) % in_flight_frames;
+    writer->count--;
+    pthread_cond_signal(&writer->not_full);
+    pthread_mutex_unlock(&writer->lock);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    current_trace_frame = request.frame;
+    char *output_filename = job_frame_filename(request.job, request.frame);
+    write_png_buffer(output_filename, &request.png);
+    free(output_filename);
+    writer->busy_seconds += elapsed_seconds(&start);
+    writer->frames_written++;
+    writer->bytes_written += request.png.length;
+    free(request.png.data);
+    memory_charge(-(int64_t)request.png.capacity);
+
+    // il frame conta come scritto solo ora, non quando il worker lo ha
+    // compresso
+    frame_written(request.job, request.frame, TRUE);
+  }
+  return NULL;
+}
+
+// Mette un frame compresso nella coda del writer, aspettando se è piena
+void writer_submit(writer_t *writer, job_t *job, const uint64_t frame,
+                   const png_buffer_t png) {
+  pthread_mutex_lock(&writer->lock);
+  while (writer->count == in_flight_frames)
+    pthread_cond_wait(&writer->not_full, &writer->lock);
+  write_request_t *request =
+      &writer->requests[(writer->head + writer->count) % in_flight_frames];
+  request->job = job;
+  request->frame = frame;
+  request->png = png;
+  writer->count++;
+  memory_charge(png.capacity);
+  pthread_cond_signal(&writer->not_empty);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+// Avvia un writer per ogni cartella del job
+void start_writers(stripe_t *stripe) {
+  stripe->writers = (writer_t *)calloc(stripe->n_roots, sizeof(writer_t));
+  if (!stripe->writers) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < stripe->n_roots; i++) {
+    writer_t *writer = &stripe->writers[i];
+    writer->root = stripe->roots[i];
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->not_empty, NULL);
+    pthread_cond_init(&writer->not_full, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+      perror("pthread_create error: ");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// Aspetta che i writer abbiano svuotato le code, stampa quanto ha scritto
+// ognuno e li termina
+void stop_writers(stripe_t *stripe) {
+  for (uint32_t i = 0; i < stripe->n_roots; i++) {
+    writer_t *writer = &stripe->writers[i];
+    pthread_mutex_lock(&writer->lock);
+    writer->shutdown = TRUE;
+    pthread_cond_signal(&writer->not_empty);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    printf("Cartella %s: %llu frame, %llu bytes, %.1f MB/s in scrittura\n",
+           writer->root, writer->frames_written, writer->bytes_written,
+           writer->busy_seconds > 0
+               ? writer->bytes_written / writer->busy_seconds / 1e6
+               : 0.0);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->not_empty);
+    pthread_cond_destroy(&writer->not_full);
+  }
+}
+
+// Codifica un frame in memoria e lo passa al writer della sua cartella, che
+// poi lo segna come completato
+void encode_frame_striped(job_t *job, const uint64_t frame,
+                          png_bytep image_data) {
+  fill_frame(job, frame, image_data);
+
+  png_buffer_t png;
+  memset(&png, 0, sizeof(png));
+  TRACE_BEGIN(deflate);
+  write_png_rows_to(height, frame_row, image_data, append_png_bytes, &png,
+                    frame_compression_level(image_data, PNG_TOTAL_BYTES));
+  TRACE_END(deflate);
+  writer_submit(&job->stripe->writers[job->stripe->frame_root[frame]], job,
+                frame, png);
+}
+
+// Aggiunge un task in fondo alla coda, raddoppiando la capacità se serve
+void deque_push(work_deque_t *deque, const task_t task) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->tail - deque->head == deque->capacity) {
+    const uint64_t new_capacity = deque->capacity ? deque->capacity * 2 : 64;
+    task_t *tasks =
+        (task_t *)malloc(sizeof(task_t) * new_capacity);
+    if (!tasks) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+    // ricopio i task in ordine all'inizio del nuovo array
+    for (uint64_t i = deque->head; i < deque->tail; i++)
+      tasks[i - deque->head] = deque->tasks[i % deque->capacity];
+    deque->tail -= deque->head;
+    deque->head = 0;
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->capacity = new_capacity;
+  }
+  deque->tasks[deque->tail++ % deque->capacity] = task;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+// Il proprietario della coda prende i task dalla testa, cioè nell'ordine in
+// cui sono stati inseriti, così legge i file più o meno sequenzialmente
+uint8_t deque_pop(work_deque_t *deque, task_t *task) {
+  pthread_mutex_lock(&deque->lock);
+  const uint8_t found = deque->head < deque->tail;
+  if (found)
+    *task = deque->tasks[deque->head++ % deque->capacity];
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+// Gli altri worker rubano dalla fondo della coda, lontano da dove lavora il
+// proprietario
+uint8_t deque_steal(work_deque_t *deque, task_t *task) {
+  pthread_mutex_lock(&deque->lock);
+  const uint8_t found = deque->head < deque->tail;
+  if (found)
+    *task = deque->tasks[--deque->tail % deque->capacity];
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+// Cerca un task prima nella propria coda e poi in quelle degli altri worker,
+// prima quelli dello stesso nodo NUMA e poi gli altri
+uint8_t find_task(worker_t *worker, task_t *task) {
+  thread_pool_t *pool = worker->pool;
+  if (deque_pop(&worker->deque, task))
+    return TRUE;
+
+  for (uint8_t same_node = TRUE;; same_node = FALSE) {
+    for (uint32_t i = 1; i < pool->n_workers; i++) {
+      worker_t *victim = &pool->workers[(worker->id + i) % pool->n_workers];
+      if ((victim->node == worker->node) != same_node)
+        continue;
+      if (deque_steal(&victim->deque, task)) {
+        worker->frames_stolen++;
+        if (!same_node)
+          worker->frames_stolen_remote++;
+        return TRUE;
+      }
+    }
+    if (!same_node || numa.n_nodes == 1)
+      return FALSE;
+  }
+}
+
+void *worker_main(void *arg) {
+  worker_t *worker = (worker_t *)arg;
+  thread_pool_t *pool = worker->pool;
+  task_t task;
+  trace_thread_name("worker %u", worker->id);
+  numa_bind_thread(worker->node);
+
+  for (;;) {
+    // Aspetto che ci sia almeno un task in coda da qualche parte
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued == 0 && !pool->shutdown)
+      pthread_cond_wait(&pool->work_available, &pool->lock);
+    if (pool->queued == 0 && pool->shutdown) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // Un altro worker potrebbe averlo preso nel frattempo, si riprova
+    if (!find_task(worker, &task))
+      continue;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued--;
+    pthread_mutex_unlock(&pool->lock);
+
+    current_trace_frame = task.frame;
+    TRACE_BEGIN(task);
+    // con --qos-workers o quando il sistema è carico lavorano meno worker
+    qos_enter();
+    // Con --stripe il frame lo segna come scritto il writer
+    uint8_t ok = TRUE, notify = TRUE;
+    png_bytep image_data = NULL;
+    if (task.job->type == JOB_LIVE) {
+      encode_live_frame(task.job, task.frame);
     } else {
-      current_frame_bytes_to_read = PNG_TOTAL_BYTES; // Leggi un chunk completo
-    }
-
-    printf("In questo frame leggo %u bytes\n", current_frame_bytes_to_read);
-
-    // Divido in bytes le informazioni dell'header, così le salvo sulla matrice
-    // della prima immagine
-    if (chunk == 0) {
-      // Formatto in un uint32_t le informazioni inerenti l'ultima riga,
-      // all'ultima colonna, ultimo canale e lunghezza dell'estensione
-      uint32_t tmp = 0;
-      const header_info_t predict_info =
-          predict_last_data_position(file_size_with_header, ext_length);
-
-      // prima salvo il valore della riga formattata
-      printf("Last row: %u\n", predict_info.last_byte_row);
-      tmp = predict_info.last_byte_row;
-      tmp = tmp << 20;
-      printf("Last row shifted: %u\n", tmp);
-      header_info.data_formatted = tmp;
-
-      // poi salvo il valore della colonna
-      printf("Last column: %u\n", predict_info.last_byte_column);
-      tmp = predict_info.last_byte_column;
-      tmp = tmp << 8;
-      printf("Last column shifted: %u\n", tmp);
-      // aggiungo, perchè devo mantere i bit inerenti alla riga
-      header_info.data_formatted += tmp;
-
-      // aggiungo infine il canale e la lunghezza dell'estensione
-      printf("Last channel & ext length: %u\n",
-             predict_info.last_channel_and_extension_length);
-      header_info.data_formatted +=
-          predict_info.last_channel_and_extension_length;
-      printf("All info together: %u\n", header_info.data_formatted);
-
-      // separo in byte le informazioni dell'header
-      const uint8_t *data_formatted_splitted =
-          split_uint32_t_into_bytes(header_info.data_formatted);
-      const uint8_t *total_frames_splitted =
-          split_uint64_t_into_bytes(header_info.total_frames);
-      const uint8_t *last_frame_splitted =
-          split_uint64_t_into_bytes(header_info.last_frame);
-
-      // Volendo posso mettere questi byte in un unico array e poi usare un loop
-      // per inserirli nella matrice dell'immagine, però tanto vale scrivere
-      // manualmente le assegnazioni
-      uint8_t byte_index = 0;
-
-      image_data[byte_index++] = data_formatted_splitted[0];
-      image_data[byte_index++] = data_formatted_splitted[1];
-      image_data[byte_index++] = data_formatted_splitted[2];
-      image_data[byte_index++] = data_formatted_splitted[3];
-
-      image_data[byte_index++] = total_frames_splitted[0];
-      image_data[byte_index++] = total_frames_splitted[1];
-      image_data[byte_index++] = total_frames_splitted[2];
-      image_data[byte_index++] = total_frames_splitted[3];
-      image_data[byte_index++] = total_frames_splitted[4];
-      image_data[byte_index++] = total_frames_splitted[5];
-      image_data[byte_index++] = total_frames_splitted[6];
-      image_data[byte_index++] = total_frames_splitted[7];
-
-      image_data[byte_index++] = last_frame_splitted[0];
-      image_data[byte_index++] = last_frame_splitted[1];
-      image_data[byte_index++] = last_frame_splitted[2];
-      image_data[byte_index++] = last_frame_splitted[3];
-      image_data[byte_index++] = last_frame_splitted[4];
-      image_data[byte_index++] = last_frame_splitted[5];
-      image_data[byte_index++] = last_frame_splitted[6];
-      image_data[byte_index++] = last_frame_splitted[7];
-
-      current_frame_bytes_to_read -= HEADER_INFO_LENGTH;
-
-      char *ext_str = get_extension_string(filename);
-      printf("Extension: %s\n", ext_str);
-      printf("Extension Length: %u\n", ext_length);
-      for (uint8_t i = 0; i < ext_length; i++)
-        image_data[byte_index++] = ext_str[i];
-
-      current_frame_bytes_to_read -= ext_length;
-
-      data_formatted_splitted = NULL;
-      total_frames_splitted = NULL;
-      last_frame_splitted = NULL;
-
-      /*for (int i = 0; i < 23; i++) {
-        printf("[%5d]: %3u -> %s -> %02X\n", i, image_data[i],
-               uint8_t_to_binary_string(image_data[i]), image_data[i]);
+      // Il buffer del frame arriva dal pool e ci torna appena il frame è
+      // finito (i frame live hanno già il loro), con --memory-limit qui si
+      // aspetta se la memoria è finita
+      image_data = frame_buffer_acquire(TRUE);
+      if (task.job->type == JOB_ENCODE && task.job->stripe) {
+        encode_frame_striped(task.job, task.frame, image_data);
+        notify = FALSE;
+      } else if (task.job->type == JOB_ENCODE)
+        ok = encode_frame(task.job, task.frame, image_data);
+      else if (task.job->type == JOB_DECODE)
+        ok = decode_frame(task.job, task.frame, image_data);
+      else
+        ok = verify_frame(task.job, task.frame, image_data);
+    }
+    qos_leave();
+
+    // Il task esce da pending prima di avvisare il job, altrimenti il
+    // demone può rispondere al client mentre risulta ancora in lavorazione.
+    // Anche frames_processed si aggiorna qui, STATS lo legge con il lock.
+    pthread_mutex_lock(&pool->lock);
+    worker->frames_processed++;
+    pool->pending--;
+    pool->finishing++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (notify)
+      frame_written(task.job, task.frame, ok);
+    if (image_data)
+      frame_buffer_release(image_data);
+    TRACE_END(task);
+    current_trace_frame = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->finishing == 0 && pool->pending == 0)
+      pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  return NULL;
+}
+
+// Crea il pool di worker, ognuno con la propria coda e fissato su un nodo
+// NUMA, i buffer dei frame arrivano dal pool dei buffer
+thread_pool_t *pool_create(const uint32_t n_workers) {
+  thread_pool_t *pool = (thread_pool_t *)calloc(1, sizeof(thread_pool_t));
+  if (!pool) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  pool->n_workers = n_workers;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_available, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+
+  pool->workers = (worker_t *)calloc(n_workers, sizeof(worker_t));
+  if (!pool->workers) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+
+  for (uint32_t i = 0; i < n_workers; i++) {
+    worker_t *worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->id = i;
+    // a turno sui nodi, così i worker dello stesso nodo sono id % n_nodes
+    worker->node = i % numa.n_nodes;
+    pthread_mutex_init(&worker->deque.lock, NULL);
+  }
+
+  // I thread partono solo quando tutte le code esistono, perchè possono
+  // rubare da quelle degli altri
+  for (uint32_t i = 0; i < n_workers; i++) {
+    if (pthread_create(&pool->workers[i].thread, NULL, worker_main,
+                       &pool->workers[i]) != 0) {
+      perror("pthread_create error: ");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return pool;
+}
+
+// Mette in coda un frame da codificare a un worker del nodo NUMA 'node',
+// scelto a turno, oppure a un worker qualsiasi con node < 0 o se sul nodo non
+// c'è nessun worker. Serve per i frame già in un buffer di quel nodo.
+void pool_submit_node(thread_pool_t *pool, job_t *job, const uint64_t frame,
+                      const int node) {
+  task_t task;
+  task.job = job;
+  task.frame = frame;
+
+  pthread_mutex_lock(&pool->lock);
+  uint32_t target;
+  if (node >= 0 && (uint32_t)node < pool->n_workers &&
+      (uint32_t)node < numa.n_nodes) {
+    const uint32_t on_node =
+        (pool->n_workers - node + numa.n_nodes - 1) / numa.n_nodes;
+    target = node + numa.n_nodes * (pool->next_on_node[node]++ % on_node);
+  } else {
+    target = pool->next_worker;
+    pool->next_worker = (pool->next_worker + 1) % pool->n_workers;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  deque_push(&pool->workers[target].deque, task);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->queued++;
+  pool->pending++;
+  pthread_cond_signal(&pool->work_available);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Mette in coda un frame da codificare, le code vengono scelte a turno. Ogni
+// worker legge il frame nel proprio buffer, quindi è sempre sul suo nodo.
+void pool_submit(thread_pool_t *pool, job_t *job, const uint64_t frame) {
+  pool_submit_node(pool, job, frame, -1);
+}
+
+// Aspetta che tutti i frame messi in coda siano stati scritti
+void pool_wait_idle(thread_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0 || pool->finishing > 0)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Stampa quanto ha lavorato ogni worker e ogni nodo NUMA e il throughput
+// complessivo. Il throughput dei nodi è in frame (da 24.9 MB di pixel).
+void pool_print_stats(const thread_pool_t *pool, const uint64_t input_bytes,
+                      const double seconds) {
+  uint64_t frames = 0;
+  for (uint32_t i = 0; i < pool->n_workers; i++) {
+    const worker_t *worker = &pool->workers[i];
+    printf("Worker %2u: %llu frame (%llu rubati)\n", worker->id,
+           worker->frames_processed, worker->frames_stolen);
+    frames += worker->frames_processed;
+  }
+  for (uint32_t node = 0; numa.n_nodes > 1 && node < numa.n_nodes; node++) {
+    uint64_t node_frames = 0, stolen_remote = 0;
+    uint32_t node_workers = 0;
+    for (uint32_t i = node; i < pool->n_workers; i += numa.n_nodes) {
+      node_frames += pool->workers[i].frames_processed;
+      stolen_remote += pool->workers[i].frames_stolen_remote;
+      node_workers++;
+    }
+    printf("Nodo %2d: %u worker, %llu frame (%llu rubati a un altro nodo), "
+           "%.2f frame/s -> %.1f MB/s di pixel\n",
+           numa.ids[node], node_workers, node_frames, stolen_remote,
+           seconds > 0 ? node_frames / seconds : 0.0,
+           seconds > 0 ? node_frames * (double)PNG_TOTAL_BYTES / seconds / 1e6
+                       : 0.0);
+  }
+  printf("Totale: %llu frame, %llu bytes di input in %.3f s -> %.1f MB/s, "
+         "%.2f frame/s\n",
+         frames, input_bytes, seconds,
+         seconds > 0 ? input_bytes / seconds / 1e6 : 0.0,
+         seconds > 0 ? frames / seconds : 0.0);
+  print_memory_stats();
+  print_png_read_stats();
+  print_qos_stats();
+}
+
+void pool_destroy(thread_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = TRUE;
+  pthread_cond_broadcast(&pool->work_available);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (uint32_t i = 0; i < pool->n_workers; i++) {
+    worker_t *worker = &pool->workers[i];
+    pthread_join(worker->thread, NULL);
+    pthread_mutex_destroy(&worker->deque.lock);
+    free(worker->deque.tasks);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_available);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->workers);
+  free(pool);
+}
+
+// Codifica i frame uno dopo l'altro in streaming, senza pool e senza buffer
+// del frame: in memoria c'è solo una riga più lo stato di libpng e zlib
+void convert_frames_streaming(job_t *job, const uint64_t first_chunk) {
+  png_bytep row = (png_bytep)malloc(BYTES_PER_ROW);
+  if (!row)
+    exit(ERROR_ROWS_NOT_ALLOCATED);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (uint64_t chunk = first_chunk; chunk < job->header_info.total_frames;
+       chunk++) {
+    current_trace_frame = chunk;
+    TRACE_BEGIN(task);
+    encode_frame_streaming(job, chunk, row);
+    TRACE_END(task);
+    frame_written(job, chunk, TRUE);
+  }
+  current_trace_frame = -1;
+  sync_flush();
+
+  const double seconds = elapsed_seconds(&start);
+  const uint64_t frames = job->header_info.total_frames - first_chunk;
+  const uint64_t input_bytes =
+      job->payload_size - frame_input_offset(job, first_chunk);
+  printf("Totale (stream): %llu frame, %llu bytes di input in %.3f s -> %.1f "
+         "MB/s, %.2f frame/s\n",
+         frames, input_bytes, seconds,
+         seconds > 0 ? input_bytes / seconds / 1e6 : 0.0,
+         seconds > 0 ? frames / seconds : 0.0);
+  print_sync_stats();
+  print_qos_stats();
+
+  free(row);
+}
+
+// Converte un singolo file, i frame vengono codificati in parallelo dal pool
+// oppure, con 'stream', uno alla volta una riga alla volta. Con 'stripe_roots'
+// i frame vengono divisi tra più cartelle, ognuna con il suo writer.
+void convert_file(const char *filename, const char *base_output_filename,
+                  const uint8_t resume, const uint32_t n_workers,
+                  const uint8_t stream, const char *stripe_roots,
+                  const stripe_policy_t stripe_policy) {
+  job_t *job = create_job(filename, -1, base_output_filename);
+  if (!job) {
+    printf("File not found\n");
+    exit(EXIT_FAILURE);
+  }
+  const uint64_t n_chunks = job->header_info.total_frames;
+
+  // Con --resume salto i frame già completati e verificati
+  const uint64_t first_chunk =
+      resume ? find_resume_frame(base_output_filename, job) : 0;
+  skip_job_frames(job, first_chunk);
+  job->use_journal = TRUE;
+
+  // I frame già scritti non passano dai worker, i loro hash per l'albero di
+  // Merkle si ricalcolano dall'input (senza compressione)
+  if (first_chunk > 0) {
+    png_bytep image_data = frame_buffer_acquire(TRUE);
+    for (uint64_t chunk = 0; chunk < first_chunk; chunk++)
+      fill_frame(job, chunk, image_data);
+    frame_buffer_release(image_data);
+  }
+
+  // Il manifest va scritto prima dei frame. Senza --stripe si toglie quello
+  // di una codifica precedente, che indicherebbe frame in altre cartelle.
+  if (stripe_roots) {
+    job->stripe = create_stripe(stripe_roots, base_output_filename,
+                                stripe_policy, n_chunks);
+    write_manifest(base_output_filename, job->stripe);
+    start_writers(job->stripe);
+  } else {
+    char *manifest_filename =
+        append_suffix(base_output_filename, MANIFEST_SUFFIX);
+    remove(manifest_filename);
+    free(manifest_filename);
+  }
+
+  if (stream) {
+    convert_frames_streaming(job, first_chunk);
+    write_merkle(job);
+    delete_journal(base_output_filename);
+    destroy_job(job);
+    return;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  thread_pool_t *pool = pool_create(n_workers);
+  for (uint64_t chunk = first_chunk; chunk < n_chunks; chunk++)
+    pool_submit(pool, job, chunk);
+  pool_wait_idle(pool);
+  // con --stripe i frame compressi potrebbero essere ancora nelle code dei
+  // writer, e in batch i frame scritti aspettano la sincronizzazione
+  if (job->stripe)
+    stop_writers(job->stripe);
+  sync_flush();
+  job_wait(job);
+
+  pool_print_stats(pool,
+                   job->payload_size - frame_input_offset(job, first_chunk),
+                   elapsed_seconds(&start));
+  print_sync_stats();
+  pool_destroy(pool);
+
+  // Codifica terminata, il journal non serve più
+  write_merkle(job);
+  delete_journal(base_output_filename);
+  destroy_job(job);
+}
+
+// --plan: calcola la disposizione dei frame e stima dimensione dell'output e
+// tempo di codifica senza scrivere niente. Vengono compressi con libpng
+// PLAN_SAMPLES campioni di PLAN_SAMPLE_ROWS righe presi a distanza regolare
+// nei frame, più un campione di sole righe di riempimento.
+void plan_file(const char *filename, const uint32_t n_workers) {
+  job_t *job = create_job(filename, -1, filename);
+  if (!job) {
+    printf("File not found\n");
+    exit(EXIT_FAILURE);
+  }
+  const layout_t layout =
+      plan_layout(job->payload_size, job->header_length, job->frame_capacity,
+                  job->tag_length);
+
+  const uint32_t sample_bytes = PLAN_SAMPLE_ROWS * BYTES_PER_ROW;
+  png_bytep sample = (png_bytep)malloc(sample_bytes);
+  if (!sample) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+
+  // Righe che contengono dati (header compreso), il resto è riempimento
+  const uint64_t data_rows =
+      (layout.payload_size + layout.header_length + BYTES_PER_ROW - 1) /
+      BYTES_PER_ROW;
+  uint64_t counts[256] = {0};
+  uint64_t sampled = 0, sampled_png = 0;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  const int fd = open_job_input(job);
+  for (uint64_t i = 0; i < PLAN_SAMPLES; i++) {
+    // riga di partenza del campione, senza uscire dal suo frame
+    const uint64_t global_row = i * data_rows / PLAN_SAMPLES;
+    const uint64_t frame = global_row / HEIGHT_DEFAULT;
+    uint32_t row = global_row % HEIGHT_DEFAULT;
+    if (row > HEIGHT_DEFAULT - PLAN_SAMPLE_ROWS)
+      row = HEIGHT_DEFAULT - PLAN_SAMPLE_ROWS;
+
+    fill_frame_range(job, fd, frame, row * BYTES_PER_ROW, sample_bytes,
+                     sample);
+    for (uint32_t j = 0; j < sample_bytes; j++)
+      counts[sample[j]]++;
+    sampled_png += measure_png_rows(
+        sample, PLAN_SAMPLE_ROWS,
+        frame_compression_level(sample, sample_bytes));
+    sampled += sample_bytes;
+  }
+  close_job_input(job, fd);
+  const double data_seconds = elapsed_seconds(&start);
+
+  // Le righe di riempimento sono zeri e si comprimono a parte
+  memset(sample, 0, sample_bytes);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  const uint64_t padding_png = measure_png_rows(
+      sample, PLAN_SAMPLE_ROWS, frame_compression_level(sample, sample_bytes));
+  const double padding_seconds = elapsed_seconds(&start);
+  free(sample);
+
+  const uint64_t data_bytes = data_rows * BYTES_PER_ROW;
+  const uint64_t padding_bytes =
+      layout.total_frames * PNG_TOTAL_BYTES - data_bytes;
+  const double data_ratio = (double)sampled_png / sampled;
+  const double padding_ratio = (double)padding_png / sample_bytes;
+  const double estimated_output =
+      data_ratio * data_bytes + padding_ratio * padding_bytes;
+  // Ogni worker codifica un frame alla volta, quindi più worker dei frame
+  // non servono
+  const uint32_t workers = layout.total_frames < n_workers
+                               ? (uint32_t)layout.total_frames
+                               : n_workers;
+  const double estimated_seconds =
+      (data_seconds / sampled * data_bytes +
+       padding_seconds / sample_bytes * padding_bytes) /
+      workers;
+
+  printf("Piano per %s\n", filename);
+  printf("  dimensione: %llu bytes, zone di zeri: %llu, dati nei frame: %llu "
+         "bytes\n",
+         job->file_size, job->n_zero_extents, layout.payload_size);
+  printf("  header: %u bytes\n", layout.header_length);
+  printf("  frame: %llu, ultimo frame con %u bytes (riga %u, colonna %u, "
+         "canale %u)\n",
+         layout.total_frames, layout.bytes_last_frame,
+         layout.bytes_last_frame / BYTES_PER_ROW,
+         (layout.bytes_last_frame % BYTES_PER_ROW) / BYTES_PER_PIXEL,
+         layout.bytes_last_frame % BYTES_PER_PIXEL);
+  printf("  riempimento: %llu bytes (%.2f%% dei pixel)\n",
+         layout.padding_bytes,
+         100.0 * layout.padding_bytes /
+             ((double)layout.total_frames * PNG_TOTAL_BYTES));
+  printf("  entropia campionata: %.3f bit/byte su %llu bytes\n",
+         byte_entropy(counts, sampled), sampled);
+  printf("  output stimato: %.0f bytes (%.1f%% dei pixel)\n",
+         estimated_output,
+         100.0 * estimated_output /
+             ((double)layout.total_frames * PNG_TOTAL_BYTES));
+  printf("  tempo stimato: %.3f s con %u worker (%.1f MB/s per worker sui "
+         "dati)\n",
+         estimated_seconds, workers,
+         data_seconds > 0 ? sampled / data_seconds / 1e6 : 0.0);
+
+  destroy_job(job);
+}
+
+// Percorso del profilo: quello di --profile oppure "$HOME/.d2v_profile". La
+// stringa va liberata, NULL se non c'è una home.
+char *profile_path(const char *profile_filename) {
+  if (profile_filename)
+    return strdup(profile_filename);
+  const char *home = getenv("HOME");
+  if (!home)
+    return NULL;
+  char *path = (char *)malloc(strlen(home) + strlen(PROFILE_FILENAME) + 2);
+  if (!path) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  sprintf(path, "%s/%s", home, PROFILE_FILENAME);
+  return path;
+}
+
+// Legge il profilo di --tune. Ritorna FALSE se manca o non è valido, in quel
+// caso si usano i valori di default.
+uint8_t load_profile(const char *filename, profile_t *loaded) {
+  FILE *fp = fopen(filename, "r");
+  if (!fp)
+    return FALSE;
+  char magic[16] = {0};
+  memset(loaded, 0, sizeof(profile_t));
+  const uint8_t is_valid =
+      fscanf(fp,
+             "%15s workers %u in_flight %u io_chunk %u level_low %d "
+             "level_mid %d level_high %d deflate_mbps %lf write_mbps %lf "
+             "pack_mbps %lf",
+             magic, &loaded->workers, &loaded->in_flight, &loaded->io_chunk,
+             &loaded->levels[0], &loaded->levels[1], &loaded->levels[2],
+             &loaded->deflate_mbps, &loaded->write_mbps,
+             &loaded->pack_mbps) == 10 &&
+      strcmp(magic, PROFILE_MAGIC) == 0 && loaded->workers > 0 &&
+      loaded->in_flight >= 1 && loaded->in_flight <= WRITER_QUEUE_MAX &&
+      loaded->io_chunk >= BUFFER_SIZE && loaded->io_chunk <= PNG_TOTAL_BYTES;
+  fclose(fp);
+  for (uint32_t band = 0; is_valid && band < ENTROPY_BANDS; band++)
+    if (loaded->levels[band] < Z_NO_COMPRESSION ||
+        loaded->levels[band] > Z_BEST_COMPRESSION)
+      return FALSE;
+  loaded->loaded = is_valid;
+  return is_valid;
+}
+
+// Salva il profilo, prima in un file temporaneo e poi con un rename()
+void write_profile(const char *filename, const profile_t *tuned) {
+  char *tmp_filename = append_suffix(filename, TMP_SUFFIX);
+  FILE *fp = fopen(tmp_filename, "w");
+  if (!fp) {
+    perror(tmp_filename);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(fp,
+          "%s\nworkers %u\nin_flight %u\nio_chunk %u\nlevel_low %d\n"
+          "level_mid %d\nlevel_high %d\ndeflate_mbps %.1f\nwrite_mbps %.1f\n"
+          "pack_mbps %.1f\n",
+          PROFILE_MAGIC, tuned->workers, tuned->in_flight, tuned->io_chunk,
+          tuned->levels[0], tuned->levels[1], tuned->levels[2],
+          tuned->deflate_mbps, tuned->write_mbps, tuned->pack_mbps);
+  if (durability != DURABILITY_NONE) {
+    if (fflush(fp) != 0) {
+      perror(filename);
+      exit(EXIT_FAILURE);
+    }
+    sync_fd(fileno(fp), tmp_filename);
+  }
+  if (fclose(fp) != 0 || rename(tmp_filename, filename) != 0) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+  if (durability != DURABILITY_NONE)
+    sync_parent_directory(filename);
+  free(tmp_filename);
+}
+
+// Riempie 'sample' con dati sintetici della fascia di entropia 'band': dati
+// sparsi (quasi tutti zeri), testo e dati casuali (già compressi o cifrati)
+void fill_tune_sample(png_bytep sample, const uint32_t length,
+                      const uint32_t band) {
+  unsigned int seed = 1 + band;
+  for (uint32_t i = 0; i < length; i++) {
+    const int r = rand_r(&seed);
+    if (band == 0)
+      sample[i] = r % 10 == 0 ? (r >> 8) % 16 : 0;
+    else if (band == 1)
+      // lettere con frequenze diverse, le prime molto più probabili
+      sample[i] = " etaoinshrdlucmfwypvbgkqjxz"[((r % 27) * ((r >> 8) % 27)) /
+                                               27];
+    else
+      sample[i] = r >> 7;
+  }
+}
+
+// Comprime il campione con 'level' per almeno TUNE_SECONDS. Ritorna i bytes
+// compressi al secondo e in 'ratio' il rapporto tra output e input.
+double tune_deflate(png_bytep sample, const int level, double *ratio) {
+  uint64_t input = 0, output = 0;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  double seconds;
+  do {
+    output += measure_png_rows(sample, TUNE_SAMPLE_ROWS, level);
+    input += TUNE_SAMPLE_ROWS * BYTES_PER_ROW;
+    seconds = elapsed_seconds(&start);
+  } while (seconds < TUNE_SECONDS);
+  if (ratio)
+    *ratio = (double)output / input;
+  return input / seconds;
+}
+
+struct TUNE_THREAD {
+  pthread_t thread;
+  png_bytep sample;
+  int level;
+  double bytes_per_second;
+} typedef tune_thread_t;
+
+void *tune_thread_main(void *arg) {
+  tune_thread_t *tune = (tune_thread_t *)arg;
+  tune->bytes_per_second = tune_deflate(tune->sample, tune->level, NULL);
+  return NULL;
+}
+
+// Throughput complessivo di 'n_threads' thread che comprimono insieme
+double tune_parallel_deflate(png_bytep sample, const int level,
+                             const uint32_t n_threads) {
+  tune_thread_t *threads =
+      (tune_thread_t *)calloc(n_threads, sizeof(tune_thread_t));
+  if (!threads) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < n_threads; i++) {
+    threads[i].sample = sample;
+    threads[i].level = level;
+    if (pthread_create(&threads[i].thread, NULL, tune_thread_main,
+                       &threads[i]) != 0) {
+      perror("pthread_create error: ");
+      exit(EXIT_FAILURE);
+    }
+  }
+  double total = 0.0;
+  for (uint32_t i = 0; i < n_threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    total += threads[i].bytes_per_second;
+  }
+  free(threads);
+  return total;
+}
+
+// --tune: calibra l'encoder su questa macchina e salva il profilo caricato a
+// ogni avvio. Misura la compressione di dati sintetici di diversa entropia a
+// vari livelli, quanti worker servono prima che aggiungerne non renda più,
+// la scrittura su disco in 'directory' (velocità e variabilità della
+// latenza) e la lettura dell'input nei frame con blocchi di varie dimensioni.
+void run_tune(const char *directory, const char *profile_filename) {
+  static const int levels[] = {1, 3, 6, 9};
+  static const uint32_t chunks[] = {4096, 65536, 262144, 1048576, 4194304};
+  static const char *band_names[] = {"dati sparsi", "testo",
+                                     "dati casuali"};
+  const uint32_t n_levels = sizeof(levels) / sizeof(levels[0]);
+  const uint32_t n_chunks = sizeof(chunks) / sizeof(chunks[0]);
+  const uint32_t sample_bytes = TUNE_SAMPLE_ROWS * BYTES_PER_ROW;
+
+  char *filename = profile_path(profile_filename);
+  if (!filename) {
+    printf("Manca HOME, indicare il profilo con --profile <file>\n");
+    exit(EXIT_FAILURE);
+  }
+  profile_t tuned;
+  memset(&tuned, 0, sizeof(tuned));
+  printf("Calibrazione per %s\n", filename);
+
+  // Compressione per ogni fascia di entropia e ogni livello, su un thread
+  png_bytep samples[ENTROPY_BANDS];
+  double speed[ENTROPY_BANDS][4], ratio[ENTROPY_BANDS][4];
+  for (uint32_t band = 0; band < ENTROPY_BANDS; band++) {
+    samples[band] = (png_bytep)malloc(sample_bytes);
+    if (!samples[band]) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+    fill_tune_sample(samples[band], sample_bytes, band);
+    uint64_t counts[256] = {0};
+    for (uint32_t i = 0; i < sample_bytes; i++)
+      counts[samples[band][i]]++;
+    printf("  deflate su %s (%.2f bit/byte):", band_names[band],
+           byte_entropy(counts, sample_bytes));
+    for (uint32_t l = 0; l < n_levels; l++) {
+      speed[band][l] = tune_deflate(samples[band], levels[l], &ratio[band][l]);
+      printf(" livello %d %.1f MB/s %.1f%%%s", levels[l], speed[band][l] / 1e6,
+             100.0 * ratio[band][l], l + 1 < n_levels ? "," : "\n");
+    }
+  }
+
+  // Worker: il minimo che dà almeno il 90% del throughput migliore, misurato
+  // sul testo al livello di default
+  const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  double best = 0.0, scaling[64];
+  uint32_t candidates[64], n_candidates = 0;
+  for (uint32_t n = 1;; n *= 2) {
+    candidates[n_candidates++] = n < n_cpus ? n : n_cpus;
+    if (n >= n_cpus || n_candidates == 63)
+      break;
+  }
+  printf("  worker:");
+  for (uint32_t i = 0; i < n_candidates; i++) {
+    scaling[i] = tune_parallel_deflate(samples[1], 6, candidates[i]);
+    if (scaling[i] > best)
+      best = scaling[i];
+    printf(" %u -> %.1f MB/s%s", candidates[i], scaling[i] / 1e6,
+           i + 1 < n_candidates ? "," : "\n");
+  }
+  double parallel = best;
+  for (uint32_t i = 0; i < n_candidates; i++)
+    if (scaling[i] >= 0.9 * best) {
+      tuned.workers = candidates[i];
+      parallel = scaling[i];
+      break;
+    }
+  // quanto rendono i worker scelti rispetto a uno solo
+  const double speedup = parallel / speed[1][2];
+  tuned.deflate_mbps = parallel / 1e6;
+
+  // Disco: TUNE_IO_FRAMES frame scritti e sincronizzati uno alla volta
+  char *io_filename =
+      (char *)malloc(strlen(directory) + strlen("/d2v_tune") + 1);
+  if (!io_filename) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  sprintf(io_filename, "%s/d2v_tune", directory);
+  const int fd = open(io_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(io_filename);
+    exit(EXIT_FAILURE);
+  }
+  png_bytep frame = frame_buffer_acquire(TRUE);
+  for (uint64_t i = 0; i < PNG_TOTAL_BYTES; i += sample_bytes)
+    memcpy(&frame[i], samples[2],
+           PNG_TOTAL_BYTES - i < sample_bytes ? PNG_TOTAL_BYTES - i
+                                              : sample_bytes);
+  double write_seconds = 0.0, fastest = 0.0, slowest = 0.0;
+  for (uint64_t i = 0; i < TUNE_IO_FRAMES; i++) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!write_buffered_file(fd, frame, i * PNG_TOTAL_BYTES,
+                             PNG_TOTAL_BYTES)) {
+      perror(io_filename);
+      exit(EXIT_FAILURE);
+    }
+    sync_fd(fd, io_filename);
+    const double seconds = elapsed_seconds(&start);
+    write_seconds += seconds;
+    if (i == 0 || seconds < fastest)
+      fastest = seconds;
+    if (seconds > slowest)
+      slowest = seconds;
+  }
+  const double write_speed =
+      (double)TUNE_IO_FRAMES * PNG_TOTAL_BYTES / write_seconds;
+  tuned.write_mbps = write_speed / 1e6;
+  // Frame in volo: abbastanza per coprire una scrittura lenta come la più
+  // lenta vista senza fermare i worker
+  tuned.in_flight = (uint32_t)ceil(slowest / fastest) + 1;
+  if (tuned.in_flight < WRITER_QUEUE_DEPTH)
+    tuned.in_flight = WRITER_QUEUE_DEPTH;
+  if (tuned.in_flight > WRITER_QUEUE_MAX)
+    tuned.in_flight = WRITER_QUEUE_MAX;
+  printf("  scrittura: %.1f MB/s, un frame in %.3f - %.3f s -> %u frame in "
+         "volo\n",
+         tuned.write_mbps, fastest, slowest, tuned.in_flight);
+
+  // Lettura dell'input nei frame (dalla cache, come quando un file è appena
+  // stato scritto): il blocco più piccolo entro il 5% del migliore
+  double pack_speed[sizeof(chunks) / sizeof(chunks[0])], best_pack = 0.0;
+  printf("  lettura nei frame:");
+  for (uint32_t c = 0; c < n_chunks; c++) {
+    io_chunk_size = chunks[c];
+    uint64_t bytes = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double seconds;
+    do {
+      read_buffered_file(fd, frame, (bytes / PNG_TOTAL_BYTES % TUNE_IO_FRAMES) *
+                                        PNG_TOTAL_BYTES,
+                         PNG_TOTAL_BYTES);
+      bytes += PNG_TOTAL_BYTES;
+      seconds = elapsed_seconds(&start);
+    } while (seconds < TUNE_SECONDS);
+    pack_speed[c] = bytes / seconds;
+    if (pack_speed[c] > best_pack)
+      best_pack = pack_speed[c];
+    printf(" %u KB %.1f MB/s%s", chunks[c] / 1024, pack_speed[c] / 1e6,
+           c + 1 < n_chunks ? "," : "\n");
+  }
+  for (uint32_t c = 0; c < n_chunks; c++)
+    if (pack_speed[c] >= 0.95 * best_pack) {
+      tuned.io_chunk = chunks[c];
+      tuned.pack_mbps = pack_speed[c] / 1e6;
+      break;
+    }
+  io_chunk_size = BUFFER_SIZE;
+  frame_buffer_release(frame);
+  close(fd);
+  unlink(io_filename);
+  free(io_filename);
+
+  // Livello per fascia: compressione e scrittura lavorano in parallelo, quindi
+  // il tempo per byte di input è quello della più lenta delle due. A parità
+  // (entro il 2%) si sceglie il livello più basso, che lascia CPU libera.
+  for (uint32_t band = 0; band < ENTROPY_BANDS; band++) {
+    double cost[4], best_cost = 0.0;
+    for (uint32_t l = 0; l < n_levels; l++) {
+      const double deflate_cost = 1.0 / (speed[band][l] * speedup);
+      const double write_cost = ratio[band][l] / write_speed;
+      cost[l] = deflate_cost > write_cost ? deflate_cost : write_cost;
+      if (l == 0 || cost[l] < best_cost)
+        best_cost = cost[l];
+    }
+    for (uint32_t l = 0; l < n_levels; l++)
+      if (cost[l] <= 1.02 * best_cost) {
+        tuned.levels[band] = levels[l];
+        break;
+      }
+    free(samples[band]);
+  }
+
+  write_profile(filename, &tuned);
+  printf("Profilo salvato in %s: %u worker, %u frame in volo, blocchi da %u "
+         "KB, livelli %d/%d/%d (sparsi/testo/casuali)\n",
+         filename, tuned.workers, tuned.in_flight, tuned.io_chunk / 1024,
+         tuned.levels[0], tuned.levels[1], tuned.levels[2]);
+  free(filename);
+}
+
+// Aggiunge una copia di 'path' alla lista degli input, raddoppiando la
+// capacità se serve
+void add_batch_input(char ***inputs, uint64_t *count, uint64_t *capacity,
+                     const char *path) {
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    *inputs = (char **)realloc(*inputs, sizeof(char *) * *capacity);
+    if (!*inputs) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+  }
+  (*inputs)[*count] = strdup(path);
+  if (!(*inputs)[*count]) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  (*count)++;
+}
+
+// Legge la lista degli input: se l'argomento contiene caratteri jolly viene
+// espanso con glob(), altrimenti è un file con un percorso per riga ("-" per
+// leggere da stdin)
+char **collect_batch_inputs(const char *list_or_pattern, uint64_t *n_inputs) {
+  char **inputs = NULL;
+  uint64_t count = 0, capacity = 0;
+
+  if (strpbrk(list_or_pattern, "*?[") != NULL) {
+    glob_t glob_result;
+    if (glob(list_or_pattern, 0, NULL, &glob_result) == 0) {
+      for (size_t i = 0; i < glob_result.gl_pathc; i++)
+        add_batch_input(&inputs, &count, &capacity, glob_result.gl_pathv[i]);
+    }
+    globfree(&glob_result);
+  } else {
+    FILE *list = strcmp(list_or_pattern, "-") == 0
+                     ? stdin
+                     : fopen(list_or_pattern, "r");
+    if (!list) {
+      perror(list_or_pattern);
+      exit(EXIT_FAILURE);
+    }
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), list)) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0')
+        continue;
+      add_batch_input(&inputs, &count, &capacity, line);
+    }
+    if (list != stdin)
+      fclose(list);
+  }
+
+  *n_inputs = count;
+  return inputs;
+}
+
+// Converte tanti file insieme: i frame di tutti gli input finiscono nello
+// stesso pool, alternati tra un file e l'altro, così i file piccoli riempiono
+// i buchi lasciati da quelli grandi e nessun core resta fermo alla fine.
+// L'output di ogni input è "<output dir>/<nome input>_<n>.png".
+void run_batch(const char *list_or_pattern, const char *output_dir,
+               const uint32_t n_workers) {
+  uint64_t n_inputs = 0;
+  char **inputs = collect_batch_inputs(list_or_pattern, &n_inputs);
+  if (n_inputs == 0) {
+    printf("Nessun file di input\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (mkdir(output_dir, 0755) != 0 && errno != EEXIST) {
+    perror(output_dir);
+    exit(EXIT_FAILURE);
+  }
+
+  job_t **jobs =
+      (job_t **)calloc(n_inputs, sizeof(job_t *));
+  if (!jobs) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t n_jobs = 0, max_frames = 0, input_bytes = 0;
+  for (uint64_t i = 0; i < n_inputs; i++) {
+    const char *name = strrchr(inputs[i], '/');
+    name = name ? name + 1 : inputs[i];
+
+    char *base_output_filename =
+        (char *)malloc(strlen(output_dir) + strlen(name) + 2);
+    if (!base_output_filename) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+    sprintf(base_output_filename, "%s/%s", output_dir, name);
+
+    // Due input con lo stesso nome si sovrascriverebbero i frame a vicenda
+    for (uint64_t j = 0; j < n_jobs; j++) {
+      if (strcmp(jobs[j]->frames_base, base_output_filename) == 0) {
+        printf("Due input producono lo stesso output: %s\n",
+               base_output_filename);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    job_t *job = create_job(inputs[i], -1, base_output_filename);
+    free(base_output_filename);
+    if (!job) {
+      printf("File not found, salto: %s\n", inputs[i]);
+      continue;
+    }
+
+    jobs[n_jobs++] = job;
+    input_bytes += job->file_size;
+    if (job->header_info.total_frames > max_frames)
+      max_frames = job->header_info.total_frames;
+  }
+
+  printf("Batch: %llu file, %llu bytes, %u worker\n", n_jobs, input_bytes,
+         n_workers);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  thread_pool_t *pool = pool_create(n_workers);
+  for (uint64_t frame = 0; frame < max_frames; frame++) {
+    for (uint64_t j = 0; j < n_jobs; j++) {
+      if (frame < jobs[j]->header_info.total_frames)
+        pool_submit(pool, jobs[j], frame);
+    }
+  }
+  pool_wait_idle(pool);
+  sync_flush();
+
+  pool_print_stats(pool, input_bytes, elapsed_seconds(&start));
+  print_sync_stats();
+  pool_destroy(pool);
+
+  for (uint64_t j = 0; j < n_jobs; j++) {
+    write_merkle(jobs[j]);
+    destroy_job(jobs[j]);
+  }
+  free(jobs);
+  for (uint64_t i = 0; i < n_inputs; i++)
+    free(inputs[i]);
+  free(inputs);
+}
+
+// Ricostruisce il file originale a partire dai frame "<base>_<n>.png"
+void decode_file(const char *frames_base, const char *output_filename,
+                 const uint32_t n_workers) {
+  job_t *job = create_decode_job(frames_base, output_filename, -1);
+  if (!job) {
+    printf("Frame 0 mancante o non valido\n");
+    exit(ERROR_DECODE);
+  }
+
+  if (verbose) {
+    printf("Total frames: %llu\n", job->header_info.total_frames);
+    printf("Dimensione del file = %llu bytes\n", job->file_size);
+    printf("Extension: %.*s\n", job->ext_length,
+           (const char *)&job->header[HEADER_INFO_LENGTH]);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  thread_pool_t *pool = pool_create(n_workers);
+  for (uint64_t frame = 0; frame < job->header_info.total_frames; frame++)
+    pool_submit(pool, job, frame);
+  pool_wait_idle(pool);
+
+  // Il file ricostruito va su disco prima di dire che la decodifica è finita
+  if (durability != DURABILITY_NONE) {
+    struct timespec sync_start;
+    clock_gettime(CLOCK_MONOTONIC, &sync_start);
+    sync_fd(job->fd, output_filename);
+    sync_parent_directory(output_filename);
+    record_latency(&sync_stats, elapsed_seconds(&sync_start), FALSE);
+  }
+
+  pool_print_stats(pool, job->payload_size, elapsed_seconds(&start));
+  print_sync_stats();
+  pool_destroy(pool);
+
+  const uint8_t failed = job->failed;
+  destroy_job(job);
+  if (failed) {
+    printf("Decodifica incompleta, alcuni frame non sono validi\n");
+    exit(ERROR_DECODE);
+  }
+}
+
+// File virtuale: un archivio di frame letto come un file normale, con pread,
+// read e seek sulle posizioni del file originale, senza ricostruirlo su
+// disco. I frame decodificati restano in una cache LRU con un tetto di
+// memoria. Quando le letture sono sequenziali un thread decodifica in
+// anticipo i frame successivi. Le funzioni si possono chiamare da più thread.
+enum CACHE_STATE {
+  CACHE_EMPTY,
+  CACHE_LOADING,
+  CACHE_READY
+} typedef cache_state_t;
+
+// Un frame decodificato (e decifrato) nella cache
+struct CACHE_ENTRY {
+  uint64_t frame;
+  png_bytep data; // buffer del pool dei frame, allocato al primo uso
+  cache_state_t state;
+  uint32_t pins;      // letture che stanno copiando da questo frame
+  uint64_t last_used; // per scegliere il frame da buttare
+  uint8_t prefetched; // decodificato in anticipo e non ancora letto
+} typedef cache_entry_t;
+
+struct VFILE_STATS {
+  uint64_t hits, misses;     // frame trovati nella cache o da decodificare
+  uint64_t prefetched;       // frame decodificati in anticipo
+  uint64_t prefetch_used;    // di questi, quelli poi letti
+  uint64_t evictions;
+} typedef vfile_stats_t;
+
+struct VIRTUAL_FILE {
+  job_t *job;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;   // un frame è pronto o non è più in uso
+  pthread_cond_t readahead; // ci sono frame da decodificare in anticipo
+  cache_entry_t *entries;
+  uint32_t n_entries, readahead_frames;
+  uint64_t tick;
+  uint64_t position;                   // per read() e seek()
+  uint64_t last_end;                   // fine dell'ultima lettura
+  uint32_t sequential;                 // letture sequenziali consecutive
+  uint64_t readahead_next, readahead_end; // frame da decodificare in anticipo
+  pthread_t readahead_thread;
+  uint8_t shutdown;
+  vfile_stats_t stats;
+} typedef virtual_file_t;
+
+// Decodifica un frame nel suo buffer, come decode_frame() ma senza scriverlo
+uint8_t load_cache_entry(const job_t *job, const uint64_t frame,
+                         png_bytep data) {
+  char *frame_filename = job_frame_filename(job, frame);
+  TRACE_BEGIN(decode);
+  uint8_t is_valid = read_png_file(frame_filename, data, height) &&
+                     check_frame_tag(job, frame, data);
+  TRACE_END(decode);
+  if (is_valid && job->cipher != AEAD_NONE) {
+    TRACE_BEGIN(decrypt);
+    is_valid = open_frame(job, frame, data);
+    TRACE_END(decrypt);
+  }
+  if (!is_valid)
+    fprintf(stderr, "Frame non valido: %s\n", frame_filename);
+  free(frame_filename);
+  return is_valid;
+}
+
+// Frame nella cache, NULL se non c'è. Da chiamare con il lock.
+cache_entry_t *find_cache_entry(virtual_file_t *file, const uint64_t frame) {
+  for (uint32_t i = 0; i < file->n_entries; i++)
+    if (file->entries[i].state != CACHE_EMPTY &&
+        file->entries[i].frame == frame)
+      return &file->entries[i];
+  return NULL;
+}
+
+// Posto per un nuovo frame: uno vuoto oppure quello usato meno di recente tra
+// quelli che nessuno sta leggendo o decodificando. NULL se sono tutti
+// occupati. Da chiamare con il lock.
+cache_entry_t *evict_cache_entry(virtual_file_t *file) {
+  cache_entry_t *victim = NULL;
+  for (uint32_t i = 0; i < file->n_entries; i++) {
+    cache_entry_t *entry = &file->entries[i];
+    if (entry->state == CACHE_EMPTY) {
+      victim = entry;
+      break;
+    }
+    if (entry->state == CACHE_READY && entry->pins == 0 &&
+        (!victim || entry->last_used < victim->last_used))
+      victim = entry;
+  }
+  if (victim && victim->state != CACHE_EMPTY)
+    file->stats.evictions++;
+  if (victim && !victim->data)
+    victim->data = frame_buffer_acquire(FALSE);
+  return victim;
+}
+
+// Decodifica 'frame' in 'entry' senza il lock, poi segna il risultato. Un
+// frame non valido lascia il posto vuoto, così si può riprovare.
+uint8_t fill_cache_entry(virtual_file_t *file, cache_entry_t *entry,
+                         const uint64_t frame, const uint8_t prefetched) {
+  entry->frame = frame;
+  entry->state = CACHE_LOADING;
+  entry->prefetched = prefetched;
+  entry->last_used = ++file->tick;
+  pthread_mutex_unlock(&file->lock);
+  const uint8_t is_valid = load_cache_entry(file->job, frame, entry->data);
+  pthread_mutex_lock(&file->lock);
+  entry->state = is_valid ? CACHE_READY : CACHE_EMPTY;
+  if (is_valid && prefetched)
+    file->stats.prefetched++;
+  pthread_cond_broadcast(&file->changed);
+  return is_valid;
+}
+
+void *readahead_main(void *arg) {
+  virtual_file_t *file = (virtual_file_t *)arg;
+  trace_thread_name("readahead");
+  pthread_mutex_lock(&file->lock);
+  while (!file->shutdown) {
+    if (file->readahead_next >= file->readahead_end) {
+      pthread_cond_wait(&file->readahead, &file->lock);
+      continue;
+    }
+    const uint64_t frame = file->readahead_next++;
+    if (find_cache_entry(file, frame))
+      continue;
+    cache_entry_t *entry = evict_cache_entry(file);
+    // cache piena di frame in uso, la lettura in anticipo può aspettare
+    if (!entry) {
+      file->readahead_next = file->readahead_end;
+      continue;
+    }
+    current_trace_frame = frame;
+    fill_cache_entry(file, entry, frame, TRUE);
+    current_trace_frame = -1;
+  }
+  pthread_mutex_unlock(&file->lock);
+  return NULL;
+}
+
+// Apre l'archivio "<base>_<n>.png" come file virtuale, con al massimo
+// 'cache_bytes' di frame decodificati in memoria (almeno 3 frame). Ritorna
+// NULL se il frame 0 manca o non è valido.
+virtual_file_t *vfile_open(const char *frames_base,
+                           const uint64_t cache_bytes) {
+  job_t *job = allocate_job(JOB_DECODE, frames_base, -1, frames_base);
+  if (!load_frame_header(job)) {
+    destroy_job(job);
+    return NULL;
+  }
+
+  virtual_file_t *file = (virtual_file_t *)calloc(1, sizeof(virtual_file_t));
+  if (!file) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  file->job = job;
+  file->n_entries = cache_bytes / FRAME_BUFFER_SIZE;
+  if (file->n_entries < 3)
+    file->n_entries = 3;
+  // due posti restano per il frame che si sta leggendo e quello prima
+  file->readahead_frames = file->n_entries - 2 < VFILE_READAHEAD_FRAMES
+                               ? file->n_entries - 2
+                               : VFILE_READAHEAD_FRAMES;
+  file->entries =
+      (cache_entry_t *)calloc(file->n_entries, sizeof(cache_entry_t));
+  if (!file->entries) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_init(&file->lock, NULL);
+  pthread_cond_init(&file->changed, NULL);
+  pthread_cond_init(&file->readahead, NULL);
+  if (pthread_create(&file->readahead_thread, NULL, readahead_main, file) !=
+      0) {
+    perror("pthread_create error: ");
+    exit(EXIT_FAILURE);
+  }
+  return file;
+}
+
+// Dimensione del file originale
+uint64_t vfile_size(const virtual_file_t *file) {
+  return file->job->file_size;
+}
+
+// Converte una posizione nel file originale nella posizione nei dati salvati.
+// Ritorna FALSE se la posizione cade in una zona di zeri. In 'contiguous' ci
+// sono i bytes fino al prossimo cambio (inizio o fine di una zona).
+uint8_t logical_to_payload(const job_t *job, const uint64_t logical,
+                           uint64_t *payload, uint64_t *contiguous) {
+  // ricerca binaria della prima zona che finisce dopo 'logical'
+  uint64_t low = 0, high = job->n_zero_extents;
+  while (low < high) {
+    const uint64_t middle = low + (high - low) / 2;
+    const zero_extent_t *extent = &job->zero_extents[middle];
+    if (extent->offset + extent->length <= logical)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low < job->n_zero_extents && job->zero_extents[low].offset <= logical) {
+    const zero_extent_t *extent = &job->zero_extents[low];
+    *contiguous = extent->offset + extent->length - logical;
+    return FALSE;
+  }
+  const uint64_t next = low < job->n_zero_extents
+                            ? job->zero_extents[low].offset
+                            : job->file_size;
+  *contiguous = next - logical;
+  *payload = low > 0 ? job->zero_extents[low - 1].payload_offset +
+                           (logical - job->zero_extents[low - 1].offset -
+                            job->zero_extents[low - 1].length)
+                     : logical;
+  return TRUE;
+}
+
+// Copia 'length' bytes dal frame 'frame' a partire da 'start' (posizione nel
+// frame), decodificandolo se non è nella cache. Ritorna FALSE se il frame
+// non è valido.
+uint8_t copy_from_frame(virtual_file_t *file, const uint64_t frame,
+                        const uint32_t start, const uint32_t length,
+                        uint8_t *dest) {
+  pthread_mutex_lock(&file->lock);
+  cache_entry_t *entry;
+  for (;;) {
+    entry = find_cache_entry(file, frame);
+    if (entry && entry->state == CACHE_LOADING) {
+      pthread_cond_wait(&file->changed, &file->lock);
+      continue;
+    }
+    if (entry) {
+      file->stats.hits++;
+      break;
+    }
+    entry = evict_cache_entry(file);
+    if (!entry) {
+      pthread_cond_wait(&file->changed, &file->lock);
+      continue;
+    }
+    file->stats.misses++;
+    if (!fill_cache_entry(file, entry, frame, FALSE)) {
+      pthread_mutex_unlock(&file->lock);
+      return FALSE;
+    }
+    break;
+  }
+  if (entry->prefetched) {
+    entry->prefetched = FALSE;
+    file->stats.prefetch_used++;
+  }
+  entry->pins++;
+  entry->last_used = ++file->tick;
+  pthread_mutex_unlock(&file->lock);
+
+  memcpy(dest, &entry->data[start], length);
+
+  pthread_mutex_lock(&file->lock);
+  if (--entry->pins == 0)
+    pthread_cond_broadcast(&file->changed);
+  pthread_mutex_unlock(&file->lock);
+  return TRUE;
+}
+
+// Come pread(): legge fino a 'length' bytes dalla posizione 'offset' del file
+// originale. Ritorna i bytes letti (0 alla fine del file) oppure -1 con errno
+// a EIO se un frame manca o non è valido.
+ssize_t vfile_pread(virtual_file_t *file, void *buffer, size_t length,
+                    const uint64_t offset) {
+  const job_t *job = file->job;
+  if (offset >= job->file_size)
+    return 0;
+  if (length > job->file_size - offset)
+    length = job->file_size - offset;
+
+  uint8_t *dest = (uint8_t *)buffer;
+  uint64_t done = 0, last_frame = 0;
+  while (done < length) {
+    uint64_t payload, contiguous;
+    const uint8_t in_data =
+        logical_to_payload(job, offset + done, &payload, &contiguous);
+    uint64_t n = contiguous < length - done ? contiguous : length - done;
+    if (!in_data) {
+      memset(&dest[done], 0, n);
+      done += n;
+      continue;
+    }
+    // posizione nel frame: i dati di ogni frame iniziano dopo la firma, e nel
+    // frame 0 anche dopo l'header
+    const uint32_t data_capacity = job->frame_capacity - job->tag_length;
+    const uint64_t position = payload + job->header_length;
+    const uint64_t frame = position / data_capacity;
+    const uint32_t start = job->tag_length + position % data_capacity;
+    if (n > job->frame_capacity - start)
+      n = job->frame_capacity - start;
+    if (!copy_from_frame(file, frame, start, n, &dest[done])) {
+      errno = EIO;
+      return -1;
+    }
+    last_frame = frame;
+    done += n;
+  }
+
+  // Dopo VFILE_SEQUENTIAL_READS letture una di seguito all'altra si
+  // decodificano in anticipo i frame successivi all'ultimo letto
+  pthread_mutex_lock(&file->lock);
+  file->sequential = offset == file->last_end ? file->sequential + 1 : 0;
+  file->last_end = offset + length;
+  if (file->sequential >= VFILE_SEQUENTIAL_READS &&
+      file->readahead_frames > 0) {
+    const uint64_t total_frames = job->header_info.total_frames;
+    file->readahead_next = last_frame + 1;
+    file->readahead_end = last_frame + 1 + file->readahead_frames;
+    if (file->readahead_end > total_frames)
+      file->readahead_end = total_frames;
+    pthread_cond_signal(&file->readahead);
+  }
+  pthread_mutex_unlock(&file->lock);
+  return length;
+}
+
+// Come read(): legge dalla posizione corrente e la sposta in avanti
+ssize_t vfile_read(virtual_file_t *file, void *buffer, const size_t length) {
+  pthread_mutex_lock(&file->lock);
+  const uint64_t position = file->position;
+  pthread_mutex_unlock(&file->lock);
+  const ssize_t n = vfile_pread(file, buffer, length, position);
+  if (n > 0) {
+    pthread_mutex_lock(&file->lock);
+    file->position = position + n;
+    pthread_mutex_unlock(&file->lock);
+  }
+  return n;
+}
+
+// Come lseek(), con SEEK_SET, SEEK_CUR e SEEK_END. Ritorna la nuova posizione
+// oppure -1 con errno a EINVAL.
+int64_t vfile_seek(virtual_file_t *file, const int64_t offset,
+                   const int whence) {
+  pthread_mutex_lock(&file->lock);
+  int64_t base = 0;
+  if (whence == SEEK_CUR)
+    base = file->position;
+  else if (whence == SEEK_END)
+    base = file->job->file_size;
+  const int64_t position = base + offset;
+  if ((whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) ||
+      position < 0) {
+    pthread_mutex_unlock(&file->lock);
+    errno = EINVAL;
+    return -1;
+  }
+  file->position = position;
+  pthread_mutex_unlock(&file->lock);
+  return position;
+}
+
+void vfile_get_stats(virtual_file_t *file, vfile_stats_t *stats) {
+  pthread_mutex_lock(&file->lock);
+  *stats = file->stats;
+  pthread_mutex_unlock(&file->lock);
+}
+
+void vfile_close(virtual_file_t *file) {
+  pthread_mutex_lock(&file->lock);
+  file->shutdown = TRUE;
+  pthread_cond_signal(&file->readahead);
+  pthread_mutex_unlock(&file->lock);
+  pthread_join(file->readahead_thread, NULL);
+
+  for (uint32_t i = 0; i < file->n_entries; i++)
+    if (file->entries[i].data)
+      frame_buffer_release(file->entries[i].data);
+  free(file->entries);
+  pthread_mutex_destroy(&file->lock);
+  pthread_cond_destroy(&file->changed);
+  pthread_cond_destroy(&file->readahead);
+  destroy_job(file->job);
+  free(file);
+}
+
+// --cat: scrive su stdout i bytes [offset, offset + length) del file
+// archiviato (tutto il file con length < 0) leggendolo come file virtuale.
+// Le statistiche della cache vanno su stderr.
+void cat_file(const char *frames_base, const uint64_t offset,
+              const int64_t length, const uint64_t cache_bytes) {
+  virtual_file_t *file = vfile_open(frames_base, cache_bytes);
+  if (!file) {
+    fprintf(stderr, "Frame 0 mancante o non valido\n");
+    exit(ERROR_DECODE);
+  }
+  uint8_t *buffer = (uint8_t *)malloc(VFILE_CAT_CHUNK);
+  if (!buffer) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  vfile_seek(file, offset, SEEK_SET);
+  uint64_t remaining = length < 0 ? UINT64_MAX : (uint64_t)length;
+  uint64_t copied = 0;
+  while (remaining > 0) {
+    const ssize_t n = vfile_read(
+        file, buffer, remaining < VFILE_CAT_CHUNK ? remaining : VFILE_CAT_CHUNK);
+    if (n < 0) {
+      perror(frames_base);
+      exit(ERROR_DECODE);
+    }
+    if (n == 0)
+      break;
+    if (fwrite(buffer, 1, n, stdout) != (size_t)n) {
+      perror("stdout");
+      exit(EXIT_FAILURE);
+    }
+    copied += n;
+    remaining -= n;
+  }
+  fflush(stdout);
+
+  vfile_stats_t stats;
+  vfile_get_stats(file, &stats);
+  const double seconds = elapsed_seconds(&start);
+  fprintf(stderr,
+          "Cache: %llu bytes in %.3f s -> %.1f MB/s, %llu hit, %llu miss, "
+          "%llu frame decodificati in anticipo (%llu usati), %llu buttati, "
+          "%u frame in cache\n",
+          copied, seconds, seconds > 0 ? copied / seconds / 1e6 : 0.0,
+          stats.hits, stats.misses, stats.prefetched, stats.prefetch_used,
+          stats.evictions, file->n_entries);
+  free(buffer);
+  vfile_close(file);
+}
+
+// Crea il job di verifica con la disposizione dei frame salvata nell'indice,
+// ritorna NULL se l'indice non è coerente
+job_t *create_verify_job(const char *frames_base,
+                         const merkle_info_t *info) {
+  job_t *job = allocate_job(JOB_VERIFY, frames_base, -1, frames_base);
+  job->stripe = read_manifest(frames_base);
+  job->header_info.total_frames = info->total_frames;
+  job->header_info.last_frame = info->total_frames - 1;
+  job->frame_capacity = info->frame_capacity;
+  job->header_length = info->header_length;
+  job->tag_length = info->tag_length;
+  job->payload_size = info->payload_size;
+  if (plan_layout(job->payload_size, job->header_length, job->frame_capacity,
+                  job->tag_length)
+          .total_frames != job->header_info.total_frames) {
+    destroy_job(job);
+    return NULL;
+  }
+
+  job->frame_done = (uint8_t *)calloc(info->total_frames, sizeof(uint8_t));
+  job->frame_corrupt = (uint8_t *)calloc(info->total_frames, sizeof(uint8_t));
+  if (!job->frame_done || !job->frame_corrupt) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  return job;
+}
+
+// Verifica un solo frame: ne calcola l'hash e risale fino alla radice con i
+// fratelli letti dall'indice, quindi legge solo log2(n) nodi
+uint8_t verify_single_frame(job_t *job, const merkle_info_t *info,
+                            const uint64_t frame) {
+  png_bytep image_data = frame_buffer_acquire(TRUE);
+  uint8_t hash[HASH_LENGTH], node[HASH_LENGTH];
+  const uint8_t is_readable = compute_frame_hash(job, frame, image_data, hash);
+  frame_buffer_release(image_data);
+  if (!is_readable) {
+    printf("Frame %llu: mancante o non leggibile\n", frame);
+    return FALSE;
+  }
+  if (!read_merkle_node(info, frame, node)) {
+    printf("Indice Merkle non valido\n");
+    return FALSE;
+  }
+  const uint8_t leaf_matches = memcmp(hash, node, HASH_LENGTH) == 0;
+
+  uint64_t nodes_read = 1;
+  uint64_t index = frame, level_start = 0;
+  for (uint64_t size = info->total_frames; size > 1; size = (size + 1) / 2) {
+    const uint64_t sibling = index ^ 1;
+    if (sibling < size) {
+      if (!read_merkle_node(info, level_start + sibling, node)) {
+        printf("Indice Merkle non valido\n");
+        return FALSE;
       }
-      exit(EXIT_SUCCESS);*/
-    }
-
-    /*if (chunk != 0) {
-      printf("Bytes rimanenti: %llu\n", remaining_bytes);
-      exit(EXIT_SUCCESS);
-    }*/
-
-    // Numero di buffers necessari per leggere i rimanenti bytes
-    uint16_t total_buffers =
-        ceil((double)current_frame_bytes_to_read / BUFFER_SIZE);
-    printf("Total buffers: %u\n", total_buffers);
-    printf("Current frame, bytes to reads from file: %u\n",
-           current_frame_bytes_to_read);
-    uint8_t *buffer = NULL;
-    uint16_t byte_to_reads = 0;
-    // punto al byte successivo a tutte le informazioni iniziali
-    uint32_t byte_pointer = (chunk == 0) ? HEADER_INFO_LENGTH + ext_length : 0;
-    for (uint16_t i = 0; i < total_buffers; i++) {
-      // leggo al massimo 4096 byte, se ce ne sono meno leggo solo quelli che
-      // rimangono
-      if (BUFFER_SIZE > current_frame_bytes_to_read)
-        byte_to_reads = current_frame_bytes_to_read;
+      nodes_read++;
+      if (index & 1)
+        merkle_parent(node, hash, hash);
       else
-        byte_to_reads = BUFFER_SIZE;
+        merkle_parent(hash, node, hash);
+    }
+    level_start += size;
+    index /= 2;
+  }
+
+  if (!leaf_matches) {
+    printf("Frame %llu: corrotto\n", frame);
+    return FALSE;
+  }
+  if (memcmp(hash, info->root, HASH_LENGTH) != 0) {
+    printf("Frame %llu: l'hash è quello dell'indice ma il percorso non porta "
+           "alla radice, l'indice Merkle è rovinato\n",
+           frame);
+    return FALSE;
+  }
+  printf("Frame %llu: integro (%llu nodi letti su %llu frame)\n", frame,
+         nodes_read, info->total_frames);
+  return TRUE;
+}
+
+// --verify: controlla i frame con l'albero di Merkle di "<base>.merkle", tutti
+// in parallelo con il pool oppure solo 'single_frame' se è >= 0. Stampa gli
+// intervalli di frame corrotti ed esce con ERROR_VERIFY se ce ne sono.
+void verify_file(const char *frames_base, const uint32_t n_workers,
+                 const long long single_frame) {
+  merkle_info_t info;
+  if (!open_merkle(frames_base, &info)) {
+    printf("Indice Merkle mancante o non valido: %s%s\n", frames_base,
+           MERKLE_SUFFIX);
+    exit(ERROR_VERIFY);
+  }
+  job_t *job = create_verify_job(frames_base, &info);
+  if (!job) {
+    printf("Indice Merkle non valido: %s%s\n", frames_base, MERKLE_SUFFIX);
+    exit(ERROR_VERIFY);
+  }
+  printf("Radice Merkle: ");
+  print_hash(stdout, info.root);
+  printf("\n");
+
+  if (single_frame >= 0) {
+    const uint8_t is_valid =
+        (uint64_t)single_frame < info.total_frames &&
+        verify_single_frame(job, &info, single_frame);
+    if ((uint64_t)single_frame >= info.total_frames)
+      printf("Il frame %lld non esiste, i frame sono %llu\n", single_frame,
+             info.total_frames);
+    fclose(info.fp);
+    destroy_job(job);
+    if (!is_valid)
+      exit(ERROR_VERIFY);
+    return;
+  }
+
+  // Le foglie devono portare alla radice, altrimenti è l'indice ad essere
+  // rovinato e non si può dire niente dei frame
+  job->leaf_hashes = (uint8_t *)malloc(info.total_frames * HASH_LENGTH);
+  if (!job->leaf_hashes) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  uint8_t is_valid = TRUE;
+  for (uint64_t frame = 0; is_valid && frame < info.total_frames; frame++)
+    is_valid = read_merkle_node(&info, frame,
+                                &job->leaf_hashes[frame * HASH_LENGTH]);
+  fclose(info.fp);
+  if (is_valid) {
+    uint64_t n_nodes;
+    uint8_t *tree =
+        build_merkle_tree(job->leaf_hashes, info.total_frames, &n_nodes);
+    is_valid = memcmp(&tree[(n_nodes - 1) * HASH_LENGTH], info.root,
+                      HASH_LENGTH) == 0;
+    free(tree);
+  }
+  if (!is_valid) {
+    printf("Le foglie non portano alla radice, l'indice Merkle è rovinato\n");
+    exit(ERROR_VERIFY);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  thread_pool_t *pool = pool_create(n_workers);
+  for (uint64_t frame = 0; frame < info.total_frames; frame++)
+    pool_submit(pool, job, frame);
+  pool_wait_idle(pool);
+  pool_print_stats(pool, job->payload_size, elapsed_seconds(&start));
+  pool_destroy(pool);
+
+  // Intervalli di frame corrotti consecutivi
+  uint64_t corrupt = 0;
+  for (uint64_t frame = 0; frame < info.total_frames; frame++) {
+    if (!job->frame_corrupt[frame])
+      continue;
+    uint64_t last = frame;
+    while (last + 1 < info.total_frames && job->frame_corrupt[last + 1])
+      last++;
+    if (last == frame)
+      printf("Frame corrotto: %llu\n", frame);
+    else
+      printf("Frame corrotti: da %llu a %llu\n", frame, last);
+    corrupt += last - frame + 1;
+    frame = last;
+  }
+  destroy_job(job);
 
-      buffer = read_buffered_file(fp, &byte_to_reads);
-      current_frame_bytes_to_read -= byte_to_reads;
-      remaining_bytes -= byte_to_reads;
+  if (corrupt > 0) {
+    printf("Verifica fallita: %llu frame corrotti su %llu\n", corrupt,
+           info.total_frames);
+    exit(ERROR_VERIFY);
+  }
+  printf("Verifica completata: %llu frame integri\n", info.total_frames);
+}
+
+// Un'immagine della cartella di --salvage e la firma letta dalla sua prima
+// riga, se ce l'ha. L'hash del file serve solo per le immagini con la stessa
+// firma di un'altra.
+struct SALVAGE_ENTRY {
+  char *filename;
+  uint8_t tagged;
+  frame_tag_t tag;
+  uint8_t needs_hash, hashed;
+  uint8_t hash[HASH_LENGTH];
+} typedef salvage_entry_t;
+
+// Lettura in parallelo: ogni thread prende la prossima immagine non ancora
+// letta. Nel primo passaggio si legge la prima riga, nel secondo l'hash dei
+// file con la stessa firma.
+struct SALVAGE_SCAN {
+  salvage_entry_t *entries;
+  uint64_t n_entries, next;
+  uint8_t hash_pass;
+  pthread_mutex_t lock;
+} typedef salvage_scan_t;
+
+// Controlla la firma PNG senza aprire il file con libpng, così le immagini di
+// altri formati (e gli altri file) non producono errori
+uint8_t is_png_file(const char *filename) {
+  uint8_t signature[8];
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return FALSE;
+  const uint8_t is_png = read(fd, signature, sizeof(signature)) ==
+                             sizeof(signature) &&
+                         png_sig_cmp(signature, 0, sizeof(signature)) == 0;
+  close(fd);
+  return is_png;
+}
+
+// SHA-256 di un file intero. Ritorna FALSE se non si legge.
+uint8_t hash_file(const char *filename, uint8_t *hash) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return FALSE;
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+    fprintf(stderr, "Errore nell'inizializzazione di SHA-256\n");
+    exit(EXIT_FAILURE);
+  }
+  uint8_t buffer[BUFFER_SIZE * 16];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    hash_update(ctx, buffer, n);
+  close(fd);
+  hash_end(ctx, hash);
+  return n == 0;
+}
 
-      // Per fare prima e non stampare i valori intermedi
-      if (i < 2 || !(i < total_buffers - 2))
-        printf("Buffer numero %4d, bytes letti: %u\n", i, byte_to_reads);
+void *salvage_scan_main(void *arg) {
+  salvage_scan_t *scan = (salvage_scan_t *)arg;
+  trace_thread_name("salvage");
+  uint8_t first_row[BYTES_PER_ROW];
+  for (;;) {
+    pthread_mutex_lock(&scan->lock);
+    const uint64_t index = scan->next++;
+    pthread_mutex_unlock(&scan->lock);
+    if (index >= scan->n_entries)
+      break;
+    salvage_entry_t *entry = &scan->entries[index];
+    if (scan->hash_pass) {
+      if (entry->needs_hash) {
+        TRACE_BEGIN(hash);
+        entry->hashed = hash_file(entry->filename, entry->hash);
+        TRACE_END(hash);
+      }
+      continue;
+    }
+    TRACE_BEGIN(decode);
+    entry->tagged = is_png_file(entry->filename) &&
+                    read_png_file(entry->filename, first_row, 1) &&
+                    parse_frame_tag(first_row, &entry->tag);
+    TRACE_END(decode);
+  }
+  return NULL;
+}
 
-      // salvo il buffer di dati che ho appena letto
-      for (uint16_t j = 0; j < byte_to_reads; j++)
-        image_data[byte_pointer++] = buffer[j];
+// Esegue un passaggio di lettura su tutte le immagini con 'n_threads' thread
+void run_salvage_pass(salvage_scan_t *scan, const uint32_t n_threads,
+                      const uint8_t hash_pass) {
+  scan->next = 0;
+  scan->hash_pass = hash_pass;
+  pthread_t *threads = (pthread_t *)malloc(n_threads * sizeof(pthread_t));
+  if (n_threads > 0 && !threads) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < n_threads; i++)
+    if (pthread_create(&threads[i], NULL, salvage_scan_main, scan) != 0) {
+      perror("pthread_create error: ");
+      exit(EXIT_FAILURE);
+    }
+  for (uint32_t i = 0; i < n_threads; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
 
-      free(buffer);
-      buffer = NULL;
+// I file della cartella, ordinati per nome così l'esito non dipende
+// dall'ordine di readdir(). Le stringhe e l'array vanno liberati.
+salvage_entry_t *list_salvage_files(const char *directory,
+                                    uint64_t *n_entries) {
+  DIR *dir = opendir(directory);
+  if (!dir) {
+    perror(directory);
+    exit(ERROR_SALVAGE);
+  }
+  salvage_entry_t *entries = NULL;
+  uint64_t capacity = 0;
+  *n_entries = 0;
+  struct dirent *dirent;
+  while ((dirent = readdir(dir)) != NULL) {
+    if (dirent->d_name[0] == '.')
+      continue;
+    const int length =
+        snprintf(NULL, 0, "%s/%s", directory, dirent->d_name);
+    char *filename = (char *)malloc(length + 1);
+    if (!filename) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+    snprintf(filename, length + 1, "%s/%s", directory, dirent->d_name);
+    struct stat st;
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+      free(filename);
+      continue;
+    }
+    if (*n_entries == capacity) {
+      capacity = capacity ? 2 * capacity : 1024;
+      entries = (salvage_entry_t *)realloc(
+          entries, capacity * sizeof(salvage_entry_t));
+      if (!entries) {
+        perror("malloc error: ");
+        exit(EXIT_FAILURE);
+      }
     }
+    memset(&entries[*n_entries], 0, sizeof(salvage_entry_t));
+    entries[(*n_entries)++].filename = filename;
+  }
+  closedir(dir);
+  return entries;
+}
+
+static int compare_salvage_names(const void *a, const void *b) {
+  return strcmp(((const salvage_entry_t *)a)->filename,
+                ((const salvage_entry_t *)b)->filename);
+}
 
-    /*for (uint32_t i = 0; i < HEADER_INFO_LENGTH + ext_length; i++) {
-      printf("[%4d]: %3u -> %s -> %02X\n", i, image_data[i],
-             uint8_t_to_binary_string(image_data[i]), image_data[i]);
-    }*/
+// Prima le immagini con la firma, raggruppate per archivio e ordinate per
+// numero del frame. A parità di frame resta l'ordine dei nomi (qsort non è
+// stabile, quindi il nome è l'ultimo criterio).
+static int compare_salvage_frames(const void *a, const void *b) {
+  const salvage_entry_t *x = (const salvage_entry_t *)a;
+  const salvage_entry_t *y = (const salvage_entry_t *)b;
+  if (x->tagged != y->tagged)
+    return x->tagged ? -1 : 1;
+  if (x->tagged && x->tag.archive_id != y->tag.archive_id)
+    return x->tag.archive_id < y->tag.archive_id ? -1 : 1;
+  if (x->tagged && x->tag.sequence != y->tag.sequence)
+    return x->tag.sequence < y->tag.sequence ? -1 : 1;
+  return strcmp(x->filename, y->filename);
+}
 
-    char *output_filename = (char *)malloc(sizeof(char));
-    sprintf(output_filename, "%s_%llu.png", base_output_filename, chunk);
-    write_png_file(output_filename);
+// SHA-256 dei pixel di un frame, per i doppioni ricompressi diversamente.
+// Ritorna FALSE se il frame non si decodifica.
+uint8_t hash_frame_pixels(const char *filename, png_bytep image_data,
+                          uint8_t *hash) {
+  if (!read_png_file(filename, image_data, height))
+    return FALSE;
+  return EVP_Digest(image_data, PNG_TOTAL_BYTES, hash, NULL, EVP_sha256(),
+                    NULL) == 1;
+}
 
-    free(output_filename);
-    output_filename = NULL;
+// Due immagini con la stessa firma sono doppioni se i file sono identici
+// oppure, se no, se lo sono i pixel (capita se sono state ricompresse)
+uint8_t same_frame(const salvage_entry_t *a, const salvage_entry_t *b) {
+  if (a->hashed && b->hashed && memcmp(a->hash, b->hash, HASH_LENGTH) == 0)
+    return TRUE;
+  uint8_t hash_a[HASH_LENGTH], hash_b[HASH_LENGTH];
+  png_bytep image_data = frame_buffer_acquire(TRUE);
+  const uint8_t same = hash_frame_pixels(a->filename, image_data, hash_a) &&
+                       hash_frame_pixels(b->filename, image_data, hash_b) &&
+                       memcmp(hash_a, hash_b, HASH_LENGTH) == 0;
+  frame_buffer_release(image_data);
+  return same;
+}
+
+// Mette il frame scelto al suo posto "<base>_<n>.png" con un link, o con un
+// link simbolico se la cartella di output è su un altro filesystem. Prima
+// si crea il link temporaneo di tutti i frame e solo dopo si rinominano (vedi
+// salvage_archive()), così un nome di output uguale a un'immagine letta non
+// fa mai perdere un frame.
+void link_salvaged_frame(const char *source, const char *tmp_filename) {
+  remove(tmp_filename);
+  if (link(source, tmp_filename) == 0)
+    return;
+  char *absolute = realpath(source, NULL);
+  if (!absolute || symlink(absolute, tmp_filename) != 0) {
+    perror(tmp_filename);
+    exit(ERROR_SALVAGE);
+  }
+  free(absolute);
+}
 
-    for (uint32_t i = 0; i < PNG_TOTAL_BYTES; i++) {
-      printf("[%8u]: %3u -> %s -> %02X\n", i, image_data[i],
-             uint8_t_to_binary_string(image_data[i]), image_data[i]);
+// Ricompone un archivio dalle sue immagini, già ordinate per frame: scarta i
+// doppioni, collega i frame trovati come "<base>_<n>.png" e stampa gli
+// intervalli mancanti. Ritorna il numero di frame mancanti.
+uint64_t salvage_archive(const salvage_entry_t *entries, const uint64_t count,
+                         const char *frames_base) {
+  const uint64_t total_frames = entries[0].tag.total_frames;
+  const salvage_entry_t **chosen = (const salvage_entry_t **)calloc(
+      total_frames, sizeof(salvage_entry_t *));
+  if (!chosen) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
 
-      // Per fare prima e non stampare tutti i valori intermedi
-      if (i == 25)
-        i = PNG_TOTAL_BYTES - 30;
+  uint64_t found = 0, duplicates = 0, conflicts = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    const salvage_entry_t *entry = &entries[i];
+    // Tutte le firme dello stesso archivio hanno lo stesso numero di frame,
+    // una diversa viene da un'immagine rovinata che per caso passa il CRC
+    if (entry->tag.total_frames != total_frames) {
+      printf("Firma incoerente, ignoro: %s\n", entry->filename);
+      continue;
+    }
+    const salvage_entry_t *first = chosen[entry->tag.sequence];
+    if (!first) {
+      chosen[entry->tag.sequence] = entry;
+      found++;
+    } else if (same_frame(first, entry)) {
+      duplicates++;
+    } else {
+      printf("Frame %llu: %s e %s sono diversi, tengo il primo\n",
+             entry->tag.sequence, first->filename, entry->filename);
+      conflicts++;
     }
   }
 
-  // Libero la memoria dell'immagine
-  free(image_data);
-  image_data = NULL;
-  fclose(fp);
+  char **tmp_filenames = (char **)calloc(total_frames, sizeof(char *));
+  if (!tmp_filenames) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  for (uint64_t frame = 0; frame < total_frames; frame++) {
+    if (!chosen[frame])
+      continue;
+    char *frame_filename = build_frame_filename(frames_base, frame);
+    tmp_filenames[frame] = append_suffix(frame_filename, TMP_SUFFIX);
+    link_salvaged_frame(chosen[frame]->filename, tmp_filenames[frame]);
+    free(frame_filename);
+  }
+  for (uint64_t frame = 0; frame < total_frames; frame++) {
+    if (!tmp_filenames[frame])
+      continue;
+    char *frame_filename = build_frame_filename(frames_base, frame);
+    if (rename(tmp_filenames[frame], frame_filename) != 0) {
+      perror(frame_filename);
+      exit(ERROR_SALVAGE);
+    }
+    free(frame_filename);
+    free(tmp_filenames[frame]);
+  }
+  free(tmp_filenames);
+  if (found > 0 && durability != DURABILITY_NONE) {
+    char *frame_filename = build_frame_filename(frames_base, 0);
+    sync_parent_directory(frame_filename);
+    free(frame_filename);
+  }
+
+  printf("Archivio %016llx -> %s: %llu frame su %llu, %llu doppioni "
+         "scartati, %llu in conflitto\n",
+         entries[0].tag.archive_id, frames_base, found, total_frames,
+         duplicates, conflicts);
+
+  // Intervalli di frame mancanti consecutivi
+  for (uint64_t frame = 0; frame < total_frames; frame++) {
+    if (chosen[frame])
+      continue;
+    uint64_t last = frame;
+    while (last + 1 < total_frames && !chosen[last + 1])
+      last++;
+    if (last == frame)
+      printf("Frame mancante: %llu\n", frame);
+    else
+      printf("Frame mancanti: da %llu a %llu\n", frame, last);
+    frame = last;
+  }
+  if (!chosen[0])
+    printf("Manca il frame 0 con l'header, i dati degli altri frame non "
+           "bastano per ricostruire il file\n");
+  free(chosen);
+  return total_frames - found;
+}
+
+// --salvage: cerca tra le immagini di una cartella (rinominate, in ordine
+// qualsiasi, con doppioni o buchi, ad esempio estratte da un video con
+// ffmpeg) i frame riconoscibili dalla firma, leggendo in parallelo solo la
+// prima riga di ognuna. I frame di ogni archivio vengono ordinati, i doppioni
+// scartati e quelli trovati collegati come "<base>_<n>.png", pronti per
+// --decode. Se nella cartella ci sono più archivi ognuno va in
+// "<base>-<identificativo>". Esce con ERROR_SALVAGE se manca qualche frame.
+void salvage_directory(const char *directory, const char *frames_base,
+                       const uint32_t n_workers) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  salvage_scan_t scan;
+  scan.entries = list_salvage_files(directory, &scan.n_entries);
+  pthread_mutex_init(&scan.lock, NULL);
+  if (scan.n_entries > 0)
+    qsort(scan.entries, scan.n_entries, sizeof(salvage_entry_t),
+          compare_salvage_names);
+  const uint32_t n_threads =
+      scan.n_entries < n_workers ? (uint32_t)scan.n_entries : n_workers;
+  run_salvage_pass(&scan, n_threads, FALSE);
+  const double seconds = elapsed_seconds(&start);
+
+  // I file con la stessa firma di un altro sono i soli da leggere per intero
+  uint64_t n_tagged = 0, n_archives = 0, n_hashed = 0;
+  if (scan.n_entries > 0)
+    qsort(scan.entries, scan.n_entries, sizeof(salvage_entry_t),
+          compare_salvage_frames);
+  for (uint64_t i = 0; i < scan.n_entries && scan.entries[i].tagged; i++) {
+    salvage_entry_t *entry = &scan.entries[i];
+    if (i == 0 || entry->tag.archive_id != entry[-1].tag.archive_id)
+      n_archives++;
+    else if (entry->tag.sequence == entry[-1].tag.sequence) {
+      n_hashed += !entry[-1].needs_hash + 1;
+      entry[-1].needs_hash = entry->needs_hash = TRUE;
+    }
+    n_tagged++;
+  }
+  printf("Salvage: %llu file letti in %.3f s (%.0f file/s) con %u thread, "
+         "%llu frame con la firma in %llu archivi\n",
+         scan.n_entries, seconds, seconds > 0 ? scan.n_entries / seconds : 0.0,
+         n_threads, n_tagged, n_archives);
+  if (n_hashed > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_salvage_pass(&scan, n_threads, TRUE);
+    printf("Salvage: hash di %llu frame con la stessa firma in %.3f s\n",
+           n_hashed, elapsed_seconds(&start));
+  }
+  pthread_mutex_destroy(&scan.lock);
+
+  uint64_t missing = 0;
+  for (uint64_t i = 0; i < n_tagged;) {
+    uint64_t j = i + 1;
+    while (j < n_tagged &&
+           scan.entries[j].tag.archive_id == scan.entries[i].tag.archive_id)
+      j++;
+    char *archive_base = NULL;
+    if (n_archives > 1) {
+      const int length = snprintf(NULL, 0, "%s-%016llx", frames_base,
+                                  scan.entries[i].tag.archive_id);
+      archive_base = (char *)malloc(length + 1);
+      if (!archive_base) {
+        perror("malloc error: ");
+        exit(EXIT_FAILURE);
+      }
+      snprintf(archive_base, length + 1, "%s-%016llx", frames_base,
+               scan.entries[i].tag.archive_id);
+    }
+    missing += salvage_archive(&scan.entries[i], j - i,
+                               archive_base ? archive_base : frames_base);
+    free(archive_base);
+    i = j;
+  }
+
+  for (uint64_t i = 0; i < scan.n_entries; i++)
+    free(scan.entries[i].filename);
+  free(scan.entries);
+
+  if (n_archives == 0) {
+    printf("Nessun frame con la firma in %s\n", directory);
+    exit(ERROR_SALVAGE);
+  }
+  if (missing > 0)
+    exit(ERROR_SALVAGE);
+}
+
+// Prende il frame live con numero 'sequence', aspettando che il frame che
+// usava lo stesso buffer sia stato scritto
+live_frame_t *acquire_live_frame(job_t *job, const uint64_t sequence) {
+  live_frame_t *slot = &job->live_frames[sequence % job->live_slots];
+  pthread_mutex_lock(&job->lock);
+  while (slot->busy)
+    pthread_cond_wait(&job->done, &job->lock);
+  slot->length = 0;
+  pthread_mutex_unlock(&job->lock);
+  return slot;
+}
+
+// Completa l'header del frame live, azzera il resto dell'ultima riga e lo
+// mette in coda per la scrittura
+void submit_live_frame(thread_pool_t *pool, job_t *job,
+                       const uint64_t sequence, live_frame_t *slot) {
+  uint8_t *sequence_splitted = split_uint64_t_into_bytes(sequence);
+  uint8_t *length_splitted = split_uint32_t_into_bytes(slot->length);
+  memcpy(slot->data, LIVE_MAGIC, 4);
+  memcpy(&slot->data[4], sequence_splitted, BYTES_INSIDE_INT64);
+  memcpy(&slot->data[4 + BYTES_INSIDE_INT64], length_splitted,
+         BYTES_INSIDE_INT32);
+  free(sequence_splitted);
+  free(length_splitted);
+
+  const uint32_t used = LIVE_HEADER_LENGTH + slot->length;
+  if (used % BYTES_PER_ROW != 0)
+    memset(&slot->data[used], 0, BYTES_PER_ROW - used % BYTES_PER_ROW);
+
+  pthread_mutex_lock(&job->lock);
+  slot->busy = TRUE;
+  pthread_mutex_unlock(&job->lock);
+  // il frame è già nel buffer dello slot, lo scrive un worker del suo nodo
+  pool_submit_node(pool, job, sequence,
+                   (sequence % job->live_slots) % numa.n_nodes);
+}
+
+// Tempo massimo che il primo byte di un frame può aspettare prima che il
+// frame venga scritto: la latenza voluta meno il tempo che serve per scriverlo
+double live_flush_deadline(job_t *job) {
+  pthread_mutex_lock(&job->lock);
+  double deadline = job->live_target - job->write_estimate;
+  pthread_mutex_unlock(&job->lock);
+  if (deadline < job->live_target * LIVE_MIN_DEADLINE_FRACTION)
+    deadline = job->live_target * LIVE_MIN_DEADLINE_FRACTION;
+  return deadline;
+}
+
+void print_live_stats(job_t *job, const uint64_t frames,
+                      const uint64_t input_bytes, const double seconds) {
+  double p50, p99, max;
+  latency_percentiles(&live_stats, &p50, &p99, &max);
+
+  pthread_mutex_lock(&job->lock);
+  const uint64_t over_target = job->over_target;
+  const double write_estimate = job->write_estimate;
+  pthread_mutex_unlock(&job->lock);
+
+  printf("Live: %llu frame, %llu bytes in %.3f s -> %.1f MB/s, latenza "
+         "p50 %.3f ms p99 %.3f ms max %.3f ms, %llu frame oltre %.0f ms, "
+         "scrittura %.3f ms\n",
+         frames, input_bytes, seconds,
+         seconds > 0 ? input_bytes / seconds / 1e6 : 0.0, p50 * 1e3,
+         p99 * 1e3, max * 1e3, over_target, job->live_target * 1e3,
+         write_estimate * 1e3);
+  fflush(stdout);
+}
+
+// Modalità live: legge un flusso (stdin con "-", oppure una FIFO o un socket)
+// e scrive frame numerati in sequenza "<base>_<n>.png". Un frame parte quando
+// arriva il suo primo byte e viene scritto quando è pieno o quando scade la
+// sua scadenza, così la latenza non dipende da quanto velocemente arrivano i
+// dati. Mentre i worker scrivono un frame si continua a leggere nel successivo.
+void run_live(const char *input_filename, const char *base_output_filename,
+              const uint32_t n_workers, const long target_ms) {
+  const int fd = strcmp(input_filename, "-") == 0
+                     ? STDIN_FILENO
+                     : open(input_filename, O_RDONLY);
+  if (fd < 0) {
+    perror(input_filename);
+    exit(ERROR_LIVE);
+  }
+
+  job_t *job = allocate_job(JOB_LIVE, input_filename, -1, base_output_filename);
+  job->live_target = target_ms / 1e3;
+  // un frame in più dei worker, così se ne riempie uno mentre gli altri
+  // vengono scritti
+  job->live_slots = n_workers + in_flight_frames - 1;
+  job->live_frames =
+      (live_frame_t *)calloc(job->live_slots, sizeof(live_frame_t));
+  if (!job->live_frames) {
+    perror("malloc error: ");
+    exit(EXIT_FAILURE);
+  }
+  // i buffer dei frame live restano occupati per tutto il flusso, quindi non
+  // aspettano il tetto della memoria (ci contano comunque). Sono distribuiti
+  // a turno sui nodi NUMA e ognuno viene scritto dai worker del suo nodo.
+  for (uint32_t i = 0; i < job->live_slots; i++)
+    job->live_frames[i].data =
+        frame_buffer_acquire_on(i % numa.n_nodes, FALSE);
+
+  thread_pool_t *pool = pool_create(n_workers);
+  printf("Live: latenza voluta %ld ms, %u worker\n", target_ms, n_workers);
+
+  struct timespec start, last_report;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  last_report = start;
+
+  uint64_t sequence = 0, input_bytes = 0;
+  live_frame_t *slot = acquire_live_frame(job, sequence);
+  uint8_t end_of_input = FALSE;
+  while (!end_of_input) {
+    // Se il frame ha già dei dati si aspetta al massimo fino alla sua
+    // scadenza, altrimenti fino al prossimo report
+    const double deadline = live_flush_deadline(job) - LIVE_POLL_RESOLUTION;
+    double wait = LIVE_REPORT_SECONDS - elapsed_seconds(&last_report);
+    if (slot->length > 0 &&
+        deadline - elapsed_seconds(&slot->first_arrival) < wait)
+      wait = deadline - elapsed_seconds(&slot->first_arrival);
+    const int timeout = wait > 0 ? (int)ceil(wait * 1e3) : 0;
+
+    struct pollfd input;
+    input.fd = fd;
+    input.events = POLLIN;
+    input.revents = 0;
+    const int ready = poll(&input, 1, timeout);
+    if (ready < 0 && errno != EINTR) {
+      perror("poll error: ");
+      exit(ERROR_LIVE);
+    }
+
+    if (ready > 0) {
+      const ssize_t received =
+          read(fd, &slot->data[LIVE_HEADER_LENGTH + slot->length],
+               LIVE_FRAME_CAPACITY - slot->length);
+      if (received < 0 && errno != EINTR && errno != EAGAIN) {
+        perror("read error: ");
+        exit(ERROR_INPUT_READ);
+      }
+      if (received == 0)
+        end_of_input = TRUE;
+      if (received > 0) {
+        if (slot->length == 0)
+          clock_gettime(CLOCK_MONOTONIC, &slot->first_arrival);
+        slot->length += received;
+        input_bytes += received;
+      }
+    }
+
+    if (slot->length > 0 &&
+        (slot->length == LIVE_FRAME_CAPACITY || end_of_input ||
+         elapsed_seconds(&slot->first_arrival) >= deadline)) {
+      submit_live_frame(pool, job, sequence, slot);
+      sequence++;
+      slot = acquire_live_frame(job, sequence);
+    }
+
+    if (elapsed_seconds(&last_report) >= LIVE_REPORT_SECONDS) {
+      print_live_stats(job, sequence, input_bytes, elapsed_seconds(&start));
+      clock_gettime(CLOCK_MONOTONIC, &last_report);
+    }
+  }
+
+  pool_wait_idle(pool);
+  sync_flush();
+  print_live_stats(job, sequence, input_bytes, elapsed_seconds(&start));
+  print_sync_stats();
+  pool_destroy(pool);
+
+  for (uint32_t i = 0; i < job->live_slots; i++)
+    frame_buffer_release(job->live_frames[i].data);
+  free(job->live_frames);
+  destroy_job(job);
+  if (fd != STDIN_FILENO)
+    close(fd);
+}
+
+// Ricostruisce il flusso live concatenando i frame in ordine di sequenza, si
+// ferma al primo frame che manca
+void decode_live(const char *frames_base, const char *output_filename) {
+  const int fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(output_filename);
+    exit(ERROR_DECODE);
+  }
+  png_bytep image_data = frame_buffer_acquire(TRUE);
+
+  uint64_t sequence = 0, output_bytes = 0;
+  for (;; sequence++) {
+    char *frame_filename = build_frame_filename(frames_base, sequence);
+    if (access(frame_filename, F_OK) != 0) {
+      free(frame_filename);
+      break;
+    }
+
+    // La prima riga dice quanti dati ci sono e quindi quante righe leggere
+    uint8_t is_valid = read_png_file(frame_filename, image_data, 1) &&
+                       memcmp(image_data, LIVE_MAGIC, 4) == 0 &&
+                       join_bytes_into_uint64_t(&image_data[4]) == sequence;
+    const uint32_t length =
+        is_valid ? join_bytes_into_uint32_t(&image_data[4 + BYTES_INSIDE_INT64])
+                 : 0;
+    if (is_valid && length <= LIVE_FRAME_CAPACITY) {
+      const int rows =
+          (LIVE_HEADER_LENGTH + length + BYTES_PER_ROW - 1) / BYTES_PER_ROW;
+      is_valid = read_png_file(frame_filename, image_data, rows) &&
+                 write_buffered_file(fd, &image_data[LIVE_HEADER_LENGTH],
+                                     output_bytes, length);
+    } else {
+      is_valid = FALSE;
+    }
+    if (!is_valid) {
+      fprintf(stderr, "Frame non valido: %s\n", frame_filename);
+      exit(ERROR_DECODE);
+    }
+    free(frame_filename);
+    output_bytes += length;
+  }
+
+  printf("Live: %llu frame, %llu bytes\n", sequence, output_bytes);
+  frame_buffer_release(image_data);
+  close(fd);
+}
+
+struct CONNECTION {
+  int client;
+  thread_pool_t *pool;
+} typedef connection_t;
+
+// Statistiche del demone, condivise da tutte le connessioni
+latency_stats_t daemon_stats = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Scrive nella risposta le statistiche: profondità della coda del pool e
+// percentili della latenza delle ultime richieste
+void format_daemon_stats(const thread_pool_t *pool, char *response,
+                         const size_t length) {
+  double p50, p99, max, sync_p50, sync_p99, sync_max;
+  latency_percentiles(&daemon_stats, &p50, &p99, &max);
+  latency_percentiles(&sync_stats, &sync_p50, &sync_p99, &sync_max);
+
+  pthread_mutex_lock(&daemon_stats.lock);
+  const uint64_t jobs_done = daemon_stats.count;
+  const uint64_t jobs_failed = daemon_stats.failed;
+  pthread_mutex_unlock(&daemon_stats.lock);
+
+  // Frame per nodo NUMA, separati da virgole. I worker aggiornano
+  // frames_processed con il lock del pool.
+  char node_frames[256] = "";
+  size_t used = 0;
+  pthread_mutex_lock((pthread_mutex_t *)&pool->lock);
+  const uint64_t queued = pool->queued, pending = pool->pending;
+  for (uint32_t node = 0; node < numa.n_nodes && used < sizeof(node_frames);
+       node++) {
+    uint64_t frames = 0;
+    for (uint32_t i = node; i < pool->n_workers; i += numa.n_nodes)
+      frames += pool->workers[i].frames_processed;
+    used += snprintf(&node_frames[used], sizeof(node_frames) - used, "%s%llu",
+                     node > 0 ? "," : "", frames);
+  }
+  pthread_mutex_unlock((pthread_mutex_t *)&pool->lock);
+
+  pthread_mutex_lock(&frame_pool.lock);
+  const uint64_t memory_bytes = frame_pool.allocated_bytes;
+  const uint64_t memory_waits = frame_pool.waits;
+  pthread_mutex_unlock(&frame_pool.lock);
+
+  snprintf(response, length,
+           "OK workers=%u queued=%llu pending=%llu jobs=%llu failed=%llu "
+           "p50_ms=%.3f p99_ms=%.3f max_ms=%.3f sync_p50_ms=%.3f "
+           "sync_p99_ms=%.3f memory_mb=%.1f memory_waits=%llu "
+           "numa_nodes=%u node_frames=%s\n",
+           pool->n_workers, queued, pending, jobs_done, jobs_failed,
+           p50 * 1e3, p99 * 1e3, max * 1e3, sync_p50 * 1e3, sync_p99 * 1e3,
+           memory_bytes / 1e6, memory_waits, numa.n_nodes, node_frames);
+}
+
+// Riceve una richiesta (una riga di testo) ed eventualmente un file
+// descriptor passato con SCM_RIGHTS. Ritorna FALSE quando il client chiude.
+uint8_t receive_request(const int client, char *request, int *fd) {
+  size_t length = 0;
+  *fd = -1;
+
+  while (length < DAEMON_REQUEST_MAX_LENGTH - 1) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    iov.iov_base = &request[length];
+    iov.iov_len = 1; // un byte alla volta, così non leggo la richiesta dopo
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    const ssize_t received = recvmsg(client, &msg, 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+      break;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+      if (*fd >= 0)
+        close(*fd);
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (request[length] == '\n') {
+      request[length] = '\0';
+      return TRUE;
+    }
+    length++;
+  }
+
+  if (*fd >= 0)
+    close(*fd);
+  return FALSE;
+}
+
+// Esegue una richiesta ENCODE o DECODE sul pool condiviso e aspetta che
+// finisca. Ritorna FALSE se non è stato possibile creare il job, altrimenti
+// il file descriptor passato (se usato) è stato chiuso insieme al job.
+uint8_t run_daemon_job(thread_pool_t *pool, const job_type_t type,
+                       const char *first, const char *second, int *fd,
+                       char *response, const size_t length) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // "-" indica di usare il file descriptor passato con la richiesta
+  const char *fd_argument = type == JOB_ENCODE ? first : second;
+  const int job_fd = strcmp(fd_argument, "-") == 0 ? *fd : -1;
+  if (strcmp(fd_argument, "-") == 0 && job_fd < 0)
+    return FALSE;
+
+  job_t *job = type == JOB_ENCODE ? create_job(first, job_fd, second)
+                                  : create_decode_job(first, second, job_fd);
+  if (!job)
+    return FALSE;
+  if (job_fd >= 0)
+    *fd = -1;
+
+  for (uint64_t frame = 0; frame < job->header_info.total_frames; frame++)
+    pool_submit(pool, job, frame);
+  job_wait(job);
+  if (type == JOB_DECODE && durability != DURABILITY_NONE) {
+    struct timespec sync_start;
+    clock_gettime(CLOCK_MONOTONIC, &sync_start);
+    sync_fd(job->fd, second);
+    record_latency(&sync_stats, elapsed_seconds(&sync_start), FALSE);
+  }
+
+  if (type == JOB_ENCODE)
+    write_merkle(job);
+
+  const double seconds = elapsed_seconds(&start);
+  const uint8_t failed = job->failed;
+  record_latency(&daemon_stats, seconds, failed);
+  snprintf(response, length, "%s frames=%llu bytes=%llu ms=%.3f\n",
+           failed ? "ERR" : "OK", job->header_info.total_frames,
+           job->file_size, seconds * 1e3);
+  destroy_job(job);
+  return TRUE;
+}
+
+// Gestisce una connessione: ogni riga è una richiesta e riceve una riga di
+// risposta. Richieste supportate (percorsi senza spazi, "-" = fd passato):
+//   ENCODE <input> <output base>
+//   DECODE <frames base> <output>
+//   STATS
+void *handle_connection(void *arg) {
+  connection_t *connection = (connection_t *)arg;
+  char request[DAEMON_REQUEST_MAX_LENGTH];
+  char response[256];
+  int fd = -1;
+
+  while (receive_request(connection->client, request, &fd)) {
+    char *save = NULL;
+    const char *command = strtok_r(request, " ", &save);
+    const char *first = strtok_r(NULL, " ", &save);
+    const char *second = strtok_r(NULL, " ", &save);
+
+    if (command && strcmp(command, "STATS") == 0) {
+      format_daemon_stats(connection->pool, response, sizeof(response));
+    } else if (command && first && second &&
+               (strcmp(command, "ENCODE") == 0 ||
+                strcmp(command, "DECODE") == 0)) {
+      const job_type_t type =
+          strcmp(command, "ENCODE") == 0 ? JOB_ENCODE : JOB_DECODE;
+      if (!run_daemon_job(connection->pool, type, first, second, &fd,
+                          response, sizeof(response)))
+        snprintf(response, sizeof(response), "ERR input non valido\n");
+    } else {
+      snprintf(response, sizeof(response), "ERR richiesta sconosciuta\n");
+    }
+
+    // un descriptor non usato dalla richiesta va chiuso qui
+    if (fd >= 0)
+      close(fd);
+    fd = -1;
+
+    if (write(connection->client, response, strlen(response)) < 0)
+      break;
+  }
+
+  close(connection->client);
+  free(connection);
+  return NULL;
+}
+
+// Modalità demone: il pool di worker (con i loro buffer dei frame) viene
+// creato una volta sola e resta pronto, così una richiesta piccola paga solo
+// il lavoro vero e non l'avvio del processo e le allocazioni
+void run_daemon(const char *socket_path, const uint32_t n_workers) {
+  // un client che chiude la connessione non deve terminare il demone
+  signal(SIGPIPE, SIG_IGN);
+
+  const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0) {
+    perror("socket error: ");
+    exit(ERROR_DAEMON);
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    printf("Percorso del socket troppo lungo\n");
+    exit(ERROR_DAEMON);
+  }
+  strcpy(address.sun_path, socket_path);
+  unlink(socket_path);
+
+  if (bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(server, SOMAXCONN) != 0) {
+    perror(socket_path);
+    exit(ERROR_DAEMON);
+  }
+
+  thread_pool_t *pool = pool_create(n_workers);
+  printf("Demone in ascolto su %s con %u worker\n", socket_path, n_workers);
+
+  for (;;) {
+    const int client = accept(server, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("accept error: ");
+      break;
+    }
+
+    connection_t *connection = (connection_t *)malloc(sizeof(connection_t));
+    if (!connection) {
+      perror("malloc error: ");
+      exit(EXIT_FAILURE);
+    }
+    connection->client = client;
+    connection->pool = pool;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handle_connection, connection) != 0) {
+      perror("pthread_create error: ");
+      close(client);
+      free(connection);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  pool_destroy(pool);
+  close(server);
+  unlink(socket_path);
 }
 
 // Non serve a molto questa funzione, è solo per debug
@@ -578,8 +6803,17 @@ void recover_filename(FILE *fp) {
   // Buffer per memorizzare il percorso del file
   char file_path[PATH_MAX];
 
-  // Ottieni il percorso del file associato al file descriptor
+  // Ottieni il percorso del file associato al file descriptor, F_GETPATH c'è
+  // solo su macOS, su linux si legge il link in /proc
+#if defined(F_GETPATH)
   if (fcntl(fd, F_GETPATH, file_path) != -1) {
+#else
+  char link[64];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  const ssize_t length = readlink(link, file_path, sizeof(file_path) - 1);
+  if (length >= 0) {
+    file_path[length] = '\0';
+#endif
     printf("Percorso assoluto del file: %s\n", file_path);
   } else {
     perror("Error getting file path");
@@ -672,23 +6906,337 @@ int delete_temp_dir(char *tmp_dirname) {
 }
 
 int main(int argc, char *argv[]) {
-  // Apre il file per la scrittura in modalità lettura binaria
-  FILE *fp = fopen(argv[1], "rb");
-  if (!fp) {
-    printf("File not found\n");
+  // Le opzioni iniziano con "--", il resto sono file di input e base di output
+  uint8_t resume = FALSE;
+  uint8_t batch = FALSE;
+  uint8_t decode = FALSE;
+  uint8_t daemon = FALSE;
+  uint8_t stream = FALSE;
+  uint8_t live = FALSE;
+  uint8_t plan = FALSE;
+  uint8_t verify = FALSE;
+  long long verify_frame_index = -1;
+  uint8_t cat = FALSE;
+  uint8_t salvage = FALSE;
+  long long cat_offset = 0, cat_length = -1; // -1 = fino alla fine
+  long cache_mb = VFILE_CACHE_DEFAULT_MB;
+  char *stripe_roots = NULL;
+  stripe_policy_t stripe_policy = STRIPE_ROUND_ROBIN;
+  uint8_t valid_policy = TRUE;
+  uint8_t valid_durability = TRUE;
+  char *key_filename = NULL;
+  aead_cipher_t forced_cipher = AEAD_NONE;
+  uint8_t valid_cipher = TRUE;
+  uint8_t valid_memory_limit = TRUE;
+  long numa_nodes = -1; // -1 = rileva la topologia
+  uint8_t tune = FALSE;
+  uint8_t use_profile = TRUE;
+  uint8_t threads_given = FALSE;
+  char *profile_filename = NULL;
+  uint8_t valid_numa = TRUE;
+  uint8_t valid_qos = TRUE;
+  long target_ms = LIVE_TARGET_DEFAULT_MS;
+  // Di default un worker per ogni core disponibile
+  long n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  char *input_filename = NULL;
+  char *base_output_filename = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--resume") == 0)
+      resume = TRUE;
+    else if (strcmp(argv[i], "--batch") == 0)
+      batch = TRUE;
+    else if (strcmp(argv[i], "--decode") == 0)
+      decode = TRUE;
+    else if (strcmp(argv[i], "--daemon") == 0)
+      daemon = TRUE;
+    else if (strcmp(argv[i], "--sparse") == 0)
+      sparse_scan = TRUE;
+    else if (strcmp(argv[i], "--stream") == 0)
+      stream = TRUE;
+    else if (strcmp(argv[i], "--live") == 0)
+      live = TRUE;
+    else if (strcmp(argv[i], "--plan") == 0)
+      plan = TRUE;
+    else if (strcmp(argv[i], "--verify") == 0)
+      verify = TRUE;
+    else if (strcmp(argv[i], "--cat") == 0)
+      cat = TRUE;
+    else if (strcmp(argv[i], "--salvage") == 0)
+      salvage = TRUE;
+    else if (strcmp(argv[i], "--offset") == 0 && i + 1 < argc)
+      cat_offset = strtoll(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--length") == 0 && i + 1 < argc)
+      cat_length = strtoll(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+      cache_mb = strtol(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--tune") == 0)
+      tune = TRUE;
+    else if (strcmp(argv[i], "--no-profile") == 0)
+      use_profile = FALSE;
+    else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+      profile_filename = argv[++i];
+    else if (strcmp(argv[i], "--frame") == 0 && i + 1 < argc)
+      verify_frame_index = strtoll(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--durability") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "none") == 0)
+        durability = DURABILITY_NONE;
+      else if (strcmp(argv[i], "batch") == 0)
+        durability = DURABILITY_BATCH;
+      else if (strcmp(argv[i], "strict") == 0)
+        durability = DURABILITY_STRICT;
+      else
+        valid_durability = FALSE;
+    } else if (strcmp(argv[i], "--sync-every") == 0 && i + 1 < argc) {
+      const long frames = strtol(argv[++i], NULL, 10);
+      if (frames < 1)
+        valid_durability = FALSE;
+      else
+        sync_every = frames;
+    } else if (strcmp(argv[i], "--stripe") == 0 && i + 1 < argc)
+      stripe_roots = argv[++i];
+    else if (strcmp(argv[i], "--stripe-policy") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "space") == 0)
+        stripe_policy = STRIPE_FREE_SPACE;
+      else if (strcmp(argv[i], "rr") != 0)
+        valid_policy = FALSE;
+    }
+    else if (strcmp(argv[i], "--memory-limit") == 0 && i + 1 < argc) {
+      const long megabytes = strtol(argv[++i], NULL, 10);
+      if (megabytes < 1)
+        valid_memory_limit = FALSE;
+      else
+        frame_pool.budget = (uint64_t)megabytes * 1000000;
+    } else if (strcmp(argv[i], "--numa") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "off") == 0)
+        numa_nodes = 0;
+      else if (strcmp(argv[i], "auto") != 0) {
+        numa_nodes = strtol(argv[i], NULL, 10);
+        if (numa_nodes < 1)
+          valid_numa = FALSE;
+      }
+    } else if (strcmp(argv[i], "--qos") == 0)
+      qos.enabled = TRUE;
+    else if ((strcmp(argv[i], "--qos-input") == 0 ||
+              strcmp(argv[i], "--qos-output") == 0) &&
+             i + 1 < argc) {
+      // come --memory-limit, 1 MB = 1 000 000 bytes
+      token_bucket_t *bucket =
+          strcmp(argv[i], "--qos-input") == 0 ? &qos.input : &qos.output;
+      const double megabytes = strtod(argv[++i], NULL);
+      if (megabytes <= 0)
+        valid_qos = FALSE;
+      bucket->limit = megabytes * 1e6;
+      qos.enabled = TRUE;
+    } else if (strcmp(argv[i], "--qos-workers") == 0 && i + 1 < argc) {
+      const long workers = strtol(argv[++i], NULL, 10);
+      if (workers < 1)
+        valid_qos = FALSE;
+      qos.max_workers = workers;
+      qos.enabled = TRUE;
+    } else if (strcmp(argv[i], "--qos-load") == 0 && i + 1 < argc) {
+      qos.load_threshold = strtod(argv[++i], NULL);
+      if (qos.load_threshold <= 0)
+        valid_qos = FALSE;
+      qos.enabled = TRUE;
+    } else if (strcmp(argv[i], "--qos-latency") == 0 && i + 1 < argc) {
+      qos.latency_threshold = strtod(argv[++i], NULL) / 1e3;
+      if (qos.latency_threshold <= 0)
+        valid_qos = FALSE;
+      qos.enabled = TRUE;
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+      trace_filename = argv[++i];
+    else if (strcmp(argv[i], "--key") == 0 && i + 1 < argc)
+      key_filename = argv[++i];
+    else if (strcmp(argv[i], "--cipher") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "aes") == 0)
+        forced_cipher = AEAD_AES_256_GCM;
+      else if (strcmp(argv[i], "chacha") == 0)
+        forced_cipher = AEAD_CHACHA20_POLY1305;
+      else if (strcmp(argv[i], "auto") != 0)
+        valid_cipher = FALSE;
+    }
+    else if (strcmp(argv[i], "--target") == 0 && i + 1 < argc)
+      target_ms = strtol(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      n_workers = strtol(argv[++i], NULL, 10);
+      threads_given = TRUE;
+    }
+    else if (!input_filename)
+      input_filename = argv[i];
+    else if (!base_output_filename)
+      base_output_filename = argv[i];
+  }
+
+  if ((tune                       ? base_output_filename != NULL
+       : daemon || plan || verify || cat ? !input_filename
+                                  : !input_filename || !base_output_filename) ||
+      n_workers < 1 || target_ms < 1 || batch + decode + daemon > 1 ||
+      ((resume || stream) && (batch || decode || daemon || live)) ||
+      (live && (batch || daemon || sparse_scan)) ||
+      (plan && (batch || decode || daemon || live || resume || stream)) ||
+      (stripe_roots && (batch || decode || daemon || live || plan ||
+                        resume || stream)) ||
+      (verify && (batch || decode || daemon || live || plan || resume ||
+                 stream || stripe_roots)) ||
+      (verify_frame_index != -1 && (!verify || verify_frame_index < 0)) ||
+      (tune && (batch || decode || daemon || live || plan || verify ||
+                resume || stream || stripe_roots || key_filename)) ||
+      (cat && (batch || decode || daemon || live || plan || verify ||
+               resume || stream || stripe_roots || tune)) ||
+      (salvage && (batch || decode || daemon || live || plan || verify ||
+                   resume || stream || stripe_roots || tune || cat ||
+                   key_filename)) ||
+      ((cat_offset != 0 || cat_length != -1 ||
+        cache_mb != VFILE_CACHE_DEFAULT_MB) &&
+       (!cat || cat_offset < 0 || cat_length < -1 || cache_mb < 1)) ||
+      (qos.enabled && (decode || live || plan || verify || cat || salvage ||
+                       tune)) ||
+      (key_filename && (live || plan || resume)) || !valid_policy ||
+      !valid_durability || !valid_cipher || !valid_memory_limit ||
+      !valid_numa || !valid_qos) {
+    printf("Usage: %s [--resume] [--sparse] [--stream | --threads N] "
+           "<input file> <output base>\n",
+           argv[0]);
+    printf("       %s [--sparse] [--threads N] --stripe <dir1,dir2,...> "
+           "[--stripe-policy rr|space] <input file> <output base>\n",
+           argv[0]);
+    printf("       %s --batch [--sparse] [--threads N] <file list|glob> "
+           "<output dir>\n",
+           argv[0]);
+    printf("       %s --decode [--threads N] <frames base> <output file>\n",
+           argv[0]);
+    printf("       %s --daemon [--threads N] <socket path>\n", argv[0]);
+    printf("       %s --live [--target ms] [--threads N] <input|-> "
+           "<output base>\n",
+           argv[0]);
+    printf("       %s --decode --live <frames base> <output file>\n",
+           argv[0]);
+    printf("       %s --plan [--sparse] [--threads N] <input file>\n",
+           argv[0]);
+    printf("       %s --verify [--threads N | --frame N] <frames base>\n",
+           argv[0]);
+    printf("       %s --cat [--offset N] [--length N] [--cache MB] "
+           "<frames base>\n",
+           argv[0]);
+    printf("       %s --salvage [--threads N] <cartella di immagini> "
+           "<frames base>\n",
+           argv[0]);
+    printf("       %s --tune [--profile <file>] [cartella di prova]\n",
+           argv[0]);
+    printf("  --durability none|batch|strict (e --sync-every N con batch) "
+           "vale per tutte le modalità che scrivono\n");
+    printf("  --memory-limit MB limita la memoria dei frame, i worker "
+           "aspettano invece di allocarne altra\n");
+    printf("  --profile <file> | --no-profile usa un altro profilo di --tune "
+           "(di default ~/%s) o nessuno\n",
+           PROFILE_FILENAME);
+    printf("  --numa auto|off|N fissa i worker sui nodi NUMA rilevati, "
+           "nessuno o N nodi ricavati dividendo le CPU\n");
+    printf("  --trace <file.json> salva le fasi di ogni frame per "
+           "chrome://tracing o Perfetto\n");
+    printf("  --key <file> [--cipher auto|aes|chacha] cifra i frame in "
+           "codifica e li verifica in decodifica (non con --live, --plan e "
+           "--resume)\n");
+    printf("  --qos [--qos-input MB] [--qos-output MB] [--qos-workers N] "
+           "[--qos-load X] [--qos-latency ms] codifica in background: "
+           "priorità idle, limiti in MB/s e meno worker quando il sistema è "
+           "carico\n");
     exit(EXIT_FAILURE);
   }
 
   // Inizializza il generatore di numeri casuali
   srand(time(NULL));
 
+  // La traccia viene scritta all'uscita, anche quando si esce per un errore
+  if (trace_filename) {
+    clock_gettime(CLOCK_MONOTONIC, &trace_origin);
+    trace_thread_name("main");
+    atexit(write_trace);
+  }
+
+  // Il profilo di --tune sostituisce i default, --threads vince comunque
+  if (use_profile && !tune) {
+    char *filename = profile_path(profile_filename);
+    if (filename && load_profile(filename, &profile)) {
+      if (!threads_given)
+        n_workers = profile.workers;
+      in_flight_frames = profile.in_flight;
+      io_chunk_size = profile.io_chunk;
+      if (verbose && !batch && !daemon && !plan && !cat)
+        printf("Profilo %s: %u worker, %u frame in volo, blocchi da %u KB\n",
+               filename, profile.workers, profile.in_flight,
+               profile.io_chunk / 1024);
+    } else if (profile_filename) {
+      printf("Profilo mancante o non valido: %s\n", profile_filename);
+      exit(EXIT_FAILURE);
+    }
+    free(filename);
+  }
+
+  detect_numa_topology(numa_nodes);
+  if (verbose && numa.n_nodes > 1 && !batch && !daemon && !plan && !cat)
+    printf("NUMA: %u nodi, worker distribuiti a turno\n", numa.n_nodes);
+
+  if (key_filename) {
+    load_aead_key(key_filename);
+    aead_cipher =
+        forced_cipher != AEAD_NONE ? forced_cipher : detect_aead_cipher();
+    if (verbose && !batch && !daemon && !decode && !cat)
+      printf("Cifratura dei frame: %s\n", aead_cipher_name(aead_cipher));
+  }
+
+  // Le soglie di --qos che non sono state date restano quelle di default
+  if (qos.enabled) {
+    if (qos.load_threshold == 0)
+      qos.load_threshold = QOS_LOAD_DEFAULT;
+    if (qos.latency_threshold == 0)
+      qos.latency_threshold = QOS_LATENCY_DEFAULT_MS / 1e3;
+    qos_start(n_workers);
+  }
+
   // printf("Size of png_byte: %lu\n", sizeof(png_byte));
   // printf("Size of png_bytep: %lu\n", sizeof(png_bytep));
   // printf("Extension length: %d\n", get_extension_length(argv[1]));
   // printf("Extension name: %s\n", get_extension_string(argv[1]));
   // printf("Stringa randomica: %s\n", generate_random_string(10));
 
-  convert_file(fp, argv[1], argv[2]);
+  if (batch) {
+    verbose = FALSE;
+    run_batch(input_filename, base_output_filename, n_workers);
+  } else if (decode && live) {
+    decode_live(input_filename, base_output_filename);
+  } else if (decode) {
+    decode_file(input_filename, base_output_filename, n_workers);
+  } else if (daemon) {
+    verbose = FALSE;
+    run_daemon(input_filename, n_workers);
+  } else if (plan) {
+    verbose = FALSE;
+    plan_file(input_filename, n_workers);
+  } else if (verify) {
+    verify_file(input_filename, n_workers, verify_frame_index);
+  } else if (salvage) {
+    verbose = FALSE;
+    salvage_directory(input_filename, base_output_filename, n_workers);
+  } else if (cat) {
+    verbose = FALSE;
+    cat_file(input_filename, cat_offset, cat_length,
+             (uint64_t)cache_mb * 1000000);
+  } else if (tune) {
+    run_tune(input_filename ? input_filename : ".", profile_filename);
+  } else if (live) {
+    verbose = FALSE;
+    // per la latenza conta più la velocità che la dimensione dei frame
+    compression_level = Z_BEST_SPEED;
+    run_live(input_filename, base_output_filename, n_workers, target_ms);
+  } else {
+    convert_file(input_filename, base_output_filename, resume, n_workers,
+                 stream, stripe_roots, stripe_policy);
+  }
 
   /*
   FILE *temp_fp = tmpfile();